@@ -0,0 +1,660 @@
+/*
+ * cache.c --
+ *   Process-wide cache of DNS query results.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+#include <stdio.h>
+#include <string.h>
+#include "tclsysdns.h"
+#include "cache.h"
+#include "cachefile.h"
+
+/*
+ * The cache is shared by all the interps (and threads) the package
+ * is loaded into. Result sets are kept as strings, so no Tcl objects
+ * ever cross thread boundaries: a lookup makes a fresh object out
+ * of the cached string rep.
+ *
+ * To let threads look up different names in parallel, the cache is
+ * split into a number of stripes, each being a complete cache (hash
+ * table, LRU list, counters) protected by its own mutex. A key is
+ * always handled by the stripe picked by the key's hash value, and
+ * the maximum size of the cache is evenly divided between stripes.
+ *
+ * Result sets are kept until the shortest TTL of the answer RRs
+ * they were made of runs out. Entries of a stripe are also linked
+ * into a list ordered by the time of their last use; when the
+ * stripe is full the least recently used entry is thrown away
+ * to make room for a new one.
+ *
+ * Negative answers (RFC 2308) are kept for the negative caching TTL.
+ * Those formatted as an empty result set (the answer section alone,
+ * parsed) do not depend on formatting and go under wildcard keys:
+ * NODATA is keyed by the name, class and type and NXDOMAIN -- by
+ * the name and class only, since a nonexistent name has no RRs of
+ * any type. Other negative result sets hold the question or the
+ * authority section, or are raw replies, and are keyed like
+ * positive ones.
+ *
+ * If a cache file is configured, entries are also written through
+ * to it and entries missing from memory are looked up there, which
+ * lets a restarted process pick up the answers cached by its
+ * predecessor (see cachefile.c).
+ */
+
+#define CACHE_NSTRIPES 64    /* Must be a power of 2 */
+#define CACHE_DEF_SIZE 4096
+
+#define KEY_ANYTYPE  0  /* Not a valid QTYPE */
+#define KEY_ANYFLAGS 0  /* Not a valid set of formatting flags */
+
+typedef struct CacheEntry {
+	Tcl_HashEntry *hPtr;
+	char *result;               /* String rep of the result set */
+	int resultlen;
+	long expires;               /* Absolute time of expiry, seconds */
+	struct CacheEntry *prevPtr; /* Links in the LRU list */
+	struct CacheEntry *nextPtr;
+} CacheEntry;
+
+typedef struct {
+	Tcl_Mutex mutex;
+	int initialized;
+	Tcl_HashTable table;
+	int count;                  /* Current number of entries */
+	CacheEntry *head;           /* Most recently used entry */
+	CacheEntry *tail;           /* Least recently used entry */
+
+	/* Statistics */
+	Tcl_WideInt hits;
+	Tcl_WideInt neghits;
+	Tcl_WideInt filehits;       /* Hits served from the cache file */
+	Tcl_WideInt misses;
+	Tcl_WideInt expired;
+	Tcl_WideInt evicted;
+} CacheStripe;
+
+static CacheStripe stripes[CACHE_NSTRIPES];
+
+static int cacheSize = CACHE_DEF_SIZE; /* Max number of entries, 0 disables caching */
+static int exitHandlerSet = 0;
+TCL_DECLARE_MUTEX(cacheMutex)          /* Protects the two above */
+
+static long
+CacheNow (void)
+{
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+	return now.sec;
+}
+
+/* Max number of entries in a stripe */
+static int
+CacheStripeSize (void)
+{
+	return (cacheSize + CACHE_NSTRIPES - 1) / CACHE_NSTRIPES;
+}
+
+/* FNV-1a */
+static CacheStripe *
+CacheGetStripe (
+	const char *key
+	)
+{
+	unsigned int hash;
+
+	hash = 2166136261U;
+	while (*key != '\0') {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619U;
+	}
+
+	return &stripes[hash & (CACHE_NSTRIPES - 1)];
+}
+
+/* Locks the stripe, initializing it if needed */
+static void
+CacheLock (
+	CacheStripe *stripePtr
+	)
+{
+	Tcl_MutexLock(&stripePtr->mutex);
+	if (! stripePtr->initialized) {
+		Tcl_InitHashTable(&stripePtr->table, TCL_STRING_KEYS);
+		stripePtr->initialized = 1;
+	}
+}
+
+static void
+CacheUnlock (
+	CacheStripe *stripePtr
+	)
+{
+	Tcl_MutexUnlock(&stripePtr->mutex);
+}
+
+static void
+CacheLinkHead (
+	CacheStripe *stripePtr,
+	CacheEntry *entryPtr
+	)
+{
+	entryPtr->prevPtr = NULL;
+	entryPtr->nextPtr = stripePtr->head;
+	if (stripePtr->head != NULL) {
+		stripePtr->head->prevPtr = entryPtr;
+	} else {
+		stripePtr->tail = entryPtr;
+	}
+	stripePtr->head = entryPtr;
+}
+
+static void
+CacheUnlink (
+	CacheStripe *stripePtr,
+	CacheEntry *entryPtr
+	)
+{
+	if (entryPtr->prevPtr != NULL) {
+		entryPtr->prevPtr->nextPtr = entryPtr->nextPtr;
+	} else {
+		stripePtr->head = entryPtr->nextPtr;
+	}
+	if (entryPtr->nextPtr != NULL) {
+		entryPtr->nextPtr->prevPtr = entryPtr->prevPtr;
+	} else {
+		stripePtr->tail = entryPtr->prevPtr;
+	}
+}
+
+static void
+CacheRemove (
+	CacheStripe *stripePtr,
+	CacheEntry *entryPtr
+	)
+{
+	CacheUnlink(stripePtr, entryPtr);
+	Tcl_DeleteHashEntry(entryPtr->hPtr);
+	ckfree(entryPtr->result);
+	ckfree((char *) entryPtr);
+	--stripePtr->count;
+}
+
+/* Shrinks the stripe down to the given number of entries */
+static void
+CacheTrim (
+	CacheStripe *stripePtr,
+	const int count
+	)
+{
+	while (stripePtr->count > count) {
+		CacheRemove(stripePtr, stripePtr->tail);
+		++stripePtr->evicted;
+	}
+}
+
+static void
+CacheFlushStripe (
+	CacheStripe *stripePtr
+	)
+{
+	while (stripePtr->head != NULL) {
+		CacheRemove(stripePtr, stripePtr->head);
+	}
+}
+
+static void
+CacheFinalize (
+	ClientData clientData
+	)
+{
+	int i;
+
+	for (i = 0; i < CACHE_NSTRIPES; ++i) {
+		CacheStripe *stripePtr = &stripes[i];
+
+		if (stripePtr->initialized) {
+			CacheFlushStripe(stripePtr);
+			Tcl_DeleteHashTable(&stripePtr->table);
+			stripePtr->initialized = 0;
+		}
+		Tcl_MutexFinalize(&stripePtr->mutex);
+	}
+
+	DNSCacheFileClose();
+}
+
+/* Stores the result set (taking ownership of the string) under the key */
+static void
+CacheInsert (
+	const char *key,
+	char *result,
+	const int resultlen,
+	const long expires
+	)
+{
+	CacheStripe *stripePtr;
+	Tcl_HashEntry *hPtr;
+	CacheEntry *entryPtr;
+	int stripesize, new;
+
+	stripesize = CacheStripeSize();
+
+	if (stripesize == 0) {
+		ckfree(result);
+		return;
+	}
+
+	stripePtr = CacheGetStripe(key);
+	CacheLock(stripePtr);
+
+	hPtr = Tcl_CreateHashEntry(&stripePtr->table, key, &new);
+	if (new) {
+		CacheTrim(stripePtr, stripesize - 1);
+
+		entryPtr = (CacheEntry *) ckalloc(sizeof(CacheEntry));
+		entryPtr->hPtr = hPtr;
+		Tcl_SetHashValue(hPtr, entryPtr);
+		++stripePtr->count;
+	} else {
+		entryPtr = (CacheEntry *) Tcl_GetHashValue(hPtr);
+		CacheUnlink(stripePtr, entryPtr);
+		ckfree(entryPtr->result);
+	}
+
+	entryPtr->result    = result;
+	entryPtr->resultlen = resultlen;
+	entryPtr->expires   = expires;
+
+	CacheLinkHead(stripePtr, entryPtr);
+
+	CacheUnlock(stripePtr);
+}
+
+/* Looks the key up in the cache file, moving the entry found
+ * into memory. Returns a new object holding the cached result set
+ * or NULL if there is no such unexpired entry. */
+static Tcl_Obj *
+CacheFindInFile (
+	const char *key,
+	const long now,
+	const int negative
+	)
+{
+	CacheStripe *stripePtr;
+	Tcl_DString result;
+	Tcl_Obj *resObj;
+	char *copy;
+	long expires;
+	int len;
+
+	if (CacheStripeSize() == 0
+			|| ! DNSCacheFileLookup(key, now, &result, &expires)) {
+		return NULL;
+	}
+
+	len = Tcl_DStringLength(&result);
+	resObj = Tcl_NewStringObj(Tcl_DStringValue(&result), len);
+
+	copy = ckalloc(len + 1);
+	memcpy(copy, Tcl_DStringValue(&result), len + 1);
+	Tcl_DStringFree(&result);
+
+	CacheInsert(key, copy, len, expires);
+
+	stripePtr = CacheGetStripe(key);
+	CacheLock(stripePtr);
+	if (negative) {
+		++stripePtr->neghits;
+	} else {
+		++stripePtr->hits;
+	}
+	++stripePtr->filehits;
+	CacheUnlock(stripePtr);
+
+	return resObj;
+}
+
+/* Initializes the key with the query name. Domain names
+ * are case-insensitive, so the name is lowercased. */
+static void
+CacheInitKey (
+	Tcl_DString *keyPtr,
+	Tcl_Obj *queryObj
+	)
+{
+	const char *name;
+	int len;
+
+	name = Tcl_GetStringFromObj(queryObj, &len);
+
+	Tcl_DStringInit(keyPtr);
+	Tcl_DStringAppend(keyPtr, name, len);
+	Tcl_DStringSetLength(keyPtr, Tcl_UtfToLower(Tcl_DStringValue(keyPtr)));
+}
+
+/* Completes the key made by CacheInitKey (replacing any previous
+ * completion). Since result sets are cached already formatted,
+ * the formatting flags are part of the key; so are the backend
+ * options as interps sharing the cache may use different ones. */
+static const char *
+CacheMakeKey (
+	Tcl_DString *keyPtr,
+	const int namelen,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int opts
+	)
+{
+	char buf[5 * TCL_INTEGER_SPACE];
+
+	sprintf(buf, " %u %u %u %d", qclass, qtype, resflags, opts);
+
+	Tcl_DStringSetLength(keyPtr, namelen);
+	Tcl_DStringAppend(keyPtr, buf, -1);
+
+	return Tcl_DStringValue(keyPtr);
+}
+
+/* Whether the result set of a negative answer formatted according
+ * to resflags is empty, and thus can be shared by all the formats.
+ * Raw replies (RES_RAW or DBC_RAWRESULT among opts) never are. */
+static int
+CacheNegativeIsEmpty (
+	const unsigned int resflags,
+	const int opts
+	)
+{
+	return ! (opts & DBC_RAWRESULT)
+		&& (resflags & (RES_ALL | RES_SECTNAMES | RES_COLUMNS | RES_RAW))
+			== RES_ANSWER;
+}
+
+/* Looks the key up and returns a new object holding the cached
+ * result set or NULL if there is no such entry or it has expired */
+static Tcl_Obj *
+CacheFind (
+	const char *key,
+	const long now,
+	const int negative
+	)
+{
+	CacheStripe *stripePtr;
+	Tcl_HashEntry *hPtr;
+	CacheEntry *entryPtr;
+	Tcl_Obj *resObj;
+
+	stripePtr = CacheGetStripe(key);
+	CacheLock(stripePtr);
+
+	resObj = NULL;
+
+	hPtr = Tcl_FindHashEntry(&stripePtr->table, key);
+	if (hPtr != NULL) {
+		entryPtr = (CacheEntry *) Tcl_GetHashValue(hPtr);
+
+		if (entryPtr->expires <= now) {
+			CacheRemove(stripePtr, entryPtr);
+			++stripePtr->expired;
+		} else {
+			if (entryPtr != stripePtr->head) {
+				CacheUnlink(stripePtr, entryPtr);
+				CacheLinkHead(stripePtr, entryPtr);
+			}
+			resObj = Tcl_NewStringObj(entryPtr->result, entryPtr->resultlen);
+		}
+	}
+
+	if (resObj != NULL) {
+		if (negative) {
+			++stripePtr->neghits;
+		} else {
+			++stripePtr->hits;
+		}
+	}
+
+	CacheUnlock(stripePtr);
+
+	if (resObj == NULL) {
+		resObj = CacheFindInFile(key, now, negative);
+	}
+
+	return resObj;
+}
+
+static void
+CacheForget (
+	const char *key
+	)
+{
+	CacheStripe *stripePtr;
+	Tcl_HashEntry *hPtr;
+
+	stripePtr = CacheGetStripe(key);
+	CacheLock(stripePtr);
+
+	hPtr = Tcl_FindHashEntry(&stripePtr->table, key);
+	if (hPtr != NULL) {
+		CacheRemove(stripePtr, (CacheEntry *) Tcl_GetHashValue(hPtr));
+	}
+
+	CacheUnlock(stripePtr);
+
+	DNSCacheFileForget(key);
+}
+
+static void
+CacheCountMiss (
+	const char *key
+	)
+{
+	CacheStripe *stripePtr;
+
+	stripePtr = CacheGetStripe(key);
+	CacheLock(stripePtr);
+	++stripePtr->misses;
+	CacheUnlock(stripePtr);
+}
+
+void
+DNSCacheFlush (void)
+{
+	int i;
+
+	for (i = 0; i < CACHE_NSTRIPES; ++i) {
+		CacheLock(&stripes[i]);
+		CacheFlushStripe(&stripes[i]);
+		CacheUnlock(&stripes[i]);
+	}
+
+	DNSCacheFileClear();
+}
+
+/* Returns a new object holding the cached result set for the query
+ * made with the given backend options or NULL if there is no such
+ * entry or it has expired */
+Tcl_Obj *
+DNSCacheLookup (
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int opts
+	)
+{
+	Tcl_DString key;
+	Tcl_Obj *resObj;
+	long now;
+	int namelen;
+
+	now = CacheNow();
+
+	CacheInitKey(&key, queryObj);
+	namelen = Tcl_DStringLength(&key);
+
+	resObj = CacheFind(CacheMakeKey(&key, namelen,
+				qclass, qtype, resflags, opts), now, 0);
+	if (resObj == NULL && CacheNegativeIsEmpty(resflags, opts)) {
+		resObj = CacheFind(CacheMakeKey(&key, namelen,
+					qclass, KEY_ANYTYPE, KEY_ANYFLAGS, opts), now, 1);
+		if (resObj == NULL) {
+			resObj = CacheFind(CacheMakeKey(&key, namelen,
+						qclass, qtype, KEY_ANYFLAGS, opts), now, 1);
+		}
+	}
+	if (resObj == NULL) {
+		CacheCountMiss(CacheMakeKey(&key, namelen,
+					qclass, qtype, resflags, opts));
+	}
+
+	Tcl_DStringFree(&key);
+	return resObj;
+}
+
+/* Caches the result set of the query made with the given backend
+ * options, which has the outcome described by infoPtr */
+void
+DNSCacheStore (
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int opts,
+	Tcl_Obj *resObj,
+	const ResolveInfo *infoPtr
+	)
+{
+	Tcl_DString key;
+	const char *result;
+	char *copy;
+	long expires;
+	int namelen, len;
+
+	if (CacheStripeSize() == 0 || infoPtr->ttl == 0) {
+		return;
+	}
+
+	if (! exitHandlerSet) {
+		Tcl_MutexLock(&cacheMutex);
+		if (! exitHandlerSet) {
+			Tcl_CreateExitHandler(CacheFinalize, NULL);
+			exitHandlerSet = 1;
+		}
+		Tcl_MutexUnlock(&cacheMutex);
+	}
+
+	/* The copy is made outside of the stripe lock */
+	result = Tcl_GetStringFromObj(resObj, &len);
+	copy = ckalloc(len + 1);
+	memcpy(copy, result, len + 1);
+
+	CacheInitKey(&key, queryObj);
+	namelen = Tcl_DStringLength(&key);
+
+	if (infoPtr->status != RESOLVE_NXDOMAIN) {
+		/* The name has come into existence */
+		CacheForget(CacheMakeKey(&key, namelen,
+					qclass, KEY_ANYTYPE, KEY_ANYFLAGS, opts));
+	}
+
+	/* Negative result sets which are not empty are keyed like positive ones */
+	switch (CacheNegativeIsEmpty(resflags, opts)
+			? infoPtr->status : RESOLVE_DATA) {
+		case RESOLVE_DATA:
+			CacheMakeKey(&key, namelen, qclass, qtype, resflags, opts);
+			break;
+		case RESOLVE_NODATA:
+			CacheMakeKey(&key, namelen, qclass, qtype, KEY_ANYFLAGS, opts);
+			break;
+		case RESOLVE_NXDOMAIN:
+			CacheMakeKey(&key, namelen, qclass, KEY_ANYTYPE, KEY_ANYFLAGS, opts);
+			break;
+	}
+
+	expires = CacheNow() + infoPtr->ttl;
+
+	DNSCacheFileStore(Tcl_DStringValue(&key), copy, len, expires);
+	CacheInsert(Tcl_DStringValue(&key), copy, len, expires);
+
+	Tcl_DStringFree(&key);
+}
+
+void
+DNSCacheSetSize (
+	const int size
+	)
+{
+	int i, stripesize;
+
+	Tcl_MutexLock(&cacheMutex);
+	cacheSize  = size;
+	stripesize = CacheStripeSize();
+	Tcl_MutexUnlock(&cacheMutex);
+
+	for (i = 0; i < CACHE_NSTRIPES; ++i) {
+		CacheLock(&stripes[i]);
+		CacheTrim(&stripes[i], stripesize);
+		CacheUnlock(&stripes[i]);
+	}
+}
+
+int
+DNSCacheGetSize (void)
+{
+	int size;
+
+	Tcl_MutexLock(&cacheMutex);
+	size = cacheSize;
+	Tcl_MutexUnlock(&cacheMutex);
+
+	return size;
+}
+
+/* Returns a dictionary with current statistics of the cache */
+Tcl_Obj *
+DNSCacheStats (void)
+{
+	Tcl_Obj *items[14];
+	Tcl_WideInt hits, neghits, filehits, misses, expired, evicted;
+	int i, count;
+
+	count = 0;
+	hits = neghits = filehits = misses = expired = evicted = 0;
+
+	for (i = 0; i < CACHE_NSTRIPES; ++i) {
+		CacheStripe *stripePtr = &stripes[i];
+
+		CacheLock(stripePtr);
+		count   += stripePtr->count;
+		hits    += stripePtr->hits;
+		neghits += stripePtr->neghits;
+		filehits += stripePtr->filehits;
+		misses  += stripePtr->misses;
+		expired += stripePtr->expired;
+		evicted += stripePtr->evicted;
+		CacheUnlock(stripePtr);
+	}
+
+	items[0]  = Tcl_NewStringObj("entries", -1);
+	items[1]  = Tcl_NewIntObj(count);
+	items[2]  = Tcl_NewStringObj("hits", -1);
+	items[3]  = Tcl_NewWideIntObj(hits);
+	items[4]  = Tcl_NewStringObj("neghits", -1);
+	items[5]  = Tcl_NewWideIntObj(neghits);
+	items[6]  = Tcl_NewStringObj("filehits", -1);
+	items[7]  = Tcl_NewWideIntObj(filehits);
+	items[8]  = Tcl_NewStringObj("misses", -1);
+	items[9]  = Tcl_NewWideIntObj(misses);
+	items[10] = Tcl_NewStringObj("expired", -1);
+	items[11] = Tcl_NewWideIntObj(expired);
+	items[12] = Tcl_NewStringObj("evicted", -1);
+	items[13] = Tcl_NewWideIntObj(evicted);
+
+	return Tcl_NewListObj(14, items);
+}
+
@@ -0,0 +1,40 @@
+/*
+ * cache.h --
+ *   Interface to the cache.c module.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+
+void
+DNSCacheFlush (void);
+
+Tcl_Obj *
+DNSCacheLookup (
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int opts);
+
+void
+DNSCacheStore (
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int opts,
+	Tcl_Obj *resObj,
+	const ResolveInfo *infoPtr);
+
+void
+DNSCacheSetSize (
+	const int size);
+
+int
+DNSCacheGetSize (void);
+
+Tcl_Obj *
+DNSCacheStats (void);
+
@@ -0,0 +1,507 @@
+/*
+ * cachefile.c --
+ *   Memory-mapped file backing the cache of DNS query results,
+ *   which lets a restarted process serve cached answers right away.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+#include <string.h>
+#include "cachefile.h"
+
+#if defined _WIN32 || defined __WIN32__
+
+int
+DNSCacheFileOpen (
+	Tcl_Interp *interp,
+	const char *path
+	)
+{
+	Tcl_SetResult(interp, "Cache files are not supported "
+			"on this platform", TCL_STATIC);
+	return TCL_ERROR;
+}
+
+void
+DNSCacheFileClose (void)
+{
+}
+
+Tcl_Obj *
+DNSCacheFileGetPath (void)
+{
+	return Tcl_NewObj();
+}
+
+int
+DNSCacheFileLookup (
+	const char *key,
+	const long now,
+	Tcl_DString *resultPtr,
+	long *expiresPtr
+	)
+{
+	return 0;
+}
+
+void
+DNSCacheFileStore (
+	const char *key,
+	const char *result,
+	const int resultlen,
+	const long expires
+	)
+{
+}
+
+void
+DNSCacheFileForget (
+	const char *key
+	)
+{
+}
+
+void
+DNSCacheFileClear (void)
+{
+}
+
+#else /* _WIN32 */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * The file is a fixed-size hash table of fixed-size slots following
+ * a header. Each slot holds one cache entry: its key, the string rep
+ * of its result set and its absolute expiry time. A key is looked
+ * up by probing a few consecutive slots starting at the one its hash
+ * value points to, so nothing has to be read in advance when a file
+ * is opened -- the kernel pages the slots in as they're touched.
+ *
+ * Entries too big for a slot are kept in memory only. When all the
+ * probed slots are taken, the entry expiring first is replaced.
+ *
+ * Each slot carries a checksum of its contents, so slots left half
+ * written by a crashed process are ignored. The file can only be used
+ * by a single process at a time: it is locked while open, and the
+ * interps of the process holding it share it.
+ */
+
+#define CF_MAGIC     "SYSDNSC\001"
+#define CF_HDRSIZE   64
+#define CF_NSLOTS    16384
+#define CF_SLOTSIZE  512
+#define CF_PROBES    8
+
+typedef struct {
+	char magic[8];
+	unsigned int nslots;
+	unsigned int slotsize;      /* Guards against changes of the slot layout */
+} CacheFileHeader;
+
+typedef struct {
+	unsigned int check;         /* Checksum of the slot, 0 if the slot is empty */
+	unsigned int hash;          /* Hash value of the key */
+	Tcl_WideInt expires;        /* Absolute time of expiry, seconds */
+	unsigned short keylen;
+	unsigned short datalen;
+	char data[CF_SLOTSIZE - 20]; /* Key immediately followed by the result */
+} CacheFileSlot;
+
+static struct {
+	char *path;                 /* NULL if no file is open */
+	int fd;
+	char *map;
+	size_t mapsize;
+	unsigned int nslots;
+	dev_t dev;                  /* Which file is open, to spot it being reopened */
+	ino_t ino;
+} cf = { NULL, -1, NULL, 0, 0, 0, 0 };
+
+TCL_DECLARE_MUTEX(cfMutex)
+
+static CacheFileSlot *
+CacheFileGetSlot (
+	const unsigned int index
+	)
+{
+	return (CacheFileSlot *) (cf.map + CF_HDRSIZE) + index;
+}
+
+/* FNV-1a */
+static unsigned int
+CacheFileHash (
+	unsigned int hash,
+	const char *data,
+	int len
+	)
+{
+	while (len-- > 0) {
+		hash ^= (unsigned char) *data++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static unsigned int
+CacheFileChecksum (
+	const CacheFileSlot *slotPtr
+	)
+{
+	unsigned int check;
+
+	check = CacheFileHash(2166136261U,
+			(const char *) &slotPtr->hash, sizeof(slotPtr->hash));
+	check = CacheFileHash(check,
+			(const char *) &slotPtr->expires, sizeof(slotPtr->expires));
+	check = CacheFileHash(check,
+			(const char *) &slotPtr->keylen, sizeof(slotPtr->keylen));
+	check = CacheFileHash(check,
+			(const char *) &slotPtr->datalen, sizeof(slotPtr->datalen));
+	check = CacheFileHash(check, slotPtr->data,
+			slotPtr->keylen + slotPtr->datalen);
+
+	return check == 0 ? 1 : check;
+}
+
+static int
+CacheFileSlotIsValid (
+	const CacheFileSlot *slotPtr
+	)
+{
+	return slotPtr->check != 0
+		&& slotPtr->keylen + slotPtr->datalen <= sizeof(slotPtr->data)
+		&& slotPtr->check == CacheFileChecksum(slotPtr);
+}
+
+/* Returns the slot holding the key or NULL if there is no such slot */
+static CacheFileSlot *
+CacheFileFind (
+	const char *key,
+	const unsigned int hash,
+	const int keylen
+	)
+{
+	unsigned int i;
+
+	for (i = 0; i < CF_PROBES; ++i) {
+		CacheFileSlot *slotPtr = CacheFileGetSlot((hash + i) % cf.nslots);
+
+		if (slotPtr->check != 0 && slotPtr->hash == hash
+				&& slotPtr->keylen == keylen
+				&& CacheFileSlotIsValid(slotPtr)
+				&& memcmp(slotPtr->data, key, keylen) == 0) {
+			return slotPtr;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+CacheFileSetPosixError (
+	Tcl_Interp *interp,
+	const char *path
+	)
+{
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, "couldn't open cache file \"", path, "\": ",
+			Tcl_PosixError(interp), NULL);
+}
+
+/* Must be called with cfMutex held */
+static void
+CacheFileUnmap (void)
+{
+	if (cf.path == NULL) {
+		return;
+	}
+
+	munmap(cf.map, cf.mapsize);
+	close(cf.fd);
+	ckfree(cf.path);
+
+	cf.path = NULL;
+	cf.fd   = -1;
+	cf.map  = NULL;
+}
+
+/* Opens (creating it if needed) and maps the cache file, replacing
+ * the file currently in use, if any. An empty path just closes
+ * the current file. */
+int
+DNSCacheFileOpen (
+	Tcl_Interp *interp,
+	const char *path
+	)
+{
+	CacheFileHeader *hdrPtr;
+	struct stat st;
+	unsigned int nslots;
+	size_t size;
+	char *map;
+	int fd;
+
+	if (path[0] == '\0') {
+		DNSCacheFileClose();
+		return TCL_OK;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		Tcl_SetErrno(errno);
+		CacheFileSetPosixError(interp, path);
+		if (fd != -1) {
+			close(fd);
+		}
+		return TCL_ERROR;
+	}
+
+	/* Opening the file in use again keeps it as it is: locking it
+	 * through another descriptor would fail */
+	Tcl_MutexLock(&cfMutex);
+	if (cf.path != NULL && cf.dev == st.st_dev && cf.ino == st.st_ino) {
+		Tcl_MutexUnlock(&cfMutex);
+		close(fd);
+		return TCL_OK;
+	}
+	Tcl_MutexUnlock(&cfMutex);
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "cache file \"", path,
+					"\" is in use by another process", NULL);
+		} else {
+			Tcl_SetErrno(errno);
+			CacheFileSetPosixError(interp, path);
+		}
+		close(fd);
+		return TCL_ERROR;
+	}
+
+	nslots = CF_NSLOTS;
+
+	if (st.st_size >= CF_HDRSIZE) {
+		CacheFileHeader hdr;
+
+		if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+				|| memcmp(hdr.magic, CF_MAGIC, sizeof(hdr.magic)) != 0
+				|| hdr.slotsize != sizeof(CacheFileSlot)
+				|| hdr.nslots == 0
+				|| st.st_size < (off_t) (CF_HDRSIZE
+					+ (size_t) hdr.nslots * sizeof(CacheFileSlot))) {
+			close(fd);
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "\"", path,
+					"\" is not a DNS cache file", NULL);
+			return TCL_ERROR;
+		}
+		nslots = hdr.nslots;
+	} else if (st.st_size != 0) {
+		close(fd);
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "\"", path,
+				"\" is not a DNS cache file", NULL);
+		return TCL_ERROR;
+	}
+
+	size = CF_HDRSIZE + (size_t) nslots * sizeof(CacheFileSlot);
+
+	if (st.st_size == 0 && ftruncate(fd, size) == -1) {
+		Tcl_SetErrno(errno);
+		CacheFileSetPosixError(interp, path);
+		close(fd);
+		return TCL_ERROR;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		Tcl_SetErrno(errno);
+		CacheFileSetPosixError(interp, path);
+		close(fd);
+		return TCL_ERROR;
+	}
+
+	if (st.st_size == 0) {
+		/* New file -- the slots are zeroed (empty) by ftruncate() */
+		hdrPtr = (CacheFileHeader *) map;
+		memcpy(hdrPtr->magic, CF_MAGIC, sizeof(hdrPtr->magic));
+		hdrPtr->nslots   = nslots;
+		hdrPtr->slotsize = sizeof(CacheFileSlot);
+	}
+
+	Tcl_MutexLock(&cfMutex);
+	CacheFileUnmap();
+	cf.path    = strcpy(ckalloc(strlen(path) + 1), path);
+	cf.fd      = fd;
+	cf.map     = map;
+	cf.mapsize = size;
+	cf.nslots  = nslots;
+	cf.dev     = st.st_dev;
+	cf.ino     = st.st_ino;
+	Tcl_MutexUnlock(&cfMutex);
+
+	return TCL_OK;
+}
+
+void
+DNSCacheFileClose (void)
+{
+	Tcl_MutexLock(&cfMutex);
+	CacheFileUnmap();
+	Tcl_MutexUnlock(&cfMutex);
+}
+
+Tcl_Obj *
+DNSCacheFileGetPath (void)
+{
+	Tcl_Obj *pathObj;
+
+	Tcl_MutexLock(&cfMutex);
+	pathObj = Tcl_NewStringObj(cf.path != NULL ? cf.path : "", -1);
+	Tcl_MutexUnlock(&cfMutex);
+
+	return pathObj;
+}
+
+/* Copies the result set cached under the key to resultPtr
+ * (which is initialized by this function only if the entry
+ * is found). Returns 1 if an unexpired entry is found, 0 otherwise. */
+int
+DNSCacheFileLookup (
+	const char *key,
+	const long now,
+	Tcl_DString *resultPtr,
+	long *expiresPtr
+	)
+{
+	CacheFileSlot *slotPtr;
+	int keylen, found;
+
+	keylen = strlen(key);
+	found  = 0;
+
+	Tcl_MutexLock(&cfMutex);
+
+	if (cf.path != NULL) {
+		slotPtr = CacheFileFind(key,
+				CacheFileHash(2166136261U, key, keylen), keylen);
+		if (slotPtr != NULL && slotPtr->expires > now) {
+			Tcl_DStringInit(resultPtr);
+			Tcl_DStringAppend(resultPtr,
+					slotPtr->data + keylen, slotPtr->datalen);
+			*expiresPtr = (long) slotPtr->expires;
+			found = 1;
+		}
+	}
+
+	Tcl_MutexUnlock(&cfMutex);
+
+	return found;
+}
+
+void
+DNSCacheFileStore (
+	const char *key,
+	const char *result,
+	const int resultlen,
+	const long expires
+	)
+{
+	CacheFileSlot *slotPtr;
+	unsigned int hash, i;
+	int keylen;
+
+	keylen = strlen(key);
+
+	if ((size_t) (keylen + resultlen) > sizeof(slotPtr->data)) {
+		return;
+	}
+
+	hash = CacheFileHash(2166136261U, key, keylen);
+
+	Tcl_MutexLock(&cfMutex);
+
+	if (cf.path == NULL) {
+		Tcl_MutexUnlock(&cfMutex);
+		return;
+	}
+
+	slotPtr = CacheFileFind(key, hash, keylen);
+	if (slotPtr == NULL) {
+		/* Take the first free slot or the one expiring first */
+		for (i = 0; i < CF_PROBES; ++i) {
+			CacheFileSlot *probePtr = CacheFileGetSlot((hash + i) % cf.nslots);
+
+			if (! CacheFileSlotIsValid(probePtr)) {
+				slotPtr = probePtr;
+				break;
+			}
+			if (slotPtr == NULL || probePtr->expires < slotPtr->expires) {
+				slotPtr = probePtr;
+			}
+		}
+	}
+
+	slotPtr->check   = 0;
+	slotPtr->hash    = hash;
+	slotPtr->expires = expires;
+	slotPtr->keylen  = keylen;
+	slotPtr->datalen = resultlen;
+	memcpy(slotPtr->data, key, keylen);
+	memcpy(slotPtr->data + keylen, result, resultlen);
+	slotPtr->check   = CacheFileChecksum(slotPtr);
+
+	Tcl_MutexUnlock(&cfMutex);
+}
+
+void
+DNSCacheFileForget (
+	const char *key
+	)
+{
+	CacheFileSlot *slotPtr;
+	int keylen;
+
+	keylen = strlen(key);
+
+	Tcl_MutexLock(&cfMutex);
+
+	if (cf.path != NULL) {
+		slotPtr = CacheFileFind(key,
+				CacheFileHash(2166136261U, key, keylen), keylen);
+		if (slotPtr != NULL) {
+			slotPtr->check = 0;
+		}
+	}
+
+	Tcl_MutexUnlock(&cfMutex);
+}
+
+void
+DNSCacheFileClear (void)
+{
+	unsigned int i;
+
+	Tcl_MutexLock(&cfMutex);
+
+	if (cf.path != NULL) {
+		for (i = 0; i < cf.nslots; ++i) {
+			CacheFileGetSlot(i)->check = 0;
+		}
+	}
+
+	Tcl_MutexUnlock(&cfMutex);
+}
+
+#endif /* _WIN32 */
+
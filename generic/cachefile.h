@@ -0,0 +1,41 @@
+/*
+ * cachefile.h --
+ *   Interface to the cachefile.c module.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+
+int
+DNSCacheFileOpen (
+	Tcl_Interp *interp,
+	const char *path);
+
+void
+DNSCacheFileClose (void);
+
+Tcl_Obj *
+DNSCacheFileGetPath (void);
+
+int
+DNSCacheFileLookup (
+	const char *key,
+	const long now,
+	Tcl_DString *resultPtr,
+	long *expiresPtr);
+
+void
+DNSCacheFileStore (
+	const char *key,
+	const char *result,
+	const int resultlen,
+	const long expires);
+
+void
+DNSCacheFileForget (
+	const char *key);
+
+void
+DNSCacheFileClear (void);
+
@@ -7,6 +7,172 @@
  */
 
 #include <tcl.h>
+#include <string.h>
+#include "resfmt.h"
+
+/* Mnemonics are returned as the shared objects of their literals */
+static Tcl_Obj *
+DNSGetMnemonic (
+	const char *const map[],
+	const int ix
+	)
+{
+	return DNSFormatLiteral(map[ix]);
+}
+
+/* Mnemonics given by scripts are looked up in perfect hash tables
+ * built when the package is loaded (see DNSInitMnemonics), and the
+ * codes found are kept in the internal representations of the objects
+ * holding them (see RRTypeObjType and RRClassObjType), so an object
+ * used again -- like a literal in a loop -- doesn't need to be looked
+ * up anymore. Lookups are case-insensitive. */
+#define MNEMONIC_HASHSIZE 256   /* Power of 2 */
+#define MNEMONIC_MAXLEN   15
+
+typedef struct {
+	const char *const *map;       /* Mnemonics, NULL-terminated */
+	const char *what;             /* What they are, for error messages */
+	Tcl_ObjType *objTypePtr;      /* Type caching the codes in objects */
+	unsigned long seed;           /* Seed making the hash perfect */
+	signed char slots[MNEMONIC_HASHSIZE]; /* Indices into map, -1 if free */
+} MnemonicTable;
+
+/* The package may be loaded into interps of several threads at once,
+ * and the tables must only be built by the first of them: others may
+ * already be looking mnemonics up */
+TCL_DECLARE_MUTEX(mnemonicMutex)
+static int mnemonicsBuilt = 0;
+
+/* Copies the string uppercased into buf (holding MNEMONIC_MAXLEN + 1
+ * bytes) and returns its FNV-1a hash, or 0 if it can't be a mnemonic */
+static unsigned long
+DNSMnemonicHash (
+	const char *str,
+	const int len,
+	char buf[]
+	)
+{
+	unsigned long h;
+	int i;
+
+	if (len > MNEMONIC_MAXLEN) {
+		return 0;
+	}
+
+	h = 2166136261UL;
+	for (i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char) str[i];
+		if (c >= 0x80) {
+			return 0;
+		}
+		if ('a' <= c && c <= 'z') {
+			c -= 'a' - 'A';
+		}
+		buf[i] = c;
+		h = ((h ^ c) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	buf[len] = '\0';
+
+	return h;
+}
+
+static int
+DNSMnemonicSlot (
+	const unsigned long h,
+	const unsigned long seed
+	)
+{
+	return (int) ((((h ^ seed) * 2654435761UL) & 0xFFFFFFFFUL) >> 24)
+		& (MNEMONIC_HASHSIZE - 1);
+}
+
+/* Looks for a seed placing every mnemonic of the table
+ * in a slot of its own. Called with mnemonicMutex held. */
+static void
+DNSBuildMnemonicTable (
+	MnemonicTable *tablePtr
+	)
+{
+	char buf[MNEMONIC_MAXLEN + 1];
+	unsigned long seed;
+	int ix;
+
+	for (seed = 0; ; ++seed) {
+		memset(tablePtr->slots, -1, sizeof(tablePtr->slots));
+		for (ix = 0; tablePtr->map[ix] != NULL; ++ix) {
+			const char *m = tablePtr->map[ix];
+			int slot = DNSMnemonicSlot(
+					DNSMnemonicHash(m, strlen(m), buf), seed);
+			if (tablePtr->slots[slot] != -1) {
+				break;
+			}
+			tablePtr->slots[slot] = ix;
+		}
+		if (tablePtr->map[ix] == NULL) {
+			break;
+		}
+	}
+	tablePtr->seed = seed;
+
+	Tcl_RegisterObjType(tablePtr->objTypePtr);
+}
+
+/* Finds the index of the mnemonic held by the object in the table's
+ * map. Leaves an error message in interp if there's no such one. */
+static int
+DNSLookupMnemonic (
+	Tcl_Interp *interp,
+	Tcl_Obj *objPtr,
+	MnemonicTable *tablePtr,
+	int *ixPtr
+	)
+{
+	char buf[MNEMONIC_MAXLEN + 1];
+	const char *str;
+	unsigned long h;
+	Tcl_Obj *keyObj;
+	int len, ix;
+
+	str = Tcl_GetStringFromObj(objPtr, &len);
+	h = DNSMnemonicHash(str, len, buf);
+	if (h != 0) {
+		ix = tablePtr->slots[DNSMnemonicSlot(h, tablePtr->seed)];
+		if (ix != -1 && strcmp(buf, tablePtr->map[ix]) == 0) {
+			*ixPtr = ix;
+			return TCL_OK;
+		}
+	}
+
+	/* Not a mnemonic -- let Tcl_GetIndexFromObj() report the error
+	 * (which also accepts the odd non-ASCII letters uppercasing to ASCII) */
+	keyObj = Tcl_DuplicateObj(objPtr);
+	Tcl_IncrRefCount(keyObj);
+	Tcl_UtfToUpper(Tcl_GetStringFromObj(keyObj, NULL));
+	if (Tcl_GetIndexFromObj(interp, keyObj, (const char **) tablePtr->map,
+				tablePtr->what, TCL_EXACT, &ix) != TCL_OK) {
+		Tcl_DecrRefCount(keyObj);
+		return TCL_ERROR;
+	}
+	Tcl_DecrRefCount(keyObj);
+
+	*ixPtr = ix;
+	return TCL_OK;
+}
+
+/* Makes the code the internal representation of the object */
+static void
+DNSSetMnemonicRep (
+	Tcl_Obj *objPtr,
+	Tcl_ObjType *objTypePtr,
+	const unsigned short code
+	)
+{
+	if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+		objPtr->typePtr->freeIntRepProc(objPtr);
+	}
+	objPtr->internalRep.longValue = code;
+	objPtr->typePtr = objTypePtr;
+}
 
 static const char *classmap[] = {
 	/* Indices 0..3 */
@@ -21,25 +187,31 @@ static const char *classmap[] = {
 };
 
 
-int
-DNSQClassMnemonicToIndex (
+static int SetRRClassFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType RRClassObjType = {
+	"dnsrrclass",
+	NULL,
+	NULL,
+	NULL,
+	SetRRClassFromAny
+};
+
+static MnemonicTable classTable = {
+	classmap, "domain system class", &RRClassObjType, 0, {0}
+};
+
+static int
+SetRRClassFromAny (
 	Tcl_Interp *interp,
-	Tcl_Obj *classObj,
-	unsigned short *classPtr
+	Tcl_Obj *objPtr
 	)
 {
-	Tcl_Obj *keyObj;
 	int ix;
+	unsigned short qclass;
 
-	/* Make mnemonic uppercase */
-	keyObj = Tcl_DuplicateObj(classObj);
-	Tcl_IncrRefCount(keyObj);
-	Tcl_UtfToUpper(Tcl_GetStringFromObj(keyObj, NULL));
-
-	/* Lookup type by given mnemonic */
-	if (Tcl_GetIndexFromObj(interp, keyObj, classmap, "domain system class",
-			TCL_EXACT, &ix) != TCL_OK) {
-		Tcl_DecrRefCount(keyObj);
+	/* Lookup class by given mnemonic */
+	if (DNSLookupMnemonic(interp, objPtr, &classTable, &ix) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
@@ -47,26 +219,43 @@ DNSQClassMnemonicToIndex (
 	switch (ix) {
 		case 4:
 		case 5:
-			*classPtr = 255;
+			qclass = 255;
 			break;
 		default:
-			*classPtr = ix + 1;
+			qclass = ix + 1;
 	}
 
-	Tcl_DecrRefCount(keyObj);
+	DNSSetMnemonicRep(objPtr, &RRClassObjType, qclass);
 	return TCL_OK;
 }
 
-
+
+int
+DNSQClassMnemonicToIndex (
+	Tcl_Interp *interp,
+	Tcl_Obj *classObj,
+	unsigned short *classPtr
+	)
+{
+	if (classObj->typePtr != &RRClassObjType
+			&& Tcl_ConvertToType(interp, classObj, &RRClassObjType) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	*classPtr = (unsigned short) classObj->internalRep.longValue;
+	return TCL_OK;
+}
+
+
 Tcl_Obj *
 DNSQClassIndexToMnemonic (
 	const unsigned short cindex
 	)
 {
 	if (1 <= cindex && cindex <= 4) {
-		return Tcl_NewStringObj(classmap[cindex - 1], -1);
+		return DNSGetMnemonic(classmap, cindex - 1);
 	} else if (cindex == 255) {
-		return Tcl_NewStringObj(classmap[4], -1);
+		return DNSGetMnemonic(classmap, 4);
 	} else {
 		return Tcl_NewIntObj(cindex);
 	}
@@ -103,25 +292,31 @@ static const char *typemap[] = {
 };
 
 
-int
-DNSQTypeMnemonicToIndex (
+static int SetRRTypeFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType RRTypeObjType = {
+	"dnsrrtype",
+	NULL,
+	NULL,
+	NULL,
+	SetRRTypeFromAny
+};
+
+static MnemonicTable typeTable = {
+	typemap, "DNS RR type", &RRTypeObjType, 0, {0}
+};
+
+static int
+SetRRTypeFromAny (
 	Tcl_Interp *interp,
-	Tcl_Obj *typeObj,
-	unsigned short *typePtr
+	Tcl_Obj *objPtr
 	)
 {
-	Tcl_Obj *keyObj;
 	int ix;
-
-	/* Make mnemonic uppercase */
-	keyObj = Tcl_DuplicateObj(typeObj);
-	Tcl_IncrRefCount(keyObj);
-	Tcl_UtfToUpper(Tcl_GetStringFromObj(keyObj, NULL));
+	unsigned short qtype;
 
 	/* Lookup RR type by given mnemonic */
-	if (Tcl_GetIndexFromObj(interp, keyObj, typemap, "DNS RR type",
-			TCL_EXACT, &ix) != TCL_OK) {
-		Tcl_DecrRefCount(keyObj);
+	if (DNSLookupMnemonic(interp, objPtr, &typeTable, &ix) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
@@ -135,38 +330,70 @@ DNSQTypeMnemonicToIndex (
 	/* Remap indices */
 	if (ix < 41) {
 		/* Block 1 */
-		*typePtr = ix + 1;
+		qtype = ix + 1;
 	} else if (41 <= ix && ix <= 44) {
 		/* Block 2 */
-		*typePtr = 100 + (ix - 41);
+		qtype = 100 + (ix - 41);
 	} else if (45 <= ix && ix <= 53) {
 		/* Block 3 */
-		*typePtr = 248 + (ix - 45);
+		qtype = 248 + (ix - 45);
 	} else {
 		/* Block 4 */
-		*typePtr = 0xFF01 + (ix - 54);
+		qtype = 0xFF01 + (ix - 54);
 	}
 
-	Tcl_DecrRefCount(keyObj);
+	DNSSetMnemonicRep(objPtr, &RRTypeObjType, qtype);
 	return TCL_OK;
 }
 
-
+
+int
+DNSQTypeMnemonicToIndex (
+	Tcl_Interp *interp,
+	Tcl_Obj *typeObj,
+	unsigned short *typePtr
+	)
+{
+	if (typeObj->typePtr != &RRTypeObjType
+			&& Tcl_ConvertToType(interp, typeObj, &RRTypeObjType) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	*typePtr = (unsigned short) typeObj->internalRep.longValue;
+	return TCL_OK;
+}
+
+
 Tcl_Obj *
 DNSQTypeIndexToMnemonic (
 	const unsigned short type
 	)
 {
 	if (1 <= type && type <= 40) {
-		return Tcl_NewStringObj(typemap[type - 1], -1);
+		return DNSGetMnemonic(typemap, type - 1);
 	} else if (100 <= type && type <= 103) {
-		return Tcl_NewStringObj(typemap[type - 100 + 41], -1);
+		return DNSGetMnemonic(typemap, type - 100 + 41);
 	} else if (248 <= type && type <= 255) {
-		return Tcl_NewStringObj(typemap[type - 248 + 45], -1);
+		return DNSGetMnemonic(typemap, type - 248 + 45);
 	} else if (0xFF01 <= type && type <= 0xFF02) {
-		return Tcl_NewStringObj(typemap[type - 0xFF01 + 54], -1);
+		return DNSGetMnemonic(typemap, type - 0xFF01 + 54);
 	} else {
 		return Tcl_NewIntObj(type);
 	}
 }
 
+
+/* Builds the mnemonic tables unless done already; called whenever
+ * the package is loaded, before its commands exist, so lookups
+ * needn't lock */
+void
+DNSInitMnemonics (void)
+{
+	Tcl_MutexLock(&mnemonicMutex);
+	if (! mnemonicsBuilt) {
+		DNSBuildMnemonicTable(&classTable);
+		DNSBuildMnemonicTable(&typeTable);
+		mnemonicsBuilt = 1;
+	}
+	Tcl_MutexUnlock(&mnemonicMutex);
+}
@@ -5,6 +5,9 @@
  * $Id$
  */
 
+void
+DNSInitMnemonics (void);
+
 int
 DNSQClassMnemonicToIndex (
 	Tcl_Interp *interp,
@@ -0,0 +1,846 @@
+/*
+ * pool.c --
+ *   Pool of worker threads performing blocking DNS queries on behalf
+ *   of interps which asked for asynchronous resolution using a backend
+ *   which is not capable of it by itself.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+#include <string.h>
+#include "tclsysdns.h"
+#include "pool.h"
+
+/*
+ * Each worker thread owns a private interp and a private instance
+ * of the backend's state (see Impl_Init) and just runs Impl_Resolve
+ * for the jobs it takes from the queue. Neither Tcl objects nor
+ * backend state ever cross thread boundaries: the job carries a copy
+ * of the query string in, and copies of the result string and the
+ * error code out. The result is posted back to the thread which
+ * submitted the job as a Tcl event; servicing of that event calls
+ * the script callback.
+ *
+ * Jobs whose submitter has gone (its interp data was deleted) are
+ * "orphaned": their owner is set to NULL and they are silently
+ * discarded as soon as a worker or the event loop gets to them.
+ *
+ * Jobs of a batch (see DNSPoolResolveBatch) are not delivered through
+ * the event loop: the submitting thread blocks until they are done,
+ * and workers hand completed jobs back to it via the batch itself.
+ */
+
+#define POOL_DEF_WORKERS 4
+#define POOL_DEF_QDEPTH  1024
+
+typedef struct PoolBatch PoolBatch;
+
+typedef struct PoolJob {
+	struct PoolJob *nextPtr;    /* Next job in the queue or in the batch */
+	struct PoolJob *prevLive;   /* Links in the list of all live jobs */
+	struct PoolJob *nextLive;
+
+	ClientData owner;           /* Submitter's identity, NULL if orphaned */
+	Tcl_ThreadId ownerThread;   /* Thread to deliver the result to */
+	Tcl_Interp *interp;         /* Interp to deliver the result to */
+	Tcl_Obj *cmdObj;            /* Callback; only touched by ownerThread */
+	PoolBatch *batchPtr;        /* Batch the job belongs to, if any */
+	BatchQuery *bqPtr;          /* Query of the batch run by the job */
+
+	char *query;
+	unsigned short qclass;
+	unsigned short qtype;
+	unsigned int resflags;
+	int set;                    /* Backend options of the submitter */
+	int clear;
+
+	Tcl_Time queued;            /* When the job was queued */
+
+	int code;                   /* Outcome of Impl_Resolve */
+	ResolveInfo info;
+	char *result;
+	int resultlen;
+	char *errorCode;
+} PoolJob;
+
+typedef struct {
+	Tcl_Event header;
+	PoolJob *jobPtr;
+} PoolEvent;
+
+struct PoolBatch {
+	Tcl_Condition cond;         /* Signalled when a job of the batch is done */
+	PoolJob *done;              /* Completed jobs not yet collected */
+};
+
+#ifdef TCL_THREADS
+
+static struct {
+	int initialized;
+	int shutdown;
+
+	int size;                   /* Max number of workers */
+	int qdepth;                 /* Max number of queued jobs */
+	int nthreads;               /* Number of running workers */
+	int retiring;               /* Number of workers about to exit */
+	int idle;                   /* Number of workers waiting for jobs */
+
+	PoolJob *head;              /* Queue of jobs (FIFO) */
+	PoolJob *tail;
+	int nqueued;
+	PoolJob *live;              /* All jobs not yet freed */
+
+	/* Statistics */
+	Tcl_WideInt submitted;
+	Tcl_WideInt completed;
+	Tcl_WideInt rejected;
+	int maxqueued;
+	Tcl_WideInt waittotal;      /* Total time jobs waited in queue, usec */
+	Tcl_WideInt waitmax;        /* Longest time a job waited in queue, usec */
+} pool = { 0, 0, POOL_DEF_WORKERS, POOL_DEF_QDEPTH };
+
+TCL_DECLARE_MUTEX(poolMutex)
+static Tcl_Condition poolCond;     /* Signalled when a job is queued */
+static Tcl_Condition poolExitCond; /* Signalled when a worker exits */
+
+static void
+PoolFreeJob (
+	PoolJob *jobPtr
+	)
+{
+	ckfree(jobPtr->query);
+	if (jobPtr->result != NULL) {
+		ckfree(jobPtr->result);
+	}
+	if (jobPtr->errorCode != NULL) {
+		ckfree(jobPtr->errorCode);
+	}
+	ckfree((char *) jobPtr);
+}
+
+/* Must be called with poolMutex held */
+static void
+PoolUnlinkLive (
+	PoolJob *jobPtr
+	)
+{
+	if (jobPtr->prevLive != NULL) {
+		jobPtr->prevLive->nextLive = jobPtr->nextLive;
+	} else {
+		pool.live = jobPtr->nextLive;
+	}
+	if (jobPtr->nextLive != NULL) {
+		jobPtr->nextLive->prevLive = jobPtr->prevLive;
+	}
+}
+
+static Tcl_WideInt
+PoolElapsed (
+	const Tcl_Time *sincePtr
+	)
+{
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+	return ((Tcl_WideInt) (now.sec - sincePtr->sec)) * 1000000
+		+ (now.usec - sincePtr->usec);
+}
+
+static char *
+PoolCopyString (
+	const char *str,
+	const int len
+	)
+{
+	char *copy;
+
+	copy = ckalloc(len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+static int
+PoolEventProc (
+	Tcl_Event *evPtr,
+	int flags
+	)
+{
+	PoolJob *jobPtr;
+	Tcl_Interp *interp;
+	Tcl_Obj *cmdObj;
+	int orphaned;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+
+	jobPtr = ((PoolEvent *) evPtr)->jobPtr;
+
+	Tcl_MutexLock(&poolMutex);
+	orphaned = (jobPtr->owner == NULL);
+	PoolUnlinkLive(jobPtr);
+	Tcl_MutexUnlock(&poolMutex);
+
+	if (orphaned) {
+		PoolFreeJob(jobPtr);
+		return 1;
+	}
+
+	interp = jobPtr->interp;
+	cmdObj = jobPtr->cmdObj;
+
+	Tcl_SetObjResult(interp,
+			Tcl_NewStringObj(jobPtr->result, jobPtr->resultlen));
+	if (jobPtr->code == TCL_ERROR && jobPtr->errorCode != NULL) {
+		Tcl_SetObjErrorCode(interp,
+				Tcl_NewStringObj(jobPtr->errorCode, -1));
+	}
+
+	Sysdns_AsyncResult(interp, cmdObj, jobPtr->code, &jobPtr->info);
+
+	Tcl_DecrRefCount(cmdObj);
+	PoolFreeJob(jobPtr);
+
+	return 1;
+}
+
+static void
+PoolRunJob (
+	Tcl_Interp *interp,
+	ClientData impldata,
+	PoolJob *jobPtr
+	)
+{
+	Tcl_Obj *queryObj, *resObj;
+	const char *str;
+	int len;
+
+	queryObj = Tcl_NewStringObj(jobPtr->query, -1);
+	Tcl_IncrRefCount(queryObj);
+
+	jobPtr->code = Impl_Resolve(impldata, interp, queryObj,
+			jobPtr->qclass, jobPtr->qtype, jobPtr->resflags, &jobPtr->info);
+
+	Tcl_DecrRefCount(queryObj);
+
+	resObj = Tcl_GetObjResult(interp);
+	str = Tcl_GetStringFromObj(resObj, &len);
+	jobPtr->result    = PoolCopyString(str, len);
+	jobPtr->resultlen = len;
+
+	if (jobPtr->code == TCL_ERROR) {
+		Tcl_Obj *optsObj, *keyObj, *codeObj;
+
+		/* The ::errorCode variable may be left over from an earlier
+		 * error, while the return options are those of this one */
+		optsObj = Tcl_GetReturnOptions(interp, jobPtr->code);
+		Tcl_IncrRefCount(optsObj);
+		keyObj = Tcl_NewStringObj("-errorcode", -1);
+		Tcl_IncrRefCount(keyObj);
+		if (Tcl_DictObjGet(NULL, optsObj, keyObj, &codeObj) == TCL_OK
+				&& codeObj != NULL) {
+			str = Tcl_GetStringFromObj(codeObj, &len);
+			jobPtr->errorCode = PoolCopyString(str, len);
+		}
+		Tcl_DecrRefCount(keyObj);
+		Tcl_DecrRefCount(optsObj);
+	}
+
+	Tcl_ResetResult(interp);
+}
+
+static Tcl_ThreadCreateType
+PoolWorker (
+	ClientData clientData
+	)
+{
+	Tcl_Interp *interp;
+	ClientData impldata;
+	int initialized, retired, set, clear;
+
+	interp = Tcl_CreateInterp();
+	retired = 0;
+	initialized = (Impl_Init(interp, &impldata) == TCL_OK);
+	set   = 0;
+	clear = 0;
+
+	Tcl_MutexLock(&poolMutex);
+
+	while (1) {
+		PoolJob *jobPtr;
+		Tcl_WideInt waited;
+
+		while (pool.head == NULL && ! pool.shutdown
+				&& pool.nthreads - pool.retiring <= pool.size) {
+			++pool.idle;
+			Tcl_ConditionWait(&poolCond, &poolMutex, NULL);
+			--pool.idle;
+		}
+		if (pool.shutdown) {
+			break;
+		}
+		if (pool.nthreads - pool.retiring > pool.size) {
+			++pool.retiring;
+			retired = 1;
+			break;
+		}
+
+		jobPtr = pool.head;
+		pool.head = jobPtr->nextPtr;
+		if (pool.head == NULL) {
+			pool.tail = NULL;
+		}
+		--pool.nqueued;
+
+		waited = PoolElapsed(&jobPtr->queued);
+		pool.waittotal += waited;
+		if (waited > pool.waitmax) {
+			pool.waitmax = waited;
+		}
+
+		if (jobPtr->owner == NULL) {
+			PoolUnlinkLive(jobPtr);
+			PoolFreeJob(jobPtr);
+			continue;
+		}
+
+		Tcl_MutexUnlock(&poolMutex);
+
+		if (! initialized) {
+			initialized = (Impl_Init(interp, &impldata) == TCL_OK);
+		}
+		if (initialized) {
+			if (jobPtr->set != set || jobPtr->clear != clear) {
+				Impl_ConfigureBackend(impldata, interp, DBC_DEFAULTS, 0);
+				Impl_ConfigureBackend(impldata, interp,
+						jobPtr->set, jobPtr->clear);
+				set   = jobPtr->set;
+				clear = jobPtr->clear;
+			}
+			PoolRunJob(interp, impldata, jobPtr);
+		} else {
+			const char *str;
+			int len;
+
+			str = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &len);
+			jobPtr->code      = TCL_ERROR;
+			jobPtr->result    = PoolCopyString(str, len);
+			jobPtr->resultlen = len;
+		}
+
+		Tcl_MutexLock(&poolMutex);
+
+		++pool.completed;
+
+		if (jobPtr->batchPtr != NULL) {
+			jobPtr->nextPtr = jobPtr->batchPtr->done;
+			jobPtr->batchPtr->done = jobPtr;
+			Tcl_ConditionNotify(&jobPtr->batchPtr->cond);
+		} else if (jobPtr->owner == NULL) {
+			PoolUnlinkLive(jobPtr);
+			PoolFreeJob(jobPtr);
+		} else {
+			PoolEvent *eventPtr;
+
+			eventPtr = (PoolEvent *) ckalloc(sizeof(PoolEvent));
+			eventPtr->header.proc = PoolEventProc;
+			eventPtr->jobPtr      = jobPtr;
+			Tcl_ThreadQueueEvent(jobPtr->ownerThread,
+					(Tcl_Event *) eventPtr, TCL_QUEUE_TAIL);
+			Tcl_ThreadAlert(jobPtr->ownerThread);
+		}
+	}
+
+	Tcl_MutexUnlock(&poolMutex);
+
+	if (initialized) {
+		Impl_Cleanup(impldata);
+	}
+	Tcl_DeleteInterp(interp);
+
+	Tcl_MutexLock(&poolMutex);
+	if (retired) {
+		--pool.retiring;
+	}
+	--pool.nthreads;
+	Tcl_ConditionNotify(&poolExitCond);
+	Tcl_MutexUnlock(&poolMutex);
+
+	Tcl_ExitThread(0);
+	TCL_THREAD_CREATE_RETURN;
+}
+
+static void
+PoolShutdown (
+	ClientData clientData
+	)
+{
+	Tcl_MutexLock(&poolMutex);
+
+	pool.shutdown = 1;
+	Tcl_ConditionNotify(&poolCond);
+	while (pool.nthreads > 0) {
+		Tcl_ConditionNotify(&poolCond);
+		Tcl_ConditionWait(&poolExitCond, &poolMutex, NULL);
+	}
+
+	while (pool.live != NULL) {
+		PoolJob *jobPtr = pool.live;
+		PoolUnlinkLive(jobPtr);
+		PoolFreeJob(jobPtr);
+	}
+	pool.head = pool.tail = NULL;
+	pool.nqueued = 0;
+
+	Tcl_MutexUnlock(&poolMutex);
+}
+
+/* Must be called with poolMutex held */
+static int
+PoolStartWorker (
+	Tcl_Interp *interp
+	)
+{
+	Tcl_ThreadId id;
+
+	if (! pool.initialized) {
+		Tcl_CreateExitHandler(PoolShutdown, NULL);
+		pool.initialized = 1;
+	}
+
+	if (Tcl_CreateThread(&id, PoolWorker, NULL,
+				TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS) != TCL_OK) {
+		Tcl_SetResult(interp, "Failed to create DNS worker thread",
+				TCL_STATIC);
+		return TCL_ERROR;
+	}
+	++pool.nthreads;
+
+	return TCL_OK;
+}
+
+static PoolJob *
+PoolNewJob (
+	ClientData owner,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int set,
+	const int clear
+	)
+{
+	PoolJob *jobPtr;
+	const char *query;
+	int len;
+
+	query = Tcl_GetStringFromObj(queryObj, &len);
+
+	jobPtr = (PoolJob *) ckalloc(sizeof(PoolJob));
+	memset(jobPtr, 0, sizeof(PoolJob));
+	jobPtr->owner       = owner;
+	jobPtr->ownerThread = Tcl_GetCurrentThread();
+	jobPtr->query       = PoolCopyString(query, len);
+	jobPtr->qclass      = qclass;
+	jobPtr->qtype       = qtype;
+	jobPtr->resflags    = resflags;
+	jobPtr->set         = set;
+	jobPtr->clear       = clear;
+	Tcl_GetTime(&jobPtr->queued);
+
+	return jobPtr;
+}
+
+/* Must be called with poolMutex held */
+static void
+PoolEnqueue (
+	PoolJob *jobPtr
+	)
+{
+	if (pool.tail != NULL) {
+		pool.tail->nextPtr = jobPtr;
+	} else {
+		pool.head = jobPtr;
+	}
+	pool.tail = jobPtr;
+
+	++pool.nqueued;
+	++pool.submitted;
+	if (pool.nqueued > pool.maxqueued) {
+		pool.maxqueued = pool.nqueued;
+	}
+
+	Tcl_ConditionNotify(&poolCond);
+}
+
+int
+DNSPoolSubmit (
+	Tcl_Interp *interp,
+	ClientData owner,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	Tcl_Obj *cmdObj
+	)
+{
+	PoolJob *jobPtr;
+
+	Tcl_MutexLock(&poolMutex);
+
+	if (pool.nqueued >= pool.qdepth) {
+		++pool.rejected;
+		Tcl_MutexUnlock(&poolMutex);
+		Tcl_SetResult(interp, "DNS query queue is full", TCL_STATIC);
+		Tcl_SetErrorCode(interp, "SYSDNS", "QUEUEFULL", NULL);
+		return TCL_ERROR;
+	}
+
+	if (pool.idle == 0 && pool.nthreads - pool.retiring < pool.size) {
+		if (PoolStartWorker(interp) != TCL_OK) {
+			Tcl_MutexUnlock(&poolMutex);
+			return TCL_ERROR;
+		}
+	}
+
+	jobPtr = PoolNewJob(owner, queryObj, qclass, qtype, resflags, set, clear);
+	jobPtr->interp = interp;
+	jobPtr->cmdObj = cmdObj;
+	Tcl_IncrRefCount(cmdObj);
+
+	jobPtr->nextLive = pool.live;
+	if (pool.live != NULL) {
+		pool.live->prevLive = jobPtr;
+	}
+	pool.live = jobPtr;
+
+	PoolEnqueue(jobPtr);
+
+	Tcl_MutexUnlock(&poolMutex);
+
+	Tcl_ResetResult(interp);
+	return TCL_OK;
+}
+
+/* Resolves the queries of the batch using the pool, keeping at most
+ * the given number of them queued or running at once, and waits for
+ * all of them to complete. Batch jobs are not subject to the queue
+ * depth limit as the concurrency limit already bounds their number.
+ * If no worker can be started, the queries not yet submitted fail
+ * with the error saying why. */
+int
+DNSPoolResolveBatch (
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	const int concurrency
+	)
+{
+	PoolBatch batch;
+	Tcl_Obj *errObj;
+	int next, running;
+
+	batch.cond = NULL;
+	batch.done = NULL;
+
+	errObj  = NULL;
+	next    = 0;
+	running = 0;
+
+	Tcl_MutexLock(&poolMutex);
+
+	while (next < nqueries || running > 0) {
+		PoolJob *jobPtr;
+
+		while (errObj == NULL && next < nqueries && running < concurrency) {
+			if (pool.idle == 0 && pool.nthreads - pool.retiring < pool.size
+					&& PoolStartWorker(interp) != TCL_OK) {
+				if (pool.nthreads - pool.retiring == 0) {
+					/* Nobody to run the jobs; keep the error
+					 * as draining the running ones resets it */
+					errObj = Tcl_GetObjResult(interp);
+					Tcl_IncrRefCount(errObj);
+					break;
+				}
+				Tcl_ResetResult(interp);
+			}
+
+			jobPtr = PoolNewJob((ClientData) &batch, queries[next]->queryObj,
+					queries[next]->qclass, queries[next]->qtype,
+					resflags, set, clear);
+			jobPtr->batchPtr = &batch;
+			jobPtr->bqPtr    = queries[next];
+			PoolEnqueue(jobPtr);
+
+			++next;
+			++running;
+		}
+
+		if (running == 0) {
+			break;
+		}
+
+		while (batch.done == NULL) {
+			Tcl_ConditionWait(&batch.cond, &poolMutex, NULL);
+		}
+
+		jobPtr = batch.done;
+		batch.done = NULL;
+
+		/* Objects are made outside of the lock */
+		Tcl_MutexUnlock(&poolMutex);
+		while (jobPtr != NULL) {
+			PoolJob *nextPtr = jobPtr->nextPtr;
+
+			Tcl_SetObjResult(interp,
+					Tcl_NewStringObj(jobPtr->result, jobPtr->resultlen));
+			jobPtr->bqPtr->info = jobPtr->info;
+			Sysdns_BatchResult(interp, jobPtr->bqPtr, jobPtr->code);
+
+			PoolFreeJob(jobPtr);
+			--running;
+			jobPtr = nextPtr;
+		}
+		Tcl_MutexLock(&poolMutex);
+	}
+
+	Tcl_MutexUnlock(&poolMutex);
+	Tcl_ConditionFinalize(&batch.cond);
+
+	if (errObj != NULL) {
+		for (; next < nqueries; ++next) {
+			Tcl_SetObjResult(interp, errObj);
+			Sysdns_BatchResult(interp, queries[next], TCL_ERROR);
+		}
+		Tcl_DecrRefCount(errObj);
+	}
+
+	return TCL_OK;
+}
+
+static int
+PoolDeleteEventFilter (
+	Tcl_Event *evPtr,
+	ClientData clientData
+	)
+{
+	PoolJob *jobPtr;
+
+	if (evPtr->proc != PoolEventProc) {
+		return 0;
+	}
+
+	jobPtr = ((PoolEvent *) evPtr)->jobPtr;
+	if (jobPtr->owner != NULL) {
+		return 0;
+	}
+
+	Tcl_MutexLock(&poolMutex);
+	PoolUnlinkLive(jobPtr);
+	Tcl_MutexUnlock(&poolMutex);
+
+	PoolFreeJob(jobPtr);
+
+	return 1;
+}
+
+/* Orphans all the jobs submitted by the given owner.
+ * Must be called by the thread which submitted them. */
+void
+DNSPoolForget (
+	ClientData owner
+	)
+{
+	PoolJob *jobPtr;
+
+	Tcl_MutexLock(&poolMutex);
+	for (jobPtr = pool.live; jobPtr != NULL; jobPtr = jobPtr->nextLive) {
+		if (jobPtr->owner == owner) {
+			jobPtr->owner = NULL;
+			/* Callbacks belong to this thread,
+			 * so release them while we're here */
+			Tcl_DecrRefCount(jobPtr->cmdObj);
+			jobPtr->cmdObj = NULL;
+		}
+	}
+	Tcl_MutexUnlock(&poolMutex);
+
+	/* Results which have already been delivered to this thread */
+	Tcl_DeleteEvents(PoolDeleteEventFilter, NULL);
+}
+
+int
+DNSPoolConfigure (
+	Tcl_Interp *interp,
+	const int nworkers,
+	const int qdepth
+	)
+{
+	if (nworkers < 1 || qdepth < 1) {
+		Tcl_SetResult(interp, "Number of workers and queue depth "
+				"must be positive integers", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	Tcl_MutexLock(&poolMutex);
+	pool.size   = nworkers;
+	pool.qdepth = qdepth;
+	/* Let superfluous idle workers exit */
+	Tcl_ConditionNotify(&poolCond);
+	Tcl_MutexUnlock(&poolMutex);
+
+	return TCL_OK;
+}
+
+void
+DNSPoolGetConfig (
+	int *nworkersPtr,
+	int *qdepthPtr
+	)
+{
+	Tcl_MutexLock(&poolMutex);
+	*nworkersPtr = pool.size;
+	*qdepthPtr   = pool.qdepth;
+	Tcl_MutexUnlock(&poolMutex);
+}
+
+/* Returns a dictionary with current statistics of the pool.
+ * Times are in microseconds. */
+Tcl_Obj *
+DNSPoolStats (void)
+{
+	Tcl_Obj *items[18];
+	Tcl_WideInt finished;
+
+	Tcl_MutexLock(&poolMutex);
+
+	finished = pool.submitted - pool.nqueued;
+
+	items[0]  = Tcl_NewStringObj("workers", -1);
+	items[1]  = Tcl_NewIntObj(pool.nthreads - pool.retiring);
+	items[2]  = Tcl_NewStringObj("busy", -1);
+	items[3]  = Tcl_NewIntObj(pool.nthreads - pool.retiring - pool.idle);
+	items[4]  = Tcl_NewStringObj("queued", -1);
+	items[5]  = Tcl_NewIntObj(pool.nqueued);
+	items[6]  = Tcl_NewStringObj("maxqueued", -1);
+	items[7]  = Tcl_NewIntObj(pool.maxqueued);
+	items[8]  = Tcl_NewStringObj("submitted", -1);
+	items[9]  = Tcl_NewWideIntObj(pool.submitted);
+	items[10] = Tcl_NewStringObj("completed", -1);
+	items[11] = Tcl_NewWideIntObj(pool.completed);
+	items[12] = Tcl_NewStringObj("rejected", -1);
+	items[13] = Tcl_NewWideIntObj(pool.rejected);
+	items[14] = Tcl_NewStringObj("avgwait", -1);
+	items[15] = Tcl_NewWideIntObj(finished > 0 ? pool.waittotal / finished : 0);
+	items[16] = Tcl_NewStringObj("maxwait", -1);
+	items[17] = Tcl_NewWideIntObj(pool.waitmax);
+
+	Tcl_MutexUnlock(&poolMutex);
+
+	return Tcl_NewListObj(18, items);
+}
+
+int
+DNSPoolIsAvailable (void)
+{
+	return 1;
+}
+
+#else /* TCL_THREADS */
+
+static void
+PoolSetNoThreadsError (
+	Tcl_Interp *interp
+	)
+{
+	Tcl_SetResult(interp, "Asynchronous resolution with this DNS "
+			"resolution backend requires threaded Tcl", TCL_STATIC);
+}
+
+int
+DNSPoolSubmit (
+	Tcl_Interp *interp,
+	ClientData owner,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	Tcl_Obj *cmdObj
+	)
+{
+	PoolSetNoThreadsError(interp);
+	return TCL_ERROR;
+}
+
+void
+DNSPoolForget (
+	ClientData owner
+	)
+{
+}
+
+/* Accepts the settings DNSPoolGetConfig reports: no pool at all */
+int
+DNSPoolConfigure (
+	Tcl_Interp *interp,
+	const int nworkers,
+	const int qdepth
+	)
+{
+	if (nworkers == 0 && qdepth == 0) {
+		return TCL_OK;
+	}
+
+	PoolSetNoThreadsError(interp);
+	return TCL_ERROR;
+}
+
+void
+DNSPoolGetConfig (
+	int *nworkersPtr,
+	int *qdepthPtr
+	)
+{
+	*nworkersPtr = 0;
+	*qdepthPtr   = 0;
+}
+
+Tcl_Obj *
+DNSPoolStats (void)
+{
+	return Tcl_NewListObj(0, NULL);
+}
+
+int
+DNSPoolResolveBatch (
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	const int concurrency
+	)
+{
+	PoolSetNoThreadsError(interp);
+	return TCL_ERROR;
+}
+
+int
+DNSPoolIsAvailable (void)
+{
+	return 0;
+}
+
+#endif /* TCL_THREADS */
+
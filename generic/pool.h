@@ -0,0 +1,52 @@
+/*
+ * pool.h --
+ *   Interface to the pool.c module.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+
+int
+DNSPoolSubmit (
+	Tcl_Interp *interp,
+	ClientData owner,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	Tcl_Obj *cmdObj);
+
+void
+DNSPoolForget (
+	ClientData owner);
+
+int
+DNSPoolConfigure (
+	Tcl_Interp *interp,
+	const int nworkers,
+	const int qdepth);
+
+void
+DNSPoolGetConfig (
+	int *nworkersPtr,
+	int *qdepthPtr);
+
+Tcl_Obj *
+DNSPoolStats (void);
+
+int
+DNSPoolResolveBatch (
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int set,
+	const int clear,
+	const int concurrency);
+
+int
+DNSPoolIsAvailable (void);
+
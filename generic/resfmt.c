@@ -16,6 +16,116 @@
 #include "dnsparams.h"
 #include "resfmt.h"
 
+/* Field names and other fixed words of results are kept as shared
+ * objects, so formatting a result only allocates objects for its
+ * data. Tcl objects can't be shared between threads, so each thread
+ * has its own table, keyed by the address of the C string. */
+typedef struct {
+	int initialized;
+	Tcl_HashTable literals;
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+static void
+DNSFormatFreeLiterals (
+	ClientData clientData
+	)
+{
+	ThreadSpecificData *tsdPtr = (ThreadSpecificData *) clientData;
+	Tcl_HashEntry *hPtr;
+	Tcl_HashSearch search;
+
+	hPtr = Tcl_FirstHashEntry(&tsdPtr->literals, &search);
+	while (hPtr != NULL) {
+		Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(hPtr));
+		hPtr = Tcl_NextHashEntry(&search);
+	}
+	Tcl_DeleteHashTable(&tsdPtr->literals);
+	tsdPtr->initialized = 0;
+}
+
+/* Returns the shared object holding the string, which must be
+ * a literal (or otherwise live and unchanged for the life of
+ * the thread) as it's looked up by its address */
+Tcl_Obj *
+DNSFormatLiteral (
+	const char *str
+	)
+{
+	ThreadSpecificData *tsdPtr;
+	Tcl_HashEntry *hPtr;
+	Tcl_Obj *litObj;
+	int isnew;
+
+	tsdPtr = (ThreadSpecificData *)
+		Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+	if (! tsdPtr->initialized) {
+		Tcl_InitHashTable(&tsdPtr->literals, TCL_ONE_WORD_KEYS);
+		Tcl_CreateThreadExitHandler(DNSFormatFreeLiterals, tsdPtr);
+		tsdPtr->initialized = 1;
+	}
+
+	hPtr = Tcl_CreateHashEntry(&tsdPtr->literals, str, &isnew);
+	if (isnew) {
+		litObj = Tcl_NewStringObj(str, -1);
+		Tcl_IncrRefCount(litObj);
+		Tcl_SetHashValue(hPtr, litObj);
+	} else {
+		litObj = (Tcl_Obj *) Tcl_GetHashValue(hPtr);
+	}
+
+	return litObj;
+}
+
+/* Releases the object made for a field left out of the output
+ * unless it's also held elsewhere */
+static void
+DNSFormatDrop (
+	Tcl_Obj *objPtr
+	)
+{
+	if (objPtr != NULL) {
+		Tcl_IncrRefCount(objPtr);
+		Tcl_DecrRefCount(objPtr);
+	}
+}
+
+/* Makes the object holding the fields of a record (question or RR) */
+Tcl_Obj *
+DNSFormatNewRecord (
+	const int resflags
+	)
+{
+	if (resflags & RES_DICT) {
+		return Tcl_NewDictObj();
+	}
+	return Tcl_NewListObj(0, NULL);
+}
+
+/* Adds the field to the record being formatted: as a key of the dict
+ * with RES_DICT, preceded by its name with RES_NAMES, or just the value */
+static void
+DNSFormatField (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[],
+	Tcl_Obj *valueObj
+	)
+{
+	if (resflags & RES_DICT) {
+		Tcl_DictObjPut(interp, resObj, DNSFormatLiteral(name), valueObj);
+		return;
+	}
+
+	if (resflags & RES_NAMES) {
+		Tcl_ListObjAppendElement(interp, resObj,
+				DNSFormatLiteral(name));
+	}
+	Tcl_ListObjAppendElement(interp, resObj, valueObj);
+}
+
 static void
 DNSFormatRRData (
 	Tcl_Interp *interp,
@@ -25,11 +135,9 @@ DNSFormatRRData (
 	Tcl_Obj *dataObj
 	)
 {
-	if (resflags & RES_NAMES) {
-		*resObjPtr = Tcl_NewListObj(0, NULL);
-		Tcl_ListObjAppendElement(interp, *resObjPtr,
-				Tcl_NewStringObj(name, -1));
-		Tcl_ListObjAppendElement(interp, *resObjPtr, dataObj);
+	if (resflags & (RES_NAMES | RES_DICT)) {
+		*resObjPtr = DNSFormatNewRecord(resflags);
+		DNSFormatField(interp, resflags, *resObjPtr, name, dataObj);
 	} else {
 		*resObjPtr = dataObj;
 	}
@@ -47,7 +155,7 @@ DNSFormatRRDataList (
 	const char *name;
 	Tcl_Obj *dataObj;
 
-	*resObjPtr = Tcl_NewListObj(0, NULL);
+	*resObjPtr = DNSFormatNewRecord(resflags);
 
 	va_start(ap, resObjPtr);
 	while (1) {
@@ -56,45 +164,132 @@ DNSFormatRRDataList (
 
 		dataObj = va_arg(ap, Tcl_Obj *);
 
-		if (resflags & RES_NAMES) {
-			Tcl_ListObjAppendElement(interp, *resObjPtr,
-					Tcl_NewStringObj(name, -1));
-		}
-		Tcl_ListObjAppendElement(interp, *resObjPtr, dataObj);
+		DNSFormatField(interp, resflags, *resObjPtr, name, dataObj);
 	};
 	va_end(ap);
 }
 
+/* Adds the section sectObj named name to the result set */
 void
-DNSFormatQuestion (
+DNSFormatPutSection (
 	Tcl_Interp *interp,
 	const int resflags,
 	Tcl_Obj *resObj,
 	const char name[],
-	const unsigned short qtype,
-	const unsigned short qclass
+	Tcl_Obj *sectObj
 	)
 {
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("name", -1));
+	if ((resflags & RES_DICT) && (resflags & RES_SECTNAMES)) {
+		Tcl_DictObjPut(interp, resObj, DNSFormatLiteral(name), sectObj);
+		return;
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			Tcl_NewStringObj(name, -1));
 
-	if (resflags & RES_NAMES) {
+	if (resflags & RES_SECTNAMES) {
 		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("qtype", -1));
+				DNSFormatLiteral(name));
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			DNSQTypeIndexToMnemonic(qtype));
+	Tcl_ListObjAppendElement(interp, resObj, sectObj);
+}
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("qclass", -1));
+/* Starts the section named name of the result set and returns the object
+ * its records are to be appended to: a new list if the result set is made
+ * of several sections, resObj itself otherwise */
+Tcl_Obj *
+DNSFormatSection (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[]
+	)
+{
+	Tcl_Obj *sectObj;
+
+	if (! (resflags & RES_WANTLIST)) {
+		return resObj;
+	}
+
+	sectObj = Tcl_NewListObj(0, NULL);
+	DNSFormatPutSection(interp, resflags, resObj, name, sectObj);
+	return sectObj;
+}
+
+/* Same as DNSFormatSection but for the section whose records have been
+ * collected in the list sectObj, which is released if it's spliced
+ * into resObj */
+void
+DNSFormatSectionObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[],
+	Tcl_Obj *sectObj
+	)
+{
+	if (resflags & RES_WANTLIST) {
+		DNSFormatPutSection(interp, resflags, resObj, name, sectObj);
+	} else {
+		Tcl_ListObjAppendList(interp, resObj, sectObj);
+		Tcl_DecrRefCount(sectObj);
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			DNSQClassIndexToMnemonic(qclass));
+}
+
+/* The type or class of a record as an integer with RES_NUMERIC,
+ * or as its mnemonic otherwise */
+static Tcl_Obj *
+DNSFormatType (
+	const int resflags,
+	const unsigned short type
+	)
+{
+	if (resflags & RES_NUMERIC) {
+		return Tcl_NewIntObj(type);
+	}
+	return DNSQTypeIndexToMnemonic(type);
+}
+
+static Tcl_Obj *
+DNSFormatClass (
+	const int resflags,
+	const unsigned short class
+	)
+{
+	if (resflags & RES_NUMERIC) {
+		return Tcl_NewIntObj(class);
+	}
+	return DNSQClassIndexToMnemonic(class);
+}
+
+void
+DNSFormatQuestion (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[],
+	const unsigned short qtype,
+	const unsigned short qclass
+	)
+{
+	DNSFormatQuestionObj(interp, resflags, resObj,
+			Tcl_NewStringObj(name, -1), qtype, qclass);
+}
+
+/* Same as DNSFormatQuestion but takes the name as an object,
+ * which may be shared */
+void
+DNSFormatQuestionObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	Tcl_Obj *nameObj,
+	const unsigned short qtype,
+	const unsigned short qclass
+	)
+{
+	DNSFormatField(interp, resflags, resObj, "name", nameObj);
+	DNSFormatField(interp, resflags, resObj, "qtype",
+			DNSFormatType(resflags, qtype));
+	DNSFormatField(interp, resflags, resObj, "qclass",
+			DNSFormatClass(resflags, qclass));
 }
 
 void
@@ -108,17 +303,9 @@ DNSFormatFakeQuestion (
 	)
 {
 	Tcl_Obj *sectObj, *questObj;
-	if (resflags & RES_SECTNAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("question", -1));
-	}
-	if (resflags & RES_WANTLIST) {
-		sectObj = Tcl_NewListObj(0, NULL);
-		Tcl_ListObjAppendElement(interp, resObj, sectObj);
-	} else {
-		sectObj = resObj;
-	}
-	questObj = Tcl_NewListObj(0, NULL);
+
+	sectObj = DNSFormatSection(interp, resflags, resObj, "question");
+	questObj = DNSFormatNewRecord(resflags);
 	Tcl_ListObjAppendElement(interp, sectObj, questObj);
 	DNSFormatQuestion(interp, resflags, questObj,
 			name, qtype, qclass);
@@ -133,49 +320,203 @@ DNSFormatRRHeader (
 	const unsigned short type,
 	const unsigned short class,
 	const unsigned long ttl,
-	const int rdlength
+	const int rdlength,
+	Tcl_Obj *dataObj
 	)
 {
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("name", -1));
-	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			Tcl_NewStringObj(name, -1));
+	DNSFormatRRHeaderObj(interp, resflags, resObj,
+			RES_WANTFIELD(resflags, RES_F_NAME)
+				? Tcl_NewStringObj(name, -1) : NULL,
+			type, class, ttl, rdlength, dataObj);
+}
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("type", -1));
+/* Same as DNSFormatRRHeader but takes the owner name as an object,
+ * which may be shared by all the RRs having the same owner. Only the
+ * fields selected by the RES_F_* flags are added; the name and data
+ * objects of the others are released and may be NULL. */
+void
+DNSFormatRRHeaderObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	Tcl_Obj *nameObj,
+	const unsigned short type,
+	const unsigned short class,
+	const unsigned long ttl,
+	const int rdlength,
+	Tcl_Obj *dataObj
+	)
+{
+	if (RES_WANTFIELD(resflags, RES_F_NAME)) {
+		DNSFormatField(interp, resflags, resObj, "name", nameObj);
+	} else {
+		DNSFormatDrop(nameObj);
+	}
+	if (RES_WANTFIELD(resflags, RES_F_TYPE)) {
+		DNSFormatField(interp, resflags, resObj, "type",
+				DNSFormatType(resflags, type));
+	}
+	if (RES_WANTFIELD(resflags, RES_F_CLASS)) {
+		DNSFormatField(interp, resflags, resObj, "class",
+				DNSFormatClass(resflags, class));
+	}
+	if (RES_WANTFIELD(resflags, RES_F_TTL)) {
+		DNSFormatField(interp, resflags, resObj, "ttl",
+				Tcl_NewWideIntObj(ttl));
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			DNSQTypeIndexToMnemonic(type));
+	if (RES_WANTFIELD(resflags, RES_F_RDLENGTH)) {
+		DNSFormatField(interp, resflags, resObj, "rdlength",
+				Tcl_NewIntObj(rdlength));
+	}
+	if (RES_WANTFIELD(resflags, RES_F_RDATA)) {
+		DNSFormatField(interp, resflags, resObj, "rdata", dataObj);
+	} else {
+		DNSFormatDrop(dataObj);
+	}
+}
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("class", -1));
+static Tcl_Obj *
+DNSFormatNewColumn (
+	const int fields,
+	const int field,
+	const int count
+	)
+{
+	return (fields & field) ? Tcl_NewListObj(count, NULL) : NULL;
+}
+
+/* Starts the columns of a section having count records (questions
+ * if question is set) for RES_COLUMNS. The lists are sized up front.
+ * Those of RRs are the ones selected by the RES_F_* flags if any,
+ * otherwise the class and RDLENGTH ones are only made with RES_DETAIL. */
+void
+DNSFormatColumnsInit (
+	DNSColumns *colsPtr,
+	const int resflags,
+	const int question,
+	const int count
+	)
+{
+	int fields;
+
+	if (question) {
+		fields = RES_F_NAME | RES_F_TYPE | RES_F_CLASS;
+	} else if (resflags & RES_FIELDS) {
+		fields = resflags & RES_FIELDS;
+	} else if (resflags & RES_DETAIL) {
+		fields = RES_FIELDS;
+	} else {
+		fields = RES_F_NAME | RES_F_TYPE | RES_F_TTL | RES_F_RDATA;
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			DNSQClassIndexToMnemonic(class));
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("ttl", -1));
+	colsPtr->question    = question;
+	colsPtr->nameObj     = DNSFormatNewColumn(fields, RES_F_NAME, count);
+	colsPtr->typeObj     = DNSFormatNewColumn(fields, RES_F_TYPE, count);
+	colsPtr->classObj    = DNSFormatNewColumn(fields, RES_F_CLASS, count);
+	colsPtr->ttlObj      = DNSFormatNewColumn(fields, RES_F_TTL, count);
+	colsPtr->rdlengthObj = DNSFormatNewColumn(fields, RES_F_RDLENGTH, count);
+	colsPtr->dataObj     = DNSFormatNewColumn(fields, RES_F_RDATA, count);
+}
+
+void
+DNSFormatColumnsQuestion (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr,
+	Tcl_Obj *nameObj,
+	const unsigned short qtype,
+	const unsigned short qclass
+	)
+{
+	Tcl_ListObjAppendElement(interp, colsPtr->nameObj, nameObj);
+	Tcl_ListObjAppendElement(interp, colsPtr->typeObj,
+			DNSFormatType(resflags, qtype));
+	Tcl_ListObjAppendElement(interp, colsPtr->classObj,
+			DNSFormatClass(resflags, qclass));
+}
+
+void
+DNSFormatColumnsRR (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr,
+	Tcl_Obj *nameObj,
+	const unsigned short type,
+	const unsigned short class,
+	const unsigned long ttl,
+	const int rdlength,
+	Tcl_Obj *dataObj
+	)
+{
+	if (colsPtr->nameObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->nameObj, nameObj);
+	} else {
+		DNSFormatDrop(nameObj);
+	}
+	if (colsPtr->typeObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->typeObj,
+				DNSFormatType(resflags, type));
+	}
+	if (colsPtr->classObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->classObj,
+				DNSFormatClass(resflags, class));
+	}
+	if (colsPtr->ttlObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->ttlObj,
+				Tcl_NewWideIntObj(ttl));
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			Tcl_NewWideIntObj(ttl));
+	if (colsPtr->rdlengthObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->rdlengthObj,
+				Tcl_NewIntObj(rdlength));
+	}
+	if (colsPtr->dataObj != NULL) {
+		Tcl_ListObjAppendElement(interp, colsPtr->dataObj, dataObj);
+	} else {
+		DNSFormatDrop(dataObj);
+	}
+}
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("rdlength", -1));
+/* Makes the record holding the columns of the section, with the fields
+ * in the same order as in the records of a section formatted by rows */
+Tcl_Obj *
+DNSFormatColumnsObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr
+	)
+{
+	Tcl_Obj *resObj;
+
+	resObj = DNSFormatNewRecord(resflags);
+
+	if (colsPtr->question) {
+		DNSFormatField(interp, resflags, resObj, "name", colsPtr->nameObj);
+		DNSFormatField(interp, resflags, resObj, "qtype", colsPtr->typeObj);
+		DNSFormatField(interp, resflags, resObj, "qclass", colsPtr->classObj);
+		return resObj;
 	}
-	Tcl_ListObjAppendElement(interp, resObj,
-			Tcl_NewIntObj(rdlength));
 
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, resObj,
-				Tcl_NewStringObj("rdata", -1));
+	if (colsPtr->nameObj != NULL) {
+		DNSFormatField(interp, resflags, resObj, "name", colsPtr->nameObj);
+	}
+	if (colsPtr->typeObj != NULL) {
+		DNSFormatField(interp, resflags, resObj, "type", colsPtr->typeObj);
+	}
+	if (colsPtr->classObj != NULL) {
+		DNSFormatField(interp, resflags, resObj, "class", colsPtr->classObj);
+	}
+	if (colsPtr->ttlObj != NULL) {
+		DNSFormatField(interp, resflags, resObj, "ttl", colsPtr->ttlObj);
+	}
+	if (colsPtr->rdlengthObj != NULL) {
+		DNSFormatField(interp, resflags, resObj,
+				"rdlength", colsPtr->rdlengthObj);
+	}
+	if (colsPtr->dataObj != NULL) {
+		DNSFormatField(interp, resflags, resObj, "rdata", colsPtr->dataObj);
 	}
-	/* Corresponding value will be provided by a call to DNSMsgParseRRData */
+
+	return resObj;
 }
 
 void
@@ -245,6 +586,27 @@ DNSFormatRRDataSOA (
 			NULL);
 }
 
+void
+DNSFormatRRDataOPT (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj **resObjPtr,
+	const unsigned short udpsize,
+	const int rcode,
+	const int version,
+	const int dnssecok,
+	Tcl_Obj *optsObj
+	)
+{
+	DNSFormatRRDataList(interp, resflags, resObjPtr,
+			"udpsize", Tcl_NewIntObj(udpsize),
+			"rcode",   Tcl_NewIntObj(rcode),
+			"version", Tcl_NewIntObj(version),
+			"do",      Tcl_NewBooleanObj(dnssecok),
+			"options", optsObj,
+			NULL);
+}
+
 void
 DNSFormatRRDataMINFO (
 	Tcl_Interp *interp,
@@ -269,24 +631,17 @@ DNSFormatRRDataTXT (
 	const char *const items[]
 	)
 {
-	Tcl_Obj *dataObj;
+	Tcl_Obj *itemsObj;
 	int i;
 
-	*resObjPtr = Tcl_NewListObj(0, NULL);
-
-	if (resflags & RES_NAMES) {
-		Tcl_ListObjAppendElement(interp, *resObjPtr,
-				Tcl_NewStringObj("data", -1));
-		dataObj = Tcl_NewListObj(0, NULL);
-		Tcl_ListObjAppendElement(interp, *resObjPtr, dataObj);
-	} else {
-		dataObj = *resObjPtr;
-	}
-
+	itemsObj = Tcl_NewListObj(0, NULL);
 	for (i = 0; i < count; ++i) {
-		Tcl_ListObjAppendElement(interp, dataObj,
+		Tcl_ListObjAppendElement(interp, itemsObj,
 				Tcl_NewStringObj(items[i], -1));
 	}
+
+	DNSFormatRRData(interp, resflags, resObjPtr,
+			"data", itemsObj);
 }
 
 void
@@ -375,15 +730,15 @@ DNSFormatRRDataATMA (
 
 	switch (type) {
 		case 1: /* E164 */
-			typeObj = Tcl_NewStringObj("E164", -1);
+			typeObj = DNSFormatLiteral("E164");
 			addrObj = Tcl_NewStringObj(addr, -1);
 			break;
 		case 2: /* AESA */
-			typeObj = Tcl_NewStringObj("AESA", -1);
+			typeObj = DNSFormatLiteral("AESA");
 			addrObj = Tcl_NewStringObj(addr, 20);
 			break;
 		default:
-			typeObj = Tcl_NewStringObj("UNSUPPORTED", -1);
+			typeObj = DNSFormatLiteral("UNSUPPORTED");
 			addrObj = Tcl_NewObj();
 			break;
 	}
@@ -548,19 +903,19 @@ DNSFormatRRDataKEY (
 	
 	switch (proto) {
 		case 1:
-			protoObj = Tcl_NewStringObj("tls", -1);
+			protoObj = DNSFormatLiteral("tls");
 			break;
 		case 2:
-			protoObj = Tcl_NewStringObj("email", -1);
+			protoObj = DNSFormatLiteral("email");
 			break;
 		case 3:
-			protoObj = Tcl_NewStringObj("dnssec", -1);
+			protoObj = DNSFormatLiteral("dnssec");
 			break;
 		case 4:
-			protoObj = Tcl_NewStringObj("ipsec", -1);
+			protoObj = DNSFormatLiteral("ipsec");
 			break;
 		case 255:
-			protoObj = Tcl_NewStringObj("all", -1);
+			protoObj = DNSFormatLiteral("all");
 			break;
 		default:
 			protoObj = Tcl_NewIntObj(proto);
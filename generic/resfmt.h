@@ -7,6 +7,37 @@
 
 #include <tcl.h>
 
+Tcl_Obj *
+DNSFormatLiteral (
+	const char *str);
+
+Tcl_Obj *
+DNSFormatNewRecord (
+	const int resflags);
+
+void
+DNSFormatPutSection (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[],
+	Tcl_Obj *sectObj);
+
+Tcl_Obj *
+DNSFormatSection (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[]);
+
+void
+DNSFormatSectionObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	const char name[],
+	Tcl_Obj *sectObj);
+
 void
 DNSFormatQuestion (
 	Tcl_Interp *interp,
@@ -16,6 +47,15 @@ DNSFormatQuestion (
 	const unsigned short qtype,
 	const unsigned short qclass);
 
+void
+DNSFormatQuestionObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	Tcl_Obj *nameObj,
+	const unsigned short qtype,
+	const unsigned short qclass);
+
 void
 DNSFormatFakeQuestion (
 	Tcl_Interp *interp,
@@ -34,7 +74,66 @@ DNSFormatRRHeader (
 	const unsigned short type,
 	const unsigned short class,
 	const unsigned long ttl,
-	const int rdlength);
+	const int rdlength,
+	Tcl_Obj *dataObj);
+
+void
+DNSFormatRRHeaderObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj *resObj,
+	Tcl_Obj *nameObj,
+	const unsigned short type,
+	const unsigned short class,
+	const unsigned long ttl,
+	const int rdlength,
+	Tcl_Obj *dataObj);
+
+/* Lists a section formatted with RES_COLUMNS is made of,
+ * each one being NULL if its field is not in the output */
+typedef struct {
+	int question;                   /* Set for the question section */
+	Tcl_Obj *nameObj;
+	Tcl_Obj *typeObj;
+	Tcl_Obj *classObj;
+	Tcl_Obj *ttlObj;
+	Tcl_Obj *rdlengthObj;
+	Tcl_Obj *dataObj;
+} DNSColumns;
+
+void
+DNSFormatColumnsInit (
+	DNSColumns *colsPtr,
+	const int resflags,
+	const int question,
+	const int count);
+
+void
+DNSFormatColumnsQuestion (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr,
+	Tcl_Obj *nameObj,
+	const unsigned short qtype,
+	const unsigned short qclass);
+
+void
+DNSFormatColumnsRR (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr,
+	Tcl_Obj *nameObj,
+	const unsigned short type,
+	const unsigned short class,
+	const unsigned long ttl,
+	const int rdlength,
+	Tcl_Obj *dataObj);
+
+Tcl_Obj *
+DNSFormatColumnsObj (
+	Tcl_Interp *interp,
+	const int resflags,
+	DNSColumns *colsPtr);
 
 void
 DNSFormatRRDataPTR (
@@ -71,6 +170,17 @@ DNSFormatRRDataSOA (
 	const unsigned long expire,
 	const unsigned long minimum);
 
+void
+DNSFormatRRDataOPT (
+	Tcl_Interp *interp,
+	const int resflags,
+	Tcl_Obj **resObjPtr,
+	const unsigned short udpsize,
+	const int rcode,
+	const int version,
+	const int dnssecok,
+	Tcl_Obj *optsObj);
+
 void
 DNSFormatRRDataMINFO (
 	Tcl_Interp *interp,
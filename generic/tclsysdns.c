@@ -6,9 +6,14 @@
  */
 
 #include <tcl.h>
+#include <stdio.h>
 #include <string.h>
 #include "tclsysdns.h"
 #include "dnsparams.h"
+#include "pool.h"
+#include "cache.h"
+#include "cachefile.h"
+#include "qtypes.h"
 
 typedef struct {
 	const char *opt;
@@ -24,6 +29,11 @@ typedef struct {
 	int b_caps;                     /* Backend capabilities */
 	const unsigned short *b_qtypes; /* QTYPEs supported by backend */
 	int b_ncaps;                    /* Number of caps supported by backend */
+	int b_features;                 /* Backend features (BF_* flags) */
+
+	int ednssize;                   /* UDP payload size to advertise with
+	                                 * EDNS0, 0 to follow the system's
+	                                 * resolver configuration */
 
 	struct {
 		const char **olist;
@@ -43,27 +53,79 @@ static PackageData pkgData;
  * and it's passed around to the package's command procs as their clientData. */
 typedef struct {
 	int refcount;
+	Tcl_Interp *interp;             /* Interp this data belongs to */
 	ClientData impldata;            /* Backend-specific opaque state */
+	int bopts;                      /* Backend options (DBC_*) enabled */
+	Tcl_HashTable pending;          /* Async queries in flight (PendingQuery),
+	                                 * keyed by their command prefixes */
+	int nprepared;                  /* Counter naming prepared queries */
 } PkgInterpData;
 
+/* Asynchronous query submitted by Sysdns_Resolve.
+ * Remembered to cache its result when it arrives. */
+typedef struct {
+	Tcl_Obj *queryObj;
+	unsigned short qclass;
+	unsigned short qtype;
+	unsigned int resflags;
+	int bopts;
+} PendingQuery;
+
+/* Key for the interp's associated data referring to PkgInterpData */
+#define ASSOC_KEY "sysdns"
+
 /* Accessor for the impldata field */
 #define ImplClientData(p) ( ((PkgInterpData *) p)->impldata )
 
+/* Options handled by the generic layer, not by backends */
 typedef enum {
 	OPT_QUERYTYPES = __DBC_MAX + 1,
 	OPT_BACKEND,
+	OPT_WORKERS,
+	OPT_QUEUEDEPTH,
+	OPT_POOLSTATS,
+	OPT_CACHESIZE,
+	OPT_CACHESTATS,
+	OPT_CACHEFILE,
+	OPT_EDNSSIZE,
 } cget_opt_t;
 
 const opt_val_t ConfOptMap[] = {
-	{NULL, 0}
+	{"-workers",    OPT_WORKERS},
+	{"-queuedepth", OPT_QUEUEDEPTH},
+	{"-cachesize",  OPT_CACHESIZE},
+	{"-cachefile",  OPT_CACHEFILE},
+	{"-ednssize",   OPT_EDNSSIZE},
+	{NULL,          0}
 };
 
 const opt_val_t CgetOptMap[] = {
 	{"-querytypes", OPT_QUERYTYPES},
 	{"-backend",    OPT_BACKEND},
+	{"-workers",    OPT_WORKERS},
+	{"-queuedepth", OPT_QUEUEDEPTH},
+	{"-poolstats",  OPT_POOLSTATS},
+	{"-cachesize",  OPT_CACHESIZE},
+	{"-cachestats", OPT_CACHESTATS},
+	{"-cachefile",  OPT_CACHEFILE},
+	{"-ednssize",   OPT_EDNSSIZE},
 	{NULL,          0}
 };
 
+/* Tells whether the backend supports the generic option */
+static int
+OptionIsSupported (
+	const int option
+	)
+{
+	switch ((cget_opt_t) option) {
+		case OPT_EDNSSIZE:
+			return (pkgData.b_features & BF_EDNS) != 0;
+		default:
+			return 1;
+	}
+}
+
 static void
 CreateOptionMaps (
 	const int caps,
@@ -124,6 +186,8 @@ CreateOptionMaps (
 									break;
 				case DBC_PRIMARY:   opt = "-primarydnsonly";
 									break;
+				case DBC_STAYOPEN:  opt = "-stayopen";
+									break;
 			}
 
 			pkgData.conf.olist[di] = opt;
@@ -140,18 +204,24 @@ CreateOptionMaps (
 
 	si = 0;
 	while (mconf[si].opt != NULL) {
-		pkgData.conf.olist[di] = mconf[si].opt;
-		pkgData.conf.omap[di]  = mconf[si].val;
-		++si; ++di;
+		if (OptionIsSupported(mconf[si].val)) {
+			pkgData.conf.olist[di] = mconf[si].opt;
+			pkgData.conf.omap[di]  = mconf[si].val;
+			++di;
+		}
+		++si;
 	}
 	pkgData.conf.olist[di] = NULL; /* NULL-terminator */
 
 	si = 0;
 	di = base;
 	while (mcget[si].opt != NULL) {
-		pkgData.cget.olist[di] = mcget[si].opt;
-		pkgData.cget.omap[di]  = mcget[si].val;
-		++si; ++di;
+		if (OptionIsSupported(mcget[si].val)) {
+			pkgData.cget.olist[di] = mcget[si].opt;
+			pkgData.cget.omap[di]  = mcget[si].val;
+			++di;
+		}
+		++si;
 	}
 	pkgData.cget.olist[di] = NULL; /* NULL-terminator */
 }
@@ -162,197 +232,1696 @@ FreeOptionMaps (void)
 	ckfree((char *) pkgData.conf.olist);
 	ckfree((char *) pkgData.conf.omap);
 
-	ckfree((char *) pkgData.cget.olist);
-	ckfree((char *) pkgData.cget.omap);
+	ckfree((char *) pkgData.cget.olist);
+	ckfree((char *) pkgData.cget.omap);
+}
+
+static void
+Sysdns_PkgInit (void)
+{
+	if (! pkgData.initialized) {
+		BackendInfo bi;
+
+		Impl_GetBackendInfo(&bi);
+
+		pkgData.b_name   = bi.name;
+		pkgData.b_caps   = bi.caps;
+		pkgData.b_qtypes = bi.qtypes;
+		pkgData.b_features = bi.features;
+
+		CreateOptionMaps(bi.caps, ConfOptMap, CgetOptMap);
+
+		pkgData.initialized = 1;
+	}
+}
+
+/* Called when the interp is being deleted (or the package
+ * is loaded into it once again) */
+static void
+Sysdns_DeleteAssocData (
+	ClientData clientData,
+	Tcl_Interp *interp
+	)
+{
+	((PkgInterpData *) clientData)->interp = NULL;
+}
+
+static void
+FreePendingQuery (
+	PendingQuery *pqPtr
+	)
+{
+	Tcl_DecrRefCount(pqPtr->queryObj);
+	ckfree((char *) pqPtr);
+}
+
+static void
+ForgetPendingQueries (
+	PkgInterpData *interpData
+	)
+{
+	Tcl_HashEntry *hPtr;
+	Tcl_HashSearch search;
+
+	for (hPtr = Tcl_FirstHashEntry(&interpData->pending, &search);
+			hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+		Tcl_Obj *cmdObj = (Tcl_Obj *) Tcl_GetHashKey(&interpData->pending, hPtr);
+		FreePendingQuery((PendingQuery *) Tcl_GetHashValue(hPtr));
+		Tcl_DecrRefCount(cmdObj);
+	}
+	Tcl_DeleteHashTable(&interpData->pending);
+}
+
+/* Collects the current state of the backend's boolean options
+ * into the set of options enabled in the interp (as for the set
+ * argument of Impl_ConfigureBackend) */
+static int
+UpdateBackendOptions (
+	PkgInterpData *interpData,
+	Tcl_Interp *interp
+	)
+{
+	dns_backend_cap_t c;
+	int set;
+
+	set = 0;
+
+	for (c = __DBC_MIN; c <= __DBC_MAX; c <<= 1) {
+		Tcl_Obj *valObj;
+		int val;
+
+		if (c == DBC_DEFAULTS || ! (pkgData.b_caps & c)) continue;
+
+		if (Impl_CgetBackend(interpData->impldata, interp,
+					c, &valObj) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		Tcl_IncrRefCount(valObj);
+		if (Tcl_GetBooleanFromObj(interp, valObj, &val) != TCL_OK) {
+			Tcl_DecrRefCount(valObj);
+			return TCL_ERROR;
+		}
+		Tcl_DecrRefCount(valObj);
+
+		if (val) {
+			set |= c;
+		}
+	}
+
+	interpData->bopts = set;
+
+	return TCL_OK;
+}
+
+static int
+Sysdns_InterpInit (
+	Tcl_Interp *interp,
+	ClientData *clientDataPtr
+	)
+{
+	PkgInterpData *interpData;
+
+	interpData = (PkgInterpData *) ckalloc(sizeof(PkgInterpData));
+
+	if (Impl_Init(interp, &(interpData->impldata)) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	interpData->refcount  = 0;
+	interpData->interp    = interp;
+	interpData->nprepared = 0;
+	Tcl_InitHashTable(&interpData->pending, TCL_ONE_WORD_KEYS);
+
+	if (UpdateBackendOptions(interpData, interp) != TCL_OK) {
+		Tcl_DeleteHashTable(&interpData->pending);
+		Impl_Cleanup(interpData->impldata);
+		ckfree((char *) interpData);
+		return TCL_ERROR;
+	}
+
+	Tcl_SetAssocData(interp, ASSOC_KEY, Sysdns_DeleteAssocData, interpData);
+
+	*clientDataPtr = (ClientData *) interpData;
+
+	return TCL_OK;
+}
+
+static void
+Sysdns_Cleanup (
+	ClientData clientData
+	)
+{
+	PkgInterpData *interpData;
+
+	interpData = (PkgInterpData *) clientData;
+
+	--interpData->refcount;
+
+	if (interpData->refcount == 0) {
+		if (interpData->interp != NULL
+				&& Tcl_GetAssocData(interpData->interp,
+					ASSOC_KEY, NULL) == interpData) {
+			Tcl_DeleteAssocData(interpData->interp, ASSOC_KEY);
+		}
+		DNSPoolForget(interpData);
+		ForgetPendingQueries(interpData);
+		Impl_Cleanup(interpData->impldata);
+		ckfree((char *) interpData);
+		printf("Instance freed");
+	}
+}
+
+static ClientData
+Sysdns_RefInterpData (
+	ClientData clientData
+	)
+{
+	PkgInterpData *interpData;
+
+	interpData = (PkgInterpData *) clientData;
+	++interpData->refcount;
+
+	return interpData;
+}
+
+/* Result of an asynchronous query found in the cache.
+ * It's delivered from the event loop like any other one. */
+typedef struct {
+	Tcl_Interp *interp;
+	Tcl_Obj *cmdObj;
+	Tcl_Obj *resObj;
+} CachedReply;
+
+static void
+CachedReplyProc (
+	ClientData clientData
+	)
+{
+	CachedReply *replyPtr;
+
+	replyPtr = (CachedReply *) clientData;
+
+	if (! Tcl_InterpDeleted(replyPtr->interp)) {
+		Tcl_SetObjResult(replyPtr->interp, replyPtr->resObj);
+		Sysdns_AsyncResult(replyPtr->interp, replyPtr->cmdObj, TCL_OK, NULL);
+	}
+
+	Tcl_Release((ClientData) replyPtr->interp);
+	Tcl_DecrRefCount(replyPtr->cmdObj);
+	Tcl_DecrRefCount(replyPtr->resObj);
+	ckfree((char *) replyPtr);
+}
+
+static void
+DeliverCachedResult (
+	Tcl_Interp *interp,
+	Tcl_Obj *cmdObj,
+	Tcl_Obj *resObj
+	)
+{
+	CachedReply *replyPtr;
+
+	replyPtr = (CachedReply *) ckalloc(sizeof(CachedReply));
+	replyPtr->interp = interp;
+	replyPtr->cmdObj = cmdObj;
+	replyPtr->resObj = resObj;
+	Tcl_Preserve((ClientData) interp);
+	Tcl_IncrRefCount(cmdObj);
+	Tcl_IncrRefCount(resObj);
+
+	Tcl_DoWhenIdle(CachedReplyProc, replyPtr);
+	Tcl_ResetResult(interp);
+}
+
+/* Options of the query commands */
+typedef enum {
+	QOPT_CLASS, QOPT_TYPE,
+	QOPT_QUESTION, QOPT_ANSWER, QOPT_AUTH, QOPT_ADD, QOPT_ALL,
+	QOPT_DETAIL,
+	QOPT_SECTNAMES, QOPT_NAMES, QOPT_DICT, QOPT_COLUMNS, QOPT_NUMERIC,
+	QOPT_FIELDS,
+	QOPT_COMMAND, QOPT_RRCOMMAND,
+	QOPT_NOCACHE, QOPT_CACHEONLY, QOPT_LAZY,
+	QOPT_CONCURRENCY, QOPT_ERRORVAR, QOPT_STATSVAR,
+	QOPT_SERIAL, QOPT_SERVER, QOPT_BATCH
+} query_opt_t;
+
+static const opt_val_t ResolveOptMap[] = {
+	{"-class",        QOPT_CLASS},
+	{"-type",         QOPT_TYPE},
+	{"-question",     QOPT_QUESTION},
+	{"-answer",       QOPT_ANSWER},
+	{"-authority",    QOPT_AUTH},
+	{"-additional",   QOPT_ADD},
+	{"-all",          QOPT_ALL},
+	{"-detailed",     QOPT_DETAIL},
+	{"-headers",      QOPT_DETAIL},
+	{"-sectionnames", QOPT_SECTNAMES},
+	{"-fieldnames",   QOPT_NAMES},
+	{"-dict",         QOPT_DICT},
+	{"-columns",      QOPT_COLUMNS},
+	{"-numeric",      QOPT_NUMERIC},
+	{"-fields",       QOPT_FIELDS},
+	{"-command",      QOPT_COMMAND},
+	{"-rrcommand",    QOPT_RRCOMMAND},
+	{"-nocache",      QOPT_NOCACHE},
+	{"-cacheonly",    QOPT_CACHEONLY},
+	{"-lazy",         QOPT_LAZY},
+	{NULL,            0}
+};
+
+static const opt_val_t ResolveManyOptMap[] = {
+	{"-class",        QOPT_CLASS},
+	{"-type",         QOPT_TYPE},
+	{"-question",     QOPT_QUESTION},
+	{"-answer",       QOPT_ANSWER},
+	{"-authority",    QOPT_AUTH},
+	{"-additional",   QOPT_ADD},
+	{"-all",          QOPT_ALL},
+	{"-detailed",     QOPT_DETAIL},
+	{"-headers",      QOPT_DETAIL},
+	{"-sectionnames", QOPT_SECTNAMES},
+	{"-fieldnames",   QOPT_NAMES},
+	{"-dict",         QOPT_DICT},
+	{"-columns",      QOPT_COLUMNS},
+	{"-numeric",      QOPT_NUMERIC},
+	{"-fields",       QOPT_FIELDS},
+	{"-nocache",      QOPT_NOCACHE},
+	{"-cacheonly",    QOPT_CACHEONLY},
+	{"-concurrency",  QOPT_CONCURRENCY},
+	{"-errorvar",     QOPT_ERRORVAR},
+	{"-statsvar",     QOPT_STATSVAR},
+	{NULL,            0}
+};
+
+/* Options of ::sysdns::parse, which only formats the result set */
+static const opt_val_t ParseOptMap[] = {
+	{"-question",     QOPT_QUESTION},
+	{"-answer",       QOPT_ANSWER},
+	{"-authority",    QOPT_AUTH},
+	{"-additional",   QOPT_ADD},
+	{"-all",          QOPT_ALL},
+	{"-detailed",     QOPT_DETAIL},
+	{"-headers",      QOPT_DETAIL},
+	{"-sectionnames", QOPT_SECTNAMES},
+	{"-fieldnames",   QOPT_NAMES},
+	{"-dict",         QOPT_DICT},
+	{"-columns",      QOPT_COLUMNS},
+	{"-numeric",      QOPT_NUMERIC},
+	{"-fields",       QOPT_FIELDS},
+	{"-lazy",         QOPT_LAZY},
+	{NULL,            0}
+};
+
+/* Options of ::sysdns::transfer, whose records always have headers */
+static const opt_val_t TransferOptMap[] = {
+	{"-class",        QOPT_CLASS},
+	{"-serial",       QOPT_SERIAL},
+	{"-server",       QOPT_SERVER},
+	{"-fieldnames",   QOPT_NAMES},
+	{"-dict",         QOPT_DICT},
+	{"-numeric",      QOPT_NUMERIC},
+	{"-command",      QOPT_COMMAND},
+	{"-batch",        QOPT_BATCH},
+	{NULL,            0}
+};
+
+#define DEF_CONCURRENCY 64
+#define DEF_XFERBATCH   256
+
+/* Settings collected from the options of a query command */
+typedef struct {
+	unsigned short qclass;
+	unsigned short qtype;
+	unsigned int resflags;
+	Tcl_Obj *cmdObj;
+	Tcl_Obj *rrCmdObj;
+	int nocache;
+	int cacheonly;
+	int concurrency;
+	Tcl_Obj *errorVarObj;
+	Tcl_Obj *statsVarObj;
+	Tcl_WideInt serial;             /* -1 unless given */
+	Tcl_Obj *serverObj;
+	int batchsize;
+} QueryOptions;
+
+/* Fields of RRs which can be selected by -fields */
+static const opt_val_t FieldMap[] = {
+	{"name",       RES_F_NAME},
+	{"type",       RES_F_TYPE},
+	{"class",      RES_F_CLASS},
+	{"ttl",        RES_F_TTL},
+	{"rdlength",   RES_F_RDLENGTH},
+	{"rdata",      RES_F_RDATA},
+	{NULL,         0}
+};
+
+/* Adds the RES_F_* flags of the fields listed in listObj to *flagsPtr */
+static int
+GetFieldsFromObj (
+	Tcl_Interp *interp,
+	Tcl_Obj *listObj,
+	unsigned int *flagsPtr
+	)
+{
+	Tcl_Obj **elems;
+	int nelems, i, idx;
+
+	if (Tcl_ListObjGetElements(interp, listObj, &nelems, &elems) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (nelems == 0) {
+		Tcl_SetResult(interp, "Option -fields requires "
+				"at least one field", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	for (i = 0; i < nelems; ++i) {
+		if (Tcl_GetIndexFromObjStruct(interp, elems[i], FieldMap,
+					sizeof(opt_val_t), "field", 0, &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		*flagsPtr |= FieldMap[idx].val;
+	}
+
+	return TCL_OK;
+}
+
+static int
+CheckLazySupport (
+	Tcl_Interp *interp
+	)
+{
+	if (! (pkgData.b_features & BF_LAZY)) {
+		Tcl_SetResult(interp, "Lazy results are not supported "
+				"by the backend", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+/* Parses the options of a query command accepted according
+ * to the given table */
+static int
+ParseQueryOptions (
+	Tcl_Interp *interp,
+	const opt_val_t optmap[],
+	int objc,
+	Tcl_Obj *const objv[],
+	QueryOptions *optsPtr
+	)
+{
+	int i, idx, sections;
+
+	optsPtr->qclass      = 1; /* default domain system class: "IN" */
+	optsPtr->qtype       = 1; /* default DNS question type: "A" */
+	optsPtr->resflags    = 0;
+	optsPtr->cmdObj      = NULL;
+	optsPtr->rrCmdObj    = NULL;
+	optsPtr->nocache     = 0;
+	optsPtr->cacheonly   = 0;
+	optsPtr->concurrency = DEF_CONCURRENCY;
+	optsPtr->errorVarObj = NULL;
+	optsPtr->statsVarObj = NULL;
+	optsPtr->serial      = -1;
+	optsPtr->serverObj   = NULL;
+	optsPtr->batchsize   = DEF_XFERBATCH;
+
+	sections = 0;
+
+	for (i = 0; i < objc; ) {
+		query_opt_t opt;
+
+		if (Tcl_GetIndexFromObjStruct(interp, objv[i], optmap,
+					sizeof(opt_val_t), "option", 0, &idx) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		opt = (query_opt_t) optmap[idx].val;
+
+		switch (opt) {
+			case QOPT_CLASS:
+			case QOPT_TYPE:
+			case QOPT_COMMAND:
+			case QOPT_RRCOMMAND:
+			case QOPT_CONCURRENCY:
+			case QOPT_ERRORVAR:
+			case QOPT_STATSVAR:
+			case QOPT_SERIAL:
+			case QOPT_SERVER:
+			case QOPT_BATCH:
+			case QOPT_FIELDS:
+				if (i == objc - 1) {
+					Tcl_ResetResult(interp);
+					Tcl_AppendResult(interp, "wrong # args: option \"",
+							optmap[idx].opt, "\" requires an argument", NULL);
+					return TCL_ERROR;
+				}
+				break;
+			default:
+				break;
+		}
+
+		switch (opt) {
+			case QOPT_CLASS:
+				if (DNSQClassMnemonicToIndex(interp,
+							objv[i + 1], &optsPtr->qclass) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				i += 2;
+				break;
+			case QOPT_TYPE:
+				if (DNSQTypeMnemonicToIndex(interp,
+							objv[i + 1], &optsPtr->qtype) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				i += 2;
+				break;
+			case QOPT_QUESTION:
+				optsPtr->resflags |= RES_QUESTION;
+				++sections;
+				++i;
+				break;
+			case QOPT_ANSWER:
+				optsPtr->resflags |= RES_ANSWER;
+				++sections;
+				++i;
+				break;
+			case QOPT_AUTH:
+				optsPtr->resflags |= RES_AUTH;
+				++sections;
+				++i;
+				break;
+			case QOPT_ADD:
+				optsPtr->resflags |= RES_ADD;
+				++sections;
+				++i;
+				break;
+			case QOPT_ALL:
+				optsPtr->resflags |= RES_ALL;
+				sections = 5;
+				++i;
+				break;
+			case QOPT_DETAIL:
+				optsPtr->resflags |= RES_DETAIL;
+				++i;
+				break;
+			case QOPT_SECTNAMES:
+				optsPtr->resflags |= RES_SECTNAMES;
+				++i;
+				break;
+			case QOPT_NAMES:
+				optsPtr->resflags |= RES_NAMES;
+				++i;
+				break;
+			case QOPT_DICT:
+				optsPtr->resflags |= RES_DICT;
+				++i;
+				break;
+			case QOPT_COLUMNS:
+				optsPtr->resflags |= RES_COLUMNS;
+				++i;
+				break;
+			case QOPT_NUMERIC:
+				optsPtr->resflags |= RES_NUMERIC;
+				++i;
+				break;
+			case QOPT_FIELDS:
+				/* Selecting fields of RRs implies records having them */
+				if (GetFieldsFromObj(interp, objv[i + 1],
+							&optsPtr->resflags) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				optsPtr->resflags |= RES_DETAIL;
+				i += 2;
+				break;
+			case QOPT_COMMAND:
+				optsPtr->cmdObj = objv[i + 1];
+				i += 2;
+				break;
+			case QOPT_RRCOMMAND:
+				optsPtr->rrCmdObj = objv[i + 1];
+				i += 2;
+				break;
+			case QOPT_NOCACHE:
+				optsPtr->nocache = 1;
+				++i;
+				break;
+			case QOPT_CACHEONLY:
+				optsPtr->cacheonly = 1;
+				++i;
+				break;
+			case QOPT_LAZY:
+				optsPtr->resflags |= RES_LAZY;
+				++i;
+				break;
+			case QOPT_CONCURRENCY:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1],
+							&optsPtr->concurrency) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				if (optsPtr->concurrency < 1) {
+					Tcl_SetResult(interp, "Concurrency must be "
+							"a positive integer", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				i += 2;
+				break;
+			case QOPT_ERRORVAR:
+				optsPtr->errorVarObj = objv[i + 1];
+				i += 2;
+				break;
+			case QOPT_STATSVAR:
+				optsPtr->statsVarObj = objv[i + 1];
+				i += 2;
+				break;
+			case QOPT_SERIAL:
+				if (Tcl_GetWideIntFromObj(interp, objv[i + 1],
+							&optsPtr->serial) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				if (optsPtr->serial < 0 || optsPtr->serial > 0xFFFFFFFFL) {
+					Tcl_SetResult(interp, "Serial must be an unsigned "
+							"32-bit integer", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				i += 2;
+				break;
+			case QOPT_SERVER:
+				optsPtr->serverObj = objv[i + 1];
+				i += 2;
+				break;
+			case QOPT_BATCH:
+				if (Tcl_GetIntFromObj(interp, objv[i + 1],
+							&optsPtr->batchsize) != TCL_OK) {
+					return TCL_ERROR;
+				}
+				if (optsPtr->batchsize < 1) {
+					Tcl_SetResult(interp, "Batch size must be "
+							"a positive integer", TCL_STATIC);
+					return TCL_ERROR;
+				}
+				i += 2;
+				break;
+		}
+	}
+
+	if (optsPtr->nocache && optsPtr->cacheonly) {
+		Tcl_SetResult(interp, "Options -nocache and -cacheonly "
+				"cannot be used together", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (optsPtr->resflags & RES_LAZY) {
+		if (CheckLazySupport(interp) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (optsPtr->cmdObj != NULL || optsPtr->cacheonly) {
+			Tcl_SetResult(interp, "Option -lazy cannot be used "
+					"with -command or -cacheonly", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		/* The cache keeps result sets as strings which lazy ones
+		 * would have to be fully parsed to produce */
+		optsPtr->nocache = 1;
+	}
+
+	if (optsPtr->rrCmdObj != NULL) {
+		if (! (pkgData.b_features & BF_PARSE)) {
+			Tcl_SetResult(interp, "Option -rrcommand is not supported "
+					"by the backend", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		if (optsPtr->cmdObj != NULL || (optsPtr->resflags & RES_LAZY)) {
+			Tcl_SetResult(interp, "Option -rrcommand cannot be used "
+					"with -command or -lazy", TCL_STATIC);
+			return TCL_ERROR;
+		}
+	}
+
+	if (optsPtr->resflags & RES_COLUMNS) {
+		if (! (pkgData.b_features & BF_COLUMNS)) {
+			Tcl_SetResult(interp, "Option -columns is not supported "
+					"by the backend", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		if (optsPtr->rrCmdObj != NULL || (optsPtr->resflags & RES_LAZY)) {
+			Tcl_SetResult(interp, "Option -columns cannot be used "
+					"with -rrcommand or -lazy", TCL_STATIC);
+			return TCL_ERROR;
+		}
+	}
+
+	if (sections == 0) {
+		optsPtr->resflags |= RES_ANSWER;
+	} else if (sections > 1) {
+		optsPtr->resflags |= RES_MULTIPLE;
+	}
+
+	return TCL_OK;
+}
+
+static void
+SetNotCachedError (
+	Tcl_Interp *interp
+	)
+{
+	Tcl_SetResult(interp, "No cached answer for the query", TCL_STATIC);
+	Tcl_SetErrorCode(interp, "SYSDNS", "NOTCACHED", NULL);
+}
+
+/* Command prefix of a callback receiving records (that of -rrcommand
+ * or of ::sysdns::transfer) with room for the arguments appended to it */
+typedef struct {
+	Tcl_Obj *cmdObj;                /* Private copy of the prefix */
+	int objc;                       /* Words of the command prefix */
+	Tcl_Obj **objv;
+	int count;                      /* Records delivered so far */
+} RRCommand;
+
+/* A private copy of the command prefix can't lose
+ * its list representation while the records are delivered */
+static int
+RRCommandInit (
+	Tcl_Interp *interp,
+	Tcl_Obj *prefixObj,
+	const int nargs,
+	RRCommand *rcPtr
+	)
+{
+	Tcl_Obj **elems;
+
+	rcPtr->cmdObj = Tcl_DuplicateObj(prefixObj);
+	Tcl_IncrRefCount(rcPtr->cmdObj);
+
+	if (Tcl_ListObjGetElements(interp, rcPtr->cmdObj,
+				&rcPtr->objc, &elems) != TCL_OK) {
+		Tcl_DecrRefCount(rcPtr->cmdObj);
+		return TCL_ERROR;
+	}
+
+	rcPtr->objv  = (Tcl_Obj **) ckalloc((rcPtr->objc + nargs)
+			* sizeof(Tcl_Obj *));
+	rcPtr->count = 0;
+	memcpy(rcPtr->objv, elems, rcPtr->objc * sizeof(Tcl_Obj *));
+
+	return TCL_OK;
+}
+
+static void
+RRCommandFree (
+	RRCommand *rcPtr
+	)
+{
+	ckfree((char *) rcPtr->objv);
+	Tcl_DecrRefCount(rcPtr->cmdObj);
+}
+
+static int
+RRCommandProc (
+	Tcl_Interp *interp,
+	ClientData clientData,
+	Tcl_Obj *sectionObj,
+	Tcl_Obj *rrObj
+	)
+{
+	RRCommand *rcPtr = (RRCommand *) clientData;
+	int res;
+
+	rcPtr->objv[rcPtr->objc]     = sectionObj;
+	rcPtr->objv[rcPtr->objc + 1] = rrObj;
+	++rcPtr->count;
+
+	res = Tcl_EvalObjv(interp, rcPtr->objc + 2, rcPtr->objv, TCL_EVAL_GLOBAL);
+	if (res == TCL_ERROR) {
+		Tcl_AddErrorInfo(interp, "\n    (DNS record callback)");
+	}
+
+	return res;
+}
+
+/* Calls the -rrcommand of the query for each record of the reply
+ * (got with RES_RAW) which is the current result of interp, and sets
+ * the result to the number of records delivered. The command may stop
+ * the iteration with [break]. */
+static int
+DeliverRRs (
+	Tcl_Interp *interp,
+	const QueryOptions *optsPtr
+	)
+{
+	Tcl_Obj *replyObj;
+	RRCommand rc;
+	unsigned char *msg;
+	int len, res;
+
+	replyObj = Tcl_GetObjResult(interp);
+	Tcl_IncrRefCount(replyObj);
+	msg = Tcl_GetByteArrayFromObj(replyObj, &len);
+
+	res = RRCommandInit(interp, optsPtr->rrCmdObj, 2, &rc);
+	if (res == TCL_OK) {
+		/* The resolv backend leaves no reply for negative answers */
+		if (len > 0) {
+			res = Impl_ParseMessageRRs(interp, msg, len,
+					optsPtr->resflags, RRCommandProc, &rc);
+		}
+		if (res == TCL_OK || res == TCL_BREAK) {
+			Tcl_SetObjResult(interp, Tcl_NewIntObj(rc.count));
+			res = TCL_OK;
+		}
+
+		RRCommandFree(&rc);
+	}
+
+	Tcl_DecrRefCount(replyObj);
+
+	return res;
+}
+
+/* Resolves the query with the options of ::sysdns::resolve, using
+ * the backend's prepared form of it if there is one (see PreparedQuery) */
+static int
+ResolveQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const QueryOptions *optsPtr,
+	ClientData prepared
+	)
+{
+	PkgInterpData *interpData;
+	int res, nocache, cacheonly;
+	unsigned short qclass, qtype;
+	unsigned int resflags;
+	Tcl_Obj *cmdObj, *resObj;
+	ResolveInfo info;
+
+	qclass    = optsPtr->qclass;
+	qtype     = optsPtr->qtype;
+	resflags  = optsPtr->resflags;
+	cmdObj    = optsPtr->cmdObj;
+	if (optsPtr->rrCmdObj != NULL) {
+		/* The reply is fetched (and cached) as is, for DeliverRRs;
+		 * the cache keeps raw replies apart from result sets */
+		resflags = RES_RAW;
+	}
+	nocache   = optsPtr->nocache;
+	cacheonly = optsPtr->cacheonly;
+
+	interpData = (PkgInterpData *) clientData;
+
+	if (! nocache) {
+		resObj = DNSCacheLookup(queryObj, qclass, qtype, resflags,
+				interpData->bopts);
+		if (resObj != NULL) {
+			if (cmdObj != NULL) {
+				DeliverCachedResult(interp, cmdObj, resObj);
+				return TCL_OK;
+			}
+			Tcl_SetObjResult(interp, resObj);
+			if (optsPtr->rrCmdObj != NULL) {
+				return DeliverRRs(interp, optsPtr);
+			}
+			return TCL_OK;
+		}
+	}
+
+	if (cacheonly) {
+		SetNotCachedError(interp);
+		return TCL_ERROR;
+	}
+
+	if (cmdObj != NULL) {
+		Tcl_HashEntry *hPtr;
+		int new;
+
+		/* A private copy of the command prefix identifies the query
+		 * when its result comes back to Sysdns_AsyncResult */
+		cmdObj = Tcl_DuplicateObj(cmdObj);
+		Tcl_IncrRefCount(cmdObj);
+
+		if (prepared != NULL && (pkgData.b_features & BF_ASYNC)) {
+			res = Impl_ResolvePrepared(ImplClientData(clientData),
+					interp, prepared, resflags, cmdObj, NULL);
+		} else if (pkgData.b_features & BF_ASYNC) {
+			res = Impl_ResolveAsync(ImplClientData(clientData),
+					interp, queryObj, qclass, qtype, resflags, cmdObj);
+		} else {
+			/* The backend can only block, so hand the query
+			 * over to the worker pool along with our options */
+			res = DNSPoolSubmit(interp, clientData, queryObj,
+					qclass, qtype, resflags, interpData->bopts,
+					pkgData.b_caps & ~(DBC_DEFAULTS | interpData->bopts),
+					cmdObj);
+		}
+
+		if (res == TCL_OK) {
+			PendingQuery *pqPtr;
+
+			pqPtr = (PendingQuery *) ckalloc(sizeof(PendingQuery));
+			pqPtr->queryObj = queryObj;
+			pqPtr->qclass   = qclass;
+			pqPtr->qtype    = qtype;
+			pqPtr->resflags = resflags;
+			pqPtr->bopts    = interpData->bopts;
+			Tcl_IncrRefCount(pqPtr->queryObj);
+
+			hPtr = Tcl_CreateHashEntry(&interpData->pending,
+					(char *) cmdObj, &new);
+			Tcl_SetHashValue(hPtr, pqPtr);
+		} else {
+			Tcl_DecrRefCount(cmdObj);
+		}
+
+		return res;
+	}
+
+	memset(&info, 0, sizeof(info));
+
+	if (prepared != NULL) {
+		res = Impl_ResolvePrepared(ImplClientData(clientData),
+				interp, prepared, resflags, NULL, &info);
+	} else {
+		res = Impl_Resolve(ImplClientData(clientData),
+				interp, queryObj, qclass, qtype, resflags, &info);
+	}
+	if (res == TCL_OK) {
+		DNSCacheStore(queryObj, qclass, qtype, resflags, interpData->bopts,
+				Tcl_GetObjResult(interp), &info);
+		if (optsPtr->rrCmdObj != NULL) {
+			res = DeliverRRs(interp, optsPtr);
+		}
+	}
+
+	return res;
+}
+
+static int
+Sysdns_Resolve (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	QueryOptions opts;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv,
+				"query ?options?");
+		return TCL_ERROR;
+	}
+
+	if (ParseQueryOptions(interp, ResolveOptMap,
+				objc - 2, objv + 2, &opts) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	return ResolveQuery(clientData, interp, objv[1], &opts, NULL);
+}
+
+/* Query made by "::sysdns::query create": its options are parsed
+ * once and for all, and backends having the BF_PREPARE feature
+ * keep it in a form ready to be sent (like the encoded question) */
+typedef struct {
+	PkgInterpData *interpData;
+	Tcl_Obj *queryObj;
+	QueryOptions opts;
+	ClientData prepared;            /* Backend's form, NULL if none */
+	Tcl_Command token;              /* Command standing for the query */
+} PreparedQuery;
+
+static void
+PreparedQueryDeleteProc (
+	ClientData clientData
+	)
+{
+	PreparedQuery *prepPtr = (PreparedQuery *) clientData;
+
+	if (prepPtr->prepared != NULL) {
+		Impl_FreePreparedQuery(prepPtr->prepared);
+	}
+	Tcl_DecrRefCount(prepPtr->queryObj);
+	if (prepPtr->opts.cmdObj != NULL) {
+		Tcl_DecrRefCount(prepPtr->opts.cmdObj);
+	}
+	if (prepPtr->opts.rrCmdObj != NULL) {
+		Tcl_DecrRefCount(prepPtr->opts.rrCmdObj);
+	}
+	Sysdns_Cleanup(prepPtr->interpData);
+	ckfree((char *) prepPtr);
+}
+
+static int
+PreparedQueryObjCmd (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	const char *subcmds[] = {
+		"run",
+		"destroy",
+		NULL };
+	typedef enum {
+		SUBCMD_RUN,
+		SUBCMD_DESTROY
+	} subcmds_t;
+
+	PreparedQuery *prepPtr;
+	int subcmd;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "subcommand");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[1],
+				subcmds, "subcommand", 0, &subcmd) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	prepPtr = (PreparedQuery *) clientData;
+
+	switch ((subcmds_t) subcmd) {
+		case SUBCMD_RUN:
+			return ResolveQuery(prepPtr->interpData, interp,
+					prepPtr->queryObj, &prepPtr->opts, prepPtr->prepared);
+		case SUBCMD_DESTROY:
+			Tcl_DeleteCommandFromToken(interp, prepPtr->token);
+			return TCL_OK;
+	}
+
+	return TCL_ERROR; /* Never reached */
+}
+
+/* Implements "::sysdns::query create query ?options?" */
+static int
+PreparedQueryCreate (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	PkgInterpData *interpData;
+	PreparedQuery *prepPtr;
+	QueryOptions opts;
+	ClientData prepared;
+	Tcl_CmdInfo info;
+	char name[40];
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs(interp, 2, objv, "query ?options?");
+		return TCL_ERROR;
+	}
+
+	if (ParseQueryOptions(interp, ResolveOptMap,
+				objc - 3, objv + 3, &opts) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	interpData = (PkgInterpData *) clientData;
+
+	prepared = NULL;
+	if ((pkgData.b_features & BF_PREPARE) && ! opts.cacheonly) {
+		if (Impl_PrepareQuery(ImplClientData(clientData), interp,
+					objv[2], opts.qclass, opts.qtype, &prepared) != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+
+	prepPtr = (PreparedQuery *) ckalloc(sizeof(PreparedQuery));
+	prepPtr->interpData = (PkgInterpData *) Sysdns_RefInterpData(clientData);
+	prepPtr->queryObj   = objv[2];
+	prepPtr->opts       = opts;
+	prepPtr->prepared   = prepared;
+	Tcl_IncrRefCount(prepPtr->queryObj);
+	if (opts.cmdObj != NULL) {
+		Tcl_IncrRefCount(opts.cmdObj);
+	}
+	if (opts.rrCmdObj != NULL) {
+		Tcl_IncrRefCount(opts.rrCmdObj);
+	}
+
+	do {
+		sprintf(name, "::sysdns::query%d", ++interpData->nprepared);
+	} while (Tcl_GetCommandInfo(interp, name, &info));
+
+	prepPtr->token = Tcl_CreateObjCommand(interp, name, PreparedQueryObjCmd,
+			prepPtr, PreparedQueryDeleteProc);
+
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+	return TCL_OK;
+}
+
+static int
+Sysdns_Query (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	const char *subcmds[] = {
+		"create",
+		NULL };
+	typedef enum {
+		SUBCMD_CREATE
+	} subcmds_t;
+
+	int subcmd;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "subcommand ?arg ...?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[1],
+				subcmds, "subcommand", 0, &subcmd) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((subcmds_t) subcmd) {
+		case SUBCMD_CREATE:
+			return PreparedQueryCreate(clientData, interp, objc, objv);
+	}
+
+	return TCL_ERROR; /* Never reached */
+}
+
+/* Sections of a lazy result set as named by the accessors below */
+static const opt_val_t LazySectionMap[] = {
+	{"question",   RES_QUESTION},
+	{"answer",     RES_ANSWER},
+	{"authority",  RES_AUTH},
+	{"additional", RES_ADD},
+	{NULL,         0}
+};
+
+static int
+GetLazySectionFromObj (
+	Tcl_Interp *interp,
+	Tcl_Obj *objPtr,
+	int *sectionPtr
+	)
+{
+	int idx;
+
+	if (Tcl_GetIndexFromObjStruct(interp, objPtr, LazySectionMap,
+				sizeof(opt_val_t), "section", 0, &idx) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	*sectionPtr = LazySectionMap[idx].val;
+	return TCL_OK;
+}
+
+/* ::sysdns::rrcount result ?section? -- returns the number of records
+ * in the section (the answer by default) of a lazy result set */
+static int
+Sysdns_RRCount (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	int section, count;
+
+	if (objc < 2 || objc > 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "result ?section?");
+		return TCL_ERROR;
+	}
+
+	if (CheckLazySupport(interp) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	section = RES_ANSWER;
+	if (objc == 3 && GetLazySectionFromObj(interp,
+				objv[2], &section) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (Impl_CountLazyRRs(interp, objv[1], section, &count) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(count));
+	return TCL_OK;
+}
+
+/* ::sysdns::rr result section index -- returns the record of a lazy
+ * result set, formatted as the element of the section's list would be */
+static int
+Sysdns_RR (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	int section, index;
+	Tcl_Obj *rrObj;
+
+	if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 1, objv, "result section index");
+		return TCL_ERROR;
+	}
+
+	if (CheckLazySupport(interp) != TCL_OK
+			|| GetLazySectionFromObj(interp, objv[2], &section) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIntFromObj(interp, objv[3], &index) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (Impl_GetLazyRR(interp, objv[1], section, index, &rrObj) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult(interp, rrObj);
+	return TCL_OK;
+}
+
+/* ::sysdns::parse message ?options? -- formats the DNS message given as
+ * a byte array (like a reply got with -rawresult) into a result set */
+static int
+Sysdns_Parse (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	QueryOptions opts;
+	ResolveInfo info;
+	unsigned char *msg;
+	int len;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "message ?options?");
+		return TCL_ERROR;
+	}
+
+	if (! (pkgData.b_features & BF_PARSE)) {
+		Tcl_SetResult(interp, "Parsing messages is not supported "
+				"by the backend", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (ParseQueryOptions(interp, ParseOptMap,
+				objc - 2, objv + 2, &opts) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	msg = Tcl_GetByteArrayFromObj(objv[1], &len);
+
+	memset(&info, 0, sizeof(info));
+	return Impl_ParseMessage(interp, msg, len, opts.resflags, &info);
+}
+
+/* Records of a zone transfer collected for the next call
+ * of its command, which gets them as a list */
+typedef struct {
+	RRCommand rc;
+	Tcl_Obj *batchObj;
+	int pending;                    /* Records in batchObj */
+	int batchsize;
+} TransferBatch;
+
+static int
+TransferFlush (
+	Tcl_Interp *interp,
+	TransferBatch *tbPtr
+	)
+{
+	RRCommand *rcPtr = &tbPtr->rc;
+	int res;
+
+	rcPtr->objv[rcPtr->objc] = tbPtr->batchObj;
+	res = Tcl_EvalObjv(interp, rcPtr->objc + 1, rcPtr->objv, TCL_EVAL_GLOBAL);
+	if (res == TCL_ERROR) {
+		Tcl_AddErrorInfo(interp, "\n    (zone transfer callback)");
+	}
+
+	Tcl_DecrRefCount(tbPtr->batchObj);
+	tbPtr->batchObj = Tcl_NewListObj(0, NULL);
+	Tcl_IncrRefCount(tbPtr->batchObj);
+	tbPtr->pending = 0;
+
+	return res;
+}
+
+static int
+TransferRRProc (
+	Tcl_Interp *interp,
+	ClientData clientData,
+	Tcl_Obj *sectionObj,
+	Tcl_Obj *rrObj
+	)
+{
+	TransferBatch *tbPtr = (TransferBatch *) clientData;
+
+	Tcl_ListObjAppendElement(interp, tbPtr->batchObj, rrObj);
+	++tbPtr->rc.count;
+
+	if (++tbPtr->pending < tbPtr->batchsize) {
+		return TCL_OK;
+	}
+	return TransferFlush(interp, tbPtr);
+}
+
+/* ::sysdns::transfer zone -command cmd ?options? -- transfers the zone
+ * with AXFR, or with IXFR if -serial is given, calling cmd with lists
+ * of up to -batch records (with headers) as they arrive. The command
+ * may stop the transfer with [break]. Returns the number of records
+ * received. */
+static int
+Sysdns_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	int objc,
+	Tcl_Obj *const objv[]
+	)
+{
+	PkgInterpData *interpData;
+	QueryOptions opts;
+	TransferBatch tb;
+	unsigned short qtype;
+	int res;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "zone ?options?");
+		return TCL_ERROR;
+	}
+
+	if (! (pkgData.b_features & BF_XFER)) {
+		Tcl_SetResult(interp, "Zone transfers are not supported "
+				"by the backend", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	if (ParseQueryOptions(interp, TransferOptMap,
+				objc - 2, objv + 2, &opts) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (opts.cmdObj == NULL) {
+		Tcl_SetResult(interp, "Option -command is required", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	interpData = (PkgInterpData *) clientData;
+
+	if (RRCommandInit(interp, opts.cmdObj, 1, &tb.rc) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	tb.batchObj  = Tcl_NewListObj(0, NULL);
+	tb.pending   = 0;
+	tb.batchsize = opts.batchsize;
+	Tcl_IncrRefCount(tb.batchObj);
+
+	qtype = opts.serial >= 0 ? SYSDNS_TYPE_IXFR : SYSDNS_TYPE_AXFR;
+
+	res = Impl_Transfer(interpData->impldata, interp, objv[1],
+			opts.serverObj, opts.qclass, qtype,
+			opts.serial >= 0 ? (unsigned long) opts.serial : 0,
+			opts.resflags | RES_DETAIL, TransferRRProc, &tb);
+	if (res == TCL_OK && tb.pending > 0) {
+		res = TransferFlush(interp, &tb);
+	}
+	if (res == TCL_OK || res == TCL_BREAK) {
+		Tcl_SetObjResult(interp, Tcl_NewIntObj(tb.rc.count));
+		res = TCL_OK;
+	}
+
+	Tcl_DecrRefCount(tb.batchObj);
+	RRCommandFree(&tb.rc);
+
+	return res;
 }
 
-static void
-Sysdns_PkgInit (void)
+/* Delivers the outcome of an asynchronous query to the script:
+ * the command prefix cmdObj is called with three more arguments --
+ * the word "ok" or "error" (depending on code), the current result
+ * of interp (which is either the result set or an error message)
+ * and the return options dictionary of the outcome, whose -errorcode
+ * (such as {SYSDNS TIMEOUT}) tells failures apart. Errors in the
+ * callback are reported as background errors. If infoPtr is not
+ * NULL, the result set may be cached. */
+void
+Sysdns_AsyncResult (
+	Tcl_Interp *interp,
+	Tcl_Obj *cmdObj,
+	const int code,
+	const ResolveInfo *infoPtr
+	)
 {
-	if (! pkgData.initialized) {
-		BackendInfo bi;
+	PkgInterpData *interpData;
+	Tcl_HashEntry *hPtr;
+	Tcl_Obj *scriptObj;
+	int res, owned;
+
+	Tcl_Preserve((ClientData) interp);
+
+	/* Cache the result if the query was submitted by Sysdns_Resolve */
+	owned = 0;
+	interpData = (PkgInterpData *) Tcl_GetAssocData(interp, ASSOC_KEY, NULL);
+	if (interpData != NULL) {
+		hPtr = Tcl_FindHashEntry(&interpData->pending, (char *) cmdObj);
+		if (hPtr != NULL) {
+			PendingQuery *pqPtr = (PendingQuery *) Tcl_GetHashValue(hPtr);
+			if (code == TCL_OK && infoPtr != NULL) {
+				DNSCacheStore(pqPtr->queryObj,
+						pqPtr->qclass, pqPtr->qtype, pqPtr->resflags,
+						pqPtr->bopts, Tcl_GetObjResult(interp), infoPtr);
+			}
+			FreePendingQuery(pqPtr);
+			Tcl_DeleteHashEntry(hPtr);
+			owned = 1;
+		}
+	}
 
-		Impl_GetBackendInfo(&bi);
+	scriptObj = Tcl_DuplicateObj(cmdObj);
+	Tcl_IncrRefCount(scriptObj);
 
-		pkgData.b_name   = bi.name;
-		pkgData.b_caps   = bi.caps;
-		pkgData.b_qtypes = bi.qtypes;
+	res = Tcl_ListObjAppendElement(interp, scriptObj,
+			Tcl_NewStringObj(code == TCL_OK ? "ok" : "error", -1));
+	if (res == TCL_OK) {
+		res = Tcl_ListObjAppendElement(interp, scriptObj,
+				Tcl_GetObjResult(interp));
+	}
+	if (res == TCL_OK) {
+		res = Tcl_ListObjAppendElement(interp, scriptObj,
+				Tcl_GetReturnOptions(interp, code));
+	}
+	if (res == TCL_OK) {
+		res = Tcl_EvalObjEx(interp, scriptObj, TCL_EVAL_GLOBAL);
+	}
+	if (res != TCL_OK) {
+		Tcl_AddErrorInfo(interp, "\n    (DNS query callback)");
+		Tcl_BackgroundError(interp);
+	}
 
-		CreateOptionMaps(bi.caps, ConfOptMap, CgetOptMap);
+	Tcl_DecrRefCount(scriptObj);
+	Tcl_ResetResult(interp);
 
-		pkgData.initialized = 1;
+	if (owned) {
+		Tcl_DecrRefCount(cmdObj);
 	}
+
+	Tcl_Release((ClientData) interp);
 }
 
-static int
-Sysdns_InterpInit (
+/* Records the outcome of a query of a batch: the current result
+ * of interp (the result set or an error message) is moved into
+ * the query, leaving interp's result empty */
+void
+Sysdns_BatchResult (
 	Tcl_Interp *interp,
-	ClientData *clientDataPtr
+	BatchQuery *queryPtr,
+	const int code
 	)
 {
-	PkgInterpData *interpData;
-
-	interpData = (PkgInterpData *) ckalloc(sizeof(PkgInterpData));
-
-	if (Impl_Init(interp, &(interpData->impldata)) != TCL_OK) {
-		return TCL_ERROR;
-	}
+	queryPtr->code   = code;
+	queryPtr->resObj = Tcl_GetObjResult(interp);
+	Tcl_IncrRefCount(queryPtr->resObj);
 
-	interpData->refcount = 0;
-	*clientDataPtr = (ClientData *) interpData;
+	Tcl_ResetResult(interp);
+}
 
-	return TCL_OK;
+/* Returns the UDP payload size backends supporting EDNS0 should
+ * advertise in their queries; 0 means they should do what the
+ * system's resolver configuration says */
+int
+Sysdns_GetEDNSSize (void)
+{
+	return pkgData.ednssize;
 }
 
-static void
-Sysdns_Cleanup (
-	ClientData clientData
+/* Resolves the queries which are not answered from the cache
+ * and caches their results. Backends resolving the batch themselves
+ * may report the network traffic it took in the stats. */
+static int
+ResolveBatch (
+	PkgInterpData *interpData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
 	)
 {
-	PkgInterpData *interpData;
+	int i, res;
 
-	interpData = (PkgInterpData *) clientData;
+	memset(statsPtr, 0, sizeof(BatchStats));
 
-	--interpData->refcount;
+	if (nqueries == 0) {
+		return TCL_OK;
+	}
 
-	if (interpData->refcount == 0) {
-		Impl_Cleanup(interpData->impldata);
-		ckfree((char *) interpData);
-		printf("Instance freed");
+	if (pkgData.b_features & BF_BATCH) {
+		res = Impl_ResolveBatch(interpData->impldata, interp,
+				queries, nqueries, resflags, concurrency, statsPtr);
+	} else if (concurrency > 1 && DNSPoolIsAvailable()) {
+		/* The backend can only block, so spread the queries
+		 * over the worker pool */
+		res = DNSPoolResolveBatch(interp, queries, nqueries, resflags,
+				interpData->bopts,
+				pkgData.b_caps & ~(DBC_DEFAULTS | interpData->bopts),
+				concurrency);
+	} else {
+		for (i = 0; i < nqueries; ++i) {
+			BatchQuery *qPtr = queries[i];
+
+			Sysdns_BatchResult(interp, qPtr, Impl_Resolve(interpData->impldata,
+						interp, qPtr->queryObj, qPtr->qclass, qPtr->qtype,
+						resflags, &qPtr->info));
+		}
+		res = TCL_OK;
+	}
+
+	for (i = 0; i < nqueries; ++i) {
+		BatchQuery *qPtr = queries[i];
+
+		if (qPtr->resObj != NULL && qPtr->code == TCL_OK) {
+			DNSCacheStore(qPtr->queryObj, qPtr->qclass, qPtr->qtype,
+					resflags, interpData->bopts, qPtr->resObj, &qPtr->info);
+		}
 	}
+
+	return res;
 }
 
-static ClientData
-Sysdns_RefInterpData (
-	ClientData clientData
+/* Makes the dictionary put into the variable named by the -statsvar
+ * option of ::sysdns::resolvemany: the number of queries, how many
+ * of them were answered from the cache, the time taken (in
+ * microseconds) and, if the backend reported them, the numbers
+ * of system calls made and datagrams sent and received */
+static Tcl_Obj *
+BatchStatsObj (
+	const int nqueries,
+	const int ncached,
+	const Tcl_Time *startPtr,
+	const BatchStats *statsPtr
 	)
 {
-	PkgInterpData *interpData;
-
-	interpData = (PkgInterpData *) clientData;
-	++interpData->refcount;
+	Tcl_Obj *statsObj;
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+
+	statsObj = Tcl_NewListObj(0, NULL);
+
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("queries", -1));
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(nqueries));
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("cached", -1));
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(ncached));
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("elapsed", -1));
+	Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewWideIntObj(
+				((Tcl_WideInt) now.sec - startPtr->sec) * 1000000
+				+ (now.usec - startPtr->usec)));
+
+	if (statsPtr->valid) {
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewStringObj("sendcalls", -1));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewWideIntObj(statsPtr->sendcalls));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewStringObj("recvcalls", -1));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewWideIntObj(statsPtr->recvcalls));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewStringObj("sent", -1));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewWideIntObj(statsPtr->sent));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewStringObj("received", -1));
+		Tcl_ListObjAppendElement(NULL, statsObj,
+				Tcl_NewWideIntObj(statsPtr->received));
+	}
 
-	return interpData;
+	return statsObj;
 }
 
+/* ::sysdns::resolvemany queries ?options?
+ * Each query is either a name or a list of a name and a query type.
+ * Returns a dictionary mapping queries to their result sets;
+ * queries which failed are left out of it, and the dictionary
+ * mapping them to error messages is put into the variable named
+ * by the -errorvar option (if given). Statistics of the batch
+ * are put into the variable named by the -statsvar option. */
 static int
-Sysdns_Resolve (
+Sysdns_ResolveMany (
 	ClientData clientData,
 	Tcl_Interp *interp,
 	int objc,
 	Tcl_Obj *const objv[]
 	)
 {
-	const char *optnames[] = {
-		"-class", "-type",
-		"-question", "-answer", "-authority", "-additional", "-all",
-		"-detailed", "-headers",
-		"-sectionnames", "-fieldnames",
-		NULL };
-	typedef enum {
-		OPT_CLASS, OPT_TYPE,
-		OPT_QUESTION, OPT_ANSWER, OPT_AUTH, OPT_ADD, OPT_ALL,
-		OPT_DETAIL, OPT_HEADERS,
-		OPT_SECTNAMES, OPT_NAMES
-	} opts_t;
-
-	int opt, i, sections;
-	unsigned short qclass, qtype;
-	unsigned int resflags;
+	PkgInterpData *interpData;
+	QueryOptions opts;
+	BatchQuery *queries, **todo;
+	BatchStats stats;
+	Tcl_Obj **elems, *resObj, *errObj;
+	Tcl_Time start;
+	int nelems, ntodo, ncached, i, res;
 
 	if (objc < 2) {
 		Tcl_WrongNumArgs(interp, 1, objv,
-				"query ?options?");
+				"queries ?options?");
 		return TCL_ERROR;
 	}
 
-	qclass  = 1; /* default domain system class: "IN" */
-	qtype   = 1; /* default DNS question type: "A" */
-	resflags = 0;
-	sections = 0;
+	if (ParseQueryOptions(interp, ResolveManyOptMap,
+				objc - 2, objv + 2, &opts) != TCL_OK) {
+		return TCL_ERROR;
+	}
 
-	for (i = 2; i < objc; ) {
-		if (Tcl_GetIndexFromObj(interp, objv[i],
-					optnames, "option", 0, &opt) != TCL_OK) {
-			return TCL_ERROR;
+	if (Tcl_ListObjGetElements(interp, objv[1], &nelems, &elems) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	interpData = (PkgInterpData *) clientData;
+
+	Tcl_GetTime(&start);
+
+	queries = (BatchQuery *) ckalloc(sizeof(BatchQuery) * (nelems + 1));
+	todo    = (BatchQuery **) ckalloc(sizeof(BatchQuery *) * (nelems + 1));
+	memset(queries, 0, sizeof(BatchQuery) * nelems);
+
+	res = TCL_OK;
+	for (i = 0; i < nelems; ++i) {
+		Tcl_Obj **items;
+		int nitems;
+
+		if (Tcl_ListObjGetElements(interp, elems[i], &nitems, &items) != TCL_OK) {
+			res = TCL_ERROR;
+			break;
+		}
+		if (nitems < 1 || nitems > 2) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "Invalid query \"", Tcl_GetString(elems[i]),
+					"\": must be a name or a name/type pair", NULL);
+			res = TCL_ERROR;
+			break;
 		}
 
-		switch ((opts_t) opt) {
-			case OPT_CLASS:
-				if (i == objc - 1) {
-					Tcl_SetResult(interp,
-							"wrong # args: option \"-class\" "
-							"requires an argument", TCL_STATIC);
-					return TCL_ERROR;
-				}
-				if (DNSQClassMnemonicToIndex(interp,
-							objv[i + 1], &qclass) != TCL_OK) {
-					return TCL_ERROR;
-				}
-				i += 2;
-				break;
-			case OPT_TYPE:
-				if (i == objc - 1) {
-					Tcl_SetResult(interp,
-							"wrong # args: option \"-type\" "
-							"requires an argument", TCL_STATIC);
-					return TCL_ERROR;
-				}
-				if (DNSQTypeMnemonicToIndex(interp,
-							objv[i + 1], &qtype) != TCL_OK) {
-					return TCL_ERROR;
+		queries[i].queryObj = items[0];
+		queries[i].qclass   = opts.qclass;
+		queries[i].qtype    = opts.qtype;
+		Tcl_IncrRefCount(queries[i].queryObj);
+
+		if (nitems == 2 && DNSQTypeMnemonicToIndex(interp,
+					items[1], &queries[i].qtype) != TCL_OK) {
+			res = TCL_ERROR;
+			break;
+		}
+	}
+
+	ntodo   = 0;
+	ncached = 0;
+	if (res == TCL_OK) {
+		for (i = 0; i < nelems; ++i) {
+			BatchQuery *qPtr = &queries[i];
+
+			if (! opts.nocache) {
+				qPtr->resObj = DNSCacheLookup(qPtr->queryObj,
+						qPtr->qclass, qPtr->qtype, opts.resflags,
+						interpData->bopts);
+				if (qPtr->resObj != NULL) {
+					qPtr->code = TCL_OK;
+					Tcl_IncrRefCount(qPtr->resObj);
+					++ncached;
+					continue;
 				}
-				i += 2;
-				break;
-			case OPT_QUESTION:
-				resflags |= RES_QUESTION;
-				++sections;
-				++i;
-				break;
-			case OPT_ANSWER:
-				resflags |= RES_ANSWER;
-				++sections;
-				++i;
-				break;
-			case OPT_AUTH:
-				resflags |= RES_AUTH;
-				++sections;
-				++i;
-				break;
-			case OPT_ADD:
-				resflags |= RES_ADD;
-				++sections;
-				++i;
-				break;
-			case OPT_ALL:
-				resflags |= RES_ALL;
-				sections = 5;
-				++i;
-				break;
-			case OPT_DETAIL:
-			case OPT_HEADERS:
-				resflags |= RES_DETAIL;
-				++i;
-				break;
-			case OPT_SECTNAMES:
-				resflags |= RES_SECTNAMES;
-				++i;
-				break;
-			case OPT_NAMES:
-				resflags |= RES_NAMES;
-				++i;
-				break;
+			}
+
+			if (opts.cacheonly) {
+				SetNotCachedError(interp);
+				Sysdns_BatchResult(interp, qPtr, TCL_ERROR);
+				continue;
+			}
+
+			todo[ntodo++] = qPtr;
 		}
+
+		res = ResolveBatch(interpData, interp, todo, ntodo,
+				opts.resflags, opts.concurrency, &stats);
 	}
 
-	if (sections == 0) {
-		resflags |= RES_ANSWER;
-	} else if (sections > 1) {
-		resflags |= RES_MULTIPLE;
+	if (res == TCL_OK) {
+		resObj = Tcl_NewListObj(0, NULL);
+		errObj = Tcl_NewListObj(0, NULL);
+
+		for (i = 0; i < nelems; ++i) {
+			Tcl_ListObjAppendElement(NULL,
+					queries[i].code == TCL_OK ? resObj : errObj, elems[i]);
+			Tcl_ListObjAppendElement(NULL,
+					queries[i].code == TCL_OK ? resObj : errObj,
+					queries[i].resObj);
+		}
+
+		Tcl_IncrRefCount(resObj);
+		Tcl_IncrRefCount(errObj);
+
+		if (opts.errorVarObj != NULL && Tcl_ObjSetVar2(interp,
+					opts.errorVarObj, NULL, errObj, TCL_LEAVE_ERR_MSG) == NULL) {
+			res = TCL_ERROR;
+		} else if (opts.statsVarObj != NULL && Tcl_ObjSetVar2(interp,
+					opts.statsVarObj, NULL,
+					BatchStatsObj(nelems, ncached, &start, &stats),
+					TCL_LEAVE_ERR_MSG) == NULL) {
+			res = TCL_ERROR;
+		} else {
+			Tcl_SetObjResult(interp, resObj);
+		}
+
+		Tcl_DecrRefCount(resObj);
+		Tcl_DecrRefCount(errObj);
+	}
+
+	for (i = 0; i < nelems; ++i) {
+		if (queries[i].queryObj != NULL) {
+			Tcl_DecrRefCount(queries[i].queryObj);
+		}
+		if (queries[i].resObj != NULL) {
+			Tcl_DecrRefCount(queries[i].resObj);
+		}
 	}
+	ckfree((char *) todo);
+	ckfree((char *) queries);
 
-	return Impl_Resolve(ImplClientData(clientData),
-			interp, objv[1], qclass, qtype, resflags);
+	return res;
 }
 
 static int
@@ -404,7 +1973,73 @@ Sysdns_Reinit (
 		}
 	}
 
-	return Impl_Reinit(ImplClientData(clientData), interp, flags);
+	/* The system configuration might have changed */
+	DNSCacheFlush();
+
+	if (Impl_Reinit(ImplClientData(clientData), interp, flags) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	return UpdateBackendOptions((PkgInterpData *) clientData, interp);
+}
+
+/* Gets the value of an option handled by the generic layer */
+static int
+GetGenericOption (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	const int option,
+	Tcl_Obj **resObjPtr
+	)
+{
+	int nworkers, qdepth;
+
+	switch ((cget_opt_t) option) {
+		case OPT_QUERYTYPES:
+		{
+			int i;
+			Tcl_Obj *listObj;
+
+			listObj = Tcl_NewListObj(0, NULL);
+			i = 0;
+			while (1) {
+				if (pkgData.b_qtypes[i] == 0) break;
+				Tcl_ListObjAppendElement(interp, listObj,
+						DNSQTypeIndexToMnemonic(pkgData.b_qtypes[i]));
+				++i;
+			};
+			*resObjPtr = listObj;
+			return TCL_OK;
+		}
+		case OPT_BACKEND:
+			*resObjPtr = Tcl_NewStringObj(pkgData.b_name, -1);
+			return TCL_OK;
+		case OPT_WORKERS:
+			DNSPoolGetConfig(&nworkers, &qdepth);
+			*resObjPtr = Tcl_NewIntObj(nworkers);
+			return TCL_OK;
+		case OPT_QUEUEDEPTH:
+			DNSPoolGetConfig(&nworkers, &qdepth);
+			*resObjPtr = Tcl_NewIntObj(qdepth);
+			return TCL_OK;
+		case OPT_POOLSTATS:
+			*resObjPtr = DNSPoolStats();
+			return TCL_OK;
+		case OPT_CACHESIZE:
+			*resObjPtr = Tcl_NewIntObj(DNSCacheGetSize());
+			return TCL_OK;
+		case OPT_CACHESTATS:
+			*resObjPtr = DNSCacheStats();
+			return TCL_OK;
+		case OPT_CACHEFILE:
+			*resObjPtr = DNSCacheFileGetPath();
+			return TCL_OK;
+		case OPT_EDNSSIZE:
+			*resObjPtr = Tcl_NewIntObj(pkgData.ednssize);
+			return TCL_OK;
+	}
+
+	return TCL_ERROR; /* Never reached */
 }
 
 static int
@@ -435,7 +2070,13 @@ Configure_GetAll (
 		Tcl_ListObjAppendElement(interp, resObj,
 				Tcl_NewStringObj(optname, -1));
 		/* TODO implement getting default values */
-		if (Impl_CgetBackend(ImplClientData(clientData), interp,
+		if (flagvalues[i] > __DBC_MAX) {
+			if (GetGenericOption(clientData, interp, flagvalues[i],
+					&flagObj) != TCL_OK) {
+				Tcl_DecrRefCount(resObj);
+				return TCL_ERROR;
+			}
+		} else if (Impl_CgetBackend(ImplClientData(clientData), interp,
 				flagvalues[i], &flagObj) != TCL_OK) {
 			Tcl_DecrRefCount(resObj);
 			return TCL_ERROR;
@@ -471,7 +2112,11 @@ Configure_Set (
 	const char **optnames;
 	const int *flagvalues;
 	int i, nopts, defaults, opt;
+	int cap, val;
 	int set, clear;
+	int nworkers, qdepth, cachesize, ednssize;
+	int poolconf;
+	Tcl_Obj *cachefileObj;
 	parse_mode mode;
 	round_result_t res;
 
@@ -483,10 +2128,15 @@ Configure_Set (
 	nopts    = 0;
 	defaults = 0;
 	mode     = PMODE_OPTION;
+	cap      = 0; /* Set while parsing an option, read with its value */
 
-	for (i = 1; i < objc; ) {
-		int cap, val;
+	DNSPoolGetConfig(&nworkers, &qdepth);
+	poolconf  = 0;
+	cachesize = DNSCacheGetSize();
+	cachefileObj = NULL;
+	ednssize  = pkgData.ednssize;
 
+	for (i = 1; i < objc; ) {
 		res = RRES_OK;
 
 		switch (mode) {
@@ -526,6 +2176,45 @@ Configure_Set (
 				break;
 
 			case PMODE_VALUE:
+				if (cap == OPT_CACHEFILE) {
+					cachefileObj = objv[i];
+					++nopts;
+					mode = PMODE_OPTION;
+
+					++i;
+					break;
+				}
+
+				if (cap > __DBC_MAX) {
+					if (Tcl_GetIntFromObj(interp, objv[i], &val) != TCL_OK) {
+						res = RRES_ERROR;
+						break;
+					}
+					switch ((cget_opt_t) cap) {
+						case OPT_WORKERS:
+							nworkers = val;
+							poolconf = 1;
+							break;
+						case OPT_QUEUEDEPTH:
+							qdepth = val;
+							poolconf = 1;
+							break;
+						case OPT_CACHESIZE:
+							cachesize = val;
+							break;
+						case OPT_EDNSSIZE:
+							ednssize = val;
+							break;
+						default:
+							break;
+					}
+					++nopts;
+					mode = PMODE_OPTION;
+
+					++i;
+					break;
+				}
+
 				if (Tcl_GetBooleanFromObj(interp, objv[i], &val) != TCL_OK) {
 					res = RRES_ERROR;
 					break;
@@ -570,6 +2259,26 @@ Configure_Set (
 					"cannot be used together", TCL_STATIC);
 			return TCL_ERROR;
 		}
+		if (cachesize < 0) {
+			Tcl_SetResult(interp, "Cache size must be "
+					"a non-negative integer", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		if (ednssize != 0 && (ednssize < 512 || ednssize > 65535)) {
+			Tcl_SetResult(interp, "EDNS payload size must be 0 "
+					"or between 512 and 65535", TCL_STATIC);
+			return TCL_ERROR;
+		}
+		/* Only touch the pool if asked to: there may be none */
+		if (poolconf && DNSPoolConfigure(interp, nworkers, qdepth) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (cachefileObj != NULL && DNSCacheFileOpen(interp,
+					Tcl_GetString(cachefileObj)) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		DNSCacheSetSize(cachesize);
+		pkgData.ednssize = ednssize;
 		/* Injecting collected caps */
 		if (Impl_ConfigureBackend(ImplClientData(clientData),
 					interp, set, clear) != TCL_OK) {
@@ -577,7 +2286,8 @@ Configure_Set (
 		}
 	}
 
-	return TCL_OK;
+	/* Cached result sets are keyed by the options in effect */
+	return UpdateBackendOptions((PkgInterpData *) clientData, interp);
 }
 
 static int
@@ -622,45 +2332,31 @@ Sysdns_Cget (
 	}
 
 	flag = flagvalues[opt];
-	switch (flag) {
-		case OPT_QUERYTYPES:
-		{
-			int i;
-			Tcl_Obj *listObj;
 
-			listObj = Tcl_NewListObj(0, NULL);
-			i = 0;
-			while (1) {
-				if (pkgData.b_qtypes[i] == 0) break;
-				Tcl_ListObjAppendElement(interp, listObj,
-						DNSQTypeIndexToMnemonic(pkgData.b_qtypes[i]));
-				++i;
-			};
-			Tcl_SetObjResult(interp, listObj);
-			return TCL_OK;
+	if (flag > __DBC_MAX) {
+		Tcl_Obj *resObj;
+
+		if (GetGenericOption(clientData, interp, flag, &resObj) != TCL_OK) {
+			return TCL_ERROR;
 		}
-		case OPT_BACKEND:
-			Tcl_SetObjResult(interp,
-					Tcl_NewStringObj(pkgData.b_name, -1));
-			return TCL_OK;
-		default:
-		{
-			Tcl_Obj *resObj;
+		Tcl_SetObjResult(interp, resObj);
+		return TCL_OK;
+	} else {
+		Tcl_Obj *resObj;
 
-			if (! (pkgData.b_caps & flag)) {
-				Tcl_ResetResult(interp);
-				Tcl_AppendResult(interp, "Bad option \"", optnames[opt],
-						"\": not supported by the DNS resolution backend", NULL);
-				return TCL_ERROR;
-			}
+		if (! (pkgData.b_caps & flag)) {
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "Bad option \"", optnames[opt],
+					"\": not supported by the DNS resolution backend", NULL);
+			return TCL_ERROR;
+		}
 
-			if (Impl_CgetBackend(ImplClientData(clientData), interp,
-					flag, &resObj) != TCL_OK) {
-				return TCL_ERROR;
-			} else {
-				Tcl_SetObjResult(interp, resObj);
-				return TCL_OK;
-			}
+		if (Impl_CgetBackend(ImplClientData(clientData), interp,
+				flag, &resObj) != TCL_OK) {
+			return TCL_ERROR;
+		} else {
+			Tcl_SetObjResult(interp, resObj);
+			return TCL_OK;
 		}
 	}
 }
@@ -676,15 +2372,16 @@ Sysdns_Init(Tcl_Interp * interp)
 	ClientData pkgInterpData;
 
 #ifdef USE_TCL_STUBS
-	if (Tcl_InitStubs(interp, "8.1", 0) == NULL) {
+	if (Tcl_InitStubs(interp, "8.5", 0) == NULL) {
 		return TCL_ERROR;
 	}
 #endif
-	if (Tcl_PkgRequire(interp, "Tcl", "8.1", 0) == NULL) {
+	if (Tcl_PkgRequire(interp, "Tcl", "8.5", 0) == NULL) {
 		return TCL_ERROR;
 	}
 
 	Sysdns_PkgInit();
+	DNSInitMnemonics();
 
 	if (Sysdns_InterpInit(interp, &pkgInterpData) != TCL_OK) {
 		return TCL_ERROR;
@@ -693,6 +2390,24 @@ Sysdns_Init(Tcl_Interp * interp)
 	Tcl_CreateObjCommand(interp, "::sysdns::resolve",
 			Sysdns_Resolve,
 			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::query",
+			Sysdns_Query,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::rr",
+			Sysdns_RR,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::rrcount",
+			Sysdns_RRCount,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::parse",
+			Sysdns_Parse,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::transfer",
+			Sysdns_Transfer,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
+	Tcl_CreateObjCommand(interp, "::sysdns::resolvemany",
+			Sysdns_ResolveMany,
+			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
 	Tcl_CreateObjCommand(interp, "::sysdns::nameservers",
 			Sysdns_Nameservers,
 			Sysdns_RefInterpData(pkgInterpData), Sysdns_Cleanup);
@@ -20,6 +20,23 @@
 #define RES_FULL        (RES_DETAIL | RES_NAMES)
 #define RES_MULTIPLE    256  /* more than one record in the output list */
 #define RES_WANTLIST   (RES_SECTNAMES | RES_MULTIPLE)
+#define RES_LAZY        512  /* Return the reply indexed, not parsed (BF_LAZY) */
+#define RES_DICT        1024 /* Make records and named sections dicts */
+#define RES_RAW         2048 /* Return the reply unparsed (like DBC_RAWRESULT) */
+#define RES_COLUMNS     4096 /* Make sections lists of fields (BF_COLUMNS) */
+#define RES_NUMERIC     8192 /* Make types and classes integers */
+
+/* Fields of RRs selected by -fields; none set means all of them */
+#define RES_F_NAME      0x04000
+#define RES_F_TYPE      0x08000
+#define RES_F_CLASS     0x10000
+#define RES_F_TTL       0x20000
+#define RES_F_RDLENGTH  0x40000
+#define RES_F_RDATA     0x80000
+#define RES_FIELDS      (RES_F_NAME | RES_F_TYPE | RES_F_CLASS | RES_F_TTL \
+		| RES_F_RDLENGTH | RES_F_RDATA)
+#define RES_WANTFIELD(resflags, field) \
+	(! ((resflags) & RES_FIELDS) || ((resflags) & (field)))
 
 /* Flags for the Impl_Reinit command */
 #define REINIT_RESETOPTS 1   /* reset resolver options */
@@ -34,18 +51,65 @@ typedef enum {
 	DBC_NOWIRE    = 0x0020, /* Look at local cache only */
 	DBC_SEARCH    = 0x0040, /* Use search lists (search unqualified names in defined domains) */
 	DBC_PRIMARY   = 0x0080, /* Use only primary DNS */
+	DBC_STAYOPEN  = 0x0100, /* Keep TCP connections open between queries */
 	__DBC_MIN     = DBC_DEFAULTS,
-	__DBC_MAX     = DBC_PRIMARY
+	__DBC_MAX     = DBC_STAYOPEN
 } dns_backend_cap_t;
 /* DBC_DEFDOMAIN ? -- append default domain */
 /* DBC_NORECURSION ? -- don't request recursive processing on the server */
-/* DBC_STAYOPEN ? -- keep TCP connection open between queries */
+
+/* Features of DNS resolution backends (not user-configurable) */
+#define BF_ASYNC        1    /* Impl_ResolveAsync is implemented */
+#define BF_BATCH        2    /* Impl_ResolveBatch is implemented */
+#define BF_EDNS         4    /* Queries can carry an EDNS0 OPT RR */
+#define BF_PREPARE      8    /* Impl_PrepareQuery and friends are implemented */
+#define BF_LAZY         16   /* Results can be lazy (RES_LAZY) */
+#define BF_PARSE        32   /* Impl_ParseMessage is implemented */
+#define BF_XFER         64   /* Impl_Transfer is implemented */
+#define BF_COLUMNS      128  /* Results can be made of columns (RES_COLUMNS) */
+
+/* Kinds of query outcomes */
+typedef enum {
+	RESOLVE_DATA = 0,             /* The answer has RRs */
+	RESOLVE_NXDOMAIN,             /* The name does not exist */
+	RESOLVE_NODATA                /* The name exists but has no RRs of this type */
+} resolve_status_t;
+
+/* Information about the outcome of a query reported by backends
+ * along with the result set */
+typedef struct {
+	resolve_status_t status;
+	unsigned long ttl;            /* Seconds the result set stays valid, 0 if unknown.
+	                               * For negative answers it's the negative
+	                               * caching TTL from the SOA (RFC 2308) */
+} ResolveInfo;
+
+/* A query of a batch resolved by ::sysdns::resolvemany */
+typedef struct {
+	Tcl_Obj *queryObj;            /* Name to query for */
+	unsigned short qclass;
+	unsigned short qtype;
+	int code;                     /* Outcome of the query */
+	Tcl_Obj *resObj;              /* Result set or error message */
+	ResolveInfo info;
+} BatchQuery;
+
+/* Network traffic of a batch, reported by backends
+ * which talk to the nameservers themselves */
+typedef struct {
+	int valid;                    /* Whether the backend filled the counters in */
+	Tcl_WideInt sendcalls;        /* System calls made to send queries */
+	Tcl_WideInt recvcalls;        /* System calls made to receive replies */
+	Tcl_WideInt sent;             /* Datagrams sent */
+	Tcl_WideInt received;         /* Datagrams received */
+} BatchStats;
 
 /* Information about a DNS resolution backend */
 typedef struct {
 	const char *name;             /* Backend proper name (like "ADNS") */
 	int caps;                     /* Backend capabilities */
 	const unsigned short *qtypes; /* Query types supported by the backend */
+	int features;                 /* Backend features (BF_* flags) */
 } BackendInfo;
 
 void
@@ -72,7 +136,135 @@ Impl_Resolve (
 	Tcl_Obj *queryObj,
 	const unsigned short qclass,
 	const unsigned short qtype,
-	const unsigned int resflags);
+	const unsigned int resflags,
+	ResolveInfo *infoPtr);
+
+/* Submits the query and arranges for Sysdns_AsyncResult to be called
+ * with the command prefix cmdObj from the event loop once the reply
+ * is available. Only called for backends having the BF_ASYNC feature. */
+int
+Impl_ResolveAsync (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj);
+
+/* Resolves the queries of the batch (all formatted according to
+ * resflags) keeping at most the given number of them in flight
+ * at once and reports their outcomes using Sysdns_BatchResult.
+ * Only called for backends having the BF_BATCH feature. */
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr);
+
+/* Makes the backend's ready-to-send form of a query which is going
+ * to be resolved many times; *preparedPtr may be left NULL if there's
+ * nothing to prepare. Only called for backends having the BF_PREPARE
+ * feature, as are the two functions below. */
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr);
+
+/* Resolves the prepared query like Impl_Resolve does if cmdObj is NULL,
+ * or like Impl_ResolveAsync does otherwise (infoPtr is NULL then) */
+int
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr);
+
+/* Frees the prepared query; queries in flight made from it
+ * must not be affected */
+void
+Impl_FreePreparedQuery (
+	ClientData prepared);
+
+/* Formats the DNS message msg into a result set as if it was the reply
+ * to a query. Only called for backends having the BF_PARSE feature. */
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr);
+
+/* Receives the records of a message one by one from
+ * Impl_ParseMessageRRs along with the name of their section */
+typedef int (Sysdns_RRProc) (
+	Tcl_Interp *interp,
+	ClientData clientData,
+	Tcl_Obj *sectionObj,
+	Tcl_Obj *rrObj);
+
+/* Passes the records of the sections of the message selected by resflags
+ * (formatted accordingly) to proc instead of making a result set; stops
+ * when proc returns anything but TCL_OK or TCL_CONTINUE and returns that.
+ * Only called for backends having the BF_PARSE feature. */
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData);
+
+/* Transfers the zone from the nameserver given as serverObj (or
+ * the first configured one if it's NULL) over TCP: qtype is AXFR,
+ * or IXFR asking for the changes since the serial. The records
+ * of the reply are handed to proc (formatted according to resflags)
+ * as the messages carrying them arrive, until the transfer ends
+ * or proc returns anything but TCL_OK or TCL_CONTINUE. Only called
+ * for backends having the BF_XFER feature. */
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData);
+
+/* Accessors of lazy result sets, made by backends having the BF_LAZY
+ * feature when RES_LAZY is set. The section is one of RES_QUESTION,
+ * RES_ANSWER, RES_AUTH and RES_ADD; the record object returned
+ * is owned by the result set. */
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr);
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr);
 
 int
 Impl_Reinit (
@@ -94,3 +286,21 @@ Impl_CgetBackend (
 	const int option,
 	Tcl_Obj **resObjPtr);
 
+/* Services provided to the backends by the generic layer */
+
+void
+Sysdns_AsyncResult (
+	Tcl_Interp *interp,
+	Tcl_Obj *cmdObj,
+	const int code,
+	const ResolveInfo *infoPtr);
+
+void
+Sysdns_BatchResult (
+	Tcl_Interp *interp,
+	BatchQuery *queryPtr,
+	const int code);
+
+int
+Sysdns_GetEDNSSize (void);
+
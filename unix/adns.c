@@ -9,19 +9,51 @@
 #include <tcl.h>
 #include <adns.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
 #include "tclsysdns.h"
 #include "dnsparams.h"
 #include "resfmt.h"
 #include "qtypes.h"
 
+typedef struct AsyncQuery AsyncQuery;
+
+typedef struct {
+	int fd;
+	int mask;
+} WatchedFile;
+
 typedef struct {
 	adns_state astate;
 	adns_queryflags qflags;
 	int opts;
+	Tcl_Interp *interp;       /* Interp to deliver async results to */
+	AsyncQuery *pending;      /* Submitted async queries (linked list) */
+	WatchedFile *watched;     /* ADNS sockets registered with the notifier */
+	int nwatched;
+	int watchedsz;
 } InterpData;
 
+/* State of a query submitted by Impl_ResolveAsync */
+struct AsyncQuery {
+	InterpData *owner;
+	adns_query query;
+	Tcl_Obj *cmdObj;          /* Command prefix to call with the result */
+	unsigned int resflags;
+	AsyncQuery *prevPtr;
+	AsyncQuery *nextPtr;
+};
+
+/* Event delivering the answer to an async query to the Tcl event loop.
+ * answPtr is NULL if the query was cancelled. */
+typedef struct {
+	Tcl_Event header;
+	AsyncQuery *aqPtr;
+	adns_answer *answPtr;
+} AsyncEvent;
+
 const adns_queryflags def_qflags = (adns_qf_quoteok_query
 		| adns_qf_quoteok_anshost | adns_qf_owner);
 
@@ -104,8 +136,12 @@ Impl_GetBackendInfo (
 	binfo->name   = "ADNS";
 	binfo->caps   = DBC_DEFAULTS | DBC_TCP | DBC_SEARCH;
 	binfo->qtypes = SupportedQTypes;
+	binfo->features = BF_ASYNC | BF_BATCH;
 }
 
+static void AdnsSetupProc (ClientData clientData, int flags);
+static void AdnsCheckProc (ClientData clientData, int flags);
+
 int
 Impl_Init (
 	Tcl_Interp *interp,
@@ -120,14 +156,25 @@ Impl_Init (
 	}
 
 	dataPtr = (InterpData *) ckalloc(sizeof(InterpData));
-	dataPtr->astate = st;
-	dataPtr->qflags = def_qflags;
+	dataPtr->astate    = st;
+	dataPtr->qflags    = def_qflags;
+	dataPtr->interp    = interp;
+	dataPtr->pending   = NULL;
+	dataPtr->watched   = NULL;
+	dataPtr->nwatched  = 0;
+	dataPtr->watchedsz = 0;
+
+	Tcl_CreateEventSource(AdnsSetupProc, AdnsCheckProc, (ClientData) dataPtr);
 
 	*clientDataPtr = (ClientData) dataPtr;
 
 	return TCL_OK;
 }
 
+static void AdnsUnwatchFiles (InterpData *interpData);
+static void AdnsCancelPending (InterpData *interpData, const int notify);
+static int AdnsDeleteEventFilter (Tcl_Event *evPtr, ClientData clientData);
+
 void
 Impl_Cleanup (
 	ClientData clientData
@@ -135,7 +182,15 @@ Impl_Cleanup (
 {
 	InterpData *interpData = (InterpData *) clientData;
 
-	free(interpData->astate);
+	AdnsCancelPending(interpData, 0);
+	Tcl_DeleteEvents(AdnsDeleteEventFilter, (ClientData) interpData);
+	AdnsUnwatchFiles(interpData);
+	Tcl_DeleteEventSource(AdnsSetupProc, AdnsCheckProc, (ClientData) interpData);
+
+	if (interpData->watched != NULL) {
+		ckfree((char *) interpData->watched);
+	}
+	adns_finish(interpData->astate);
 	ckfree((char *) interpData);
 }
 
@@ -450,16 +505,8 @@ DNSParseRRSet (
 
 	if (resflags & RES_ANSWER) {
 		Tcl_Obj *sectObj;
-		if (resflags & RES_SECTNAMES) {
-			Tcl_ListObjAppendElement(interp, resObj,
-					Tcl_NewStringObj("answer", -1));
-		}
-		if (resflags & RES_WANTLIST) {
-			sectObj = Tcl_NewListObj(0, NULL);
-			Tcl_ListObjAppendElement(interp, resObj, sectObj);
-		} else {
-			sectObj = resObj;
-		}
+
+		sectObj = DNSFormatSection(interp, resflags, resObj, "answer");
 		for (i = 0; i < answ->nrrs; ++i) {
 			Tcl_Obj *dataObj;
 
@@ -468,16 +515,16 @@ DNSParseRRSet (
 			}
 
 			if (resflags & RES_DETAIL) {
-				Tcl_Obj *rrObj = Tcl_NewListObj(0, NULL);
+				Tcl_Obj *rrObj = DNSFormatNewRecord(resflags);
 
 				DNSFormatRRHeader(interp, resflags, rrObj,
 						answ->owner,
 						answ->type,
 						qclass,
 						ttl,
-						answ->rrsz); /* that's rdlength */
+						answ->rrsz, /* that's rdlength */
+						dataObj);
 
-				Tcl_ListObjAppendElement(interp, rrObj, dataObj);
 				Tcl_ListObjAppendElement(interp, sectObj, rrObj);
 			} else {
 				Tcl_ListObjAppendElement(interp, sectObj, dataObj);
@@ -486,23 +533,11 @@ DNSParseRRSet (
 	}
 
 	if (resflags & RES_AUTH) {
-		if (resflags & RES_SECTNAMES) {
-			Tcl_ListObjAppendElement(interp, resObj,
-					Tcl_NewStringObj("authority", -1));
-		}
-		if (resflags & RES_WANTLIST) {
-			Tcl_ListObjAppendElement(interp, resObj, Tcl_NewObj());
-		}
+		DNSFormatSection(interp, resflags, resObj, "authority");
 	}
 
 	if (resflags & RES_ADD) {
-		if (resflags & RES_SECTNAMES) {
-			Tcl_ListObjAppendElement(interp, resObj,
-					Tcl_NewStringObj("additional", -1));
-		}
-		if (resflags & RES_WANTLIST) {
-			Tcl_ListObjAppendElement(interp, resObj, Tcl_NewObj());
-		}
+		DNSFormatSection(interp, resflags, resObj, "additional");
 	}
 
 	return TCL_OK;
@@ -532,6 +567,64 @@ AdnsNormalizeQueryType (
 	}
 }
 
+static void
+AdnsSetInfoTTL (
+	const adns_answer *answPtr,
+	ResolveInfo *infoPtr
+	)
+{
+	time_t now;
+
+	time(&now);
+	if (answPtr->expires > now) {
+		infoPtr->ttl = answPtr->expires - now;
+	}
+}
+
+/* Converts the ADNS answer into a result set (or an error)
+ * and sets it as the result of interp */
+static int
+AdnsSetResult (
+	Tcl_Interp *interp,
+	const adns_answer *answPtr,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	Tcl_Obj *answObj;
+
+	if (answPtr->status != adns_s_ok) {
+		switch (answPtr->status) {
+			case adns_s_nxdomain:
+			case adns_s_nodata:
+				/* ADNS derives the expiry of negative answers
+				 * from the SOA just like for positive ones */
+				infoPtr->status = answPtr->status == adns_s_nxdomain
+					? RESOLVE_NXDOMAIN : RESOLVE_NODATA;
+				AdnsSetInfoTTL(answPtr, infoPtr);
+				Tcl_ResetResult(interp);
+				return TCL_OK;
+			default:
+				AdnsSetError(interp, answPtr->status);
+				return TCL_ERROR;
+		}
+	}
+
+	answObj = Tcl_NewListObj(0, NULL);
+
+	if (DNSParseRRSet(interp, answPtr, resflags, answObj) != TCL_OK) {
+		Tcl_DecrRefCount(answObj);
+		return TCL_ERROR;
+	}
+
+	if (answPtr->nrrs > 0) {
+		AdnsSetInfoTTL(answPtr, infoPtr);
+	}
+
+	Tcl_SetObjResult(interp, answObj);
+	return TCL_OK;
+}
+
 int
 Impl_Resolve (
 	ClientData clientData,
@@ -539,13 +632,13 @@ Impl_Resolve (
 	Tcl_Obj *queryObj,
 	const unsigned short qclass,
 	const unsigned short qtype,
-	const unsigned int resflags
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
 	)
 {
 	InterpData *interpData;
 	adns_answer *answPtr;
 	int res;
-	Tcl_Obj *answObj;
 
 	interpData = (InterpData *) clientData;
 
@@ -558,31 +651,537 @@ Impl_Resolve (
 		return TCL_ERROR;
 	}
 
-	if (answPtr->status != adns_s_ok) {
-		switch (answPtr->status) {
-			case adns_s_nxdomain:
-			case adns_s_nodata:
-				Tcl_ResetResult(interp);
-				return TCL_OK;
-			default:
-				AdnsSetError(interp, answPtr->status);
-				return TCL_ERROR;
+	res = AdnsSetResult(interp, answPtr, resflags, infoPtr);
+
+	free(answPtr);
+
+	return res;
+}
+
+/*
+ * Asynchronous resolution.
+ *
+ * Queries submitted by Impl_ResolveAsync are kept in the "pending" list
+ * of the interp data. The event source created by Impl_Init registers
+ * the sockets ADNS wants to be watched with the notifier (and limits the
+ * notifier's blocking time according to the ADNS timeouts) while there
+ * are pending queries. Each time the notifier wakes up, ADNS is let to
+ * do all the processing it can without blocking and each completed query
+ * is turned into an event in the Tcl event queue. Servicing of such
+ * event formats the answer and calls the script callback.
+ */
+
+static void
+AdnsFreeQuery (
+	AsyncQuery *aqPtr
+	)
+{
+	Tcl_DecrRefCount(aqPtr->cmdObj);
+	ckfree((char *) aqPtr);
+}
+
+static void
+AdnsLinkQuery (
+	InterpData *interpData,
+	AsyncQuery *aqPtr
+	)
+{
+	aqPtr->prevPtr = NULL;
+	aqPtr->nextPtr = interpData->pending;
+	if (interpData->pending != NULL) {
+		interpData->pending->prevPtr = aqPtr;
+	}
+	interpData->pending = aqPtr;
+}
+
+static void
+AdnsUnlinkQuery (
+	InterpData *interpData,
+	AsyncQuery *aqPtr
+	)
+{
+	if (aqPtr->prevPtr != NULL) {
+		aqPtr->prevPtr->nextPtr = aqPtr->nextPtr;
+	} else {
+		interpData->pending = aqPtr->nextPtr;
+	}
+	if (aqPtr->nextPtr != NULL) {
+		aqPtr->nextPtr->prevPtr = aqPtr->prevPtr;
+	}
+}
+
+static int
+AdnsEventProc (
+	Tcl_Event *evPtr,
+	int flags
+	)
+{
+	AsyncEvent *eventPtr;
+	AsyncQuery *aqPtr;
+	Tcl_Interp *interp;
+	ResolveInfo info;
+	int res;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+
+	eventPtr = (AsyncEvent *) evPtr;
+	aqPtr    = eventPtr->aqPtr;
+	interp   = aqPtr->owner->interp;
+
+	memset(&info, 0, sizeof(info));
+
+	if (eventPtr->answPtr != NULL) {
+		res = AdnsSetResult(interp, eventPtr->answPtr, aqPtr->resflags, &info);
+		free(eventPtr->answPtr);
+	} else {
+		Tcl_SetObjResult(interp,
+				Tcl_NewStringObj("DNS query cancelled", -1));
+		res = TCL_ERROR;
+	}
+
+	/* The callback is free to delete the interp's commands
+	 * (and hence the interp data) so nothing but the query
+	 * itself may be touched after it returns */
+	Sysdns_AsyncResult(interp, aqPtr->cmdObj, res, &info);
+	AdnsFreeQuery(aqPtr);
+
+	return 1;
+}
+
+static int
+AdnsDeleteEventFilter (
+	Tcl_Event *evPtr,
+	ClientData clientData
+	)
+{
+	AsyncEvent *eventPtr;
+
+	if (evPtr->proc != AdnsEventProc) {
+		return 0;
+	}
+
+	eventPtr = (AsyncEvent *) evPtr;
+	if (eventPtr->aqPtr->owner != (InterpData *) clientData) {
+		return 0;
+	}
+
+	if (eventPtr->answPtr != NULL) {
+		free(eventPtr->answPtr);
+	}
+	AdnsFreeQuery(eventPtr->aqPtr);
+
+	return 1;
+}
+
+static void
+AdnsQueueEvent (
+	AsyncQuery *aqPtr,
+	adns_answer *answPtr
+	)
+{
+	AsyncEvent *eventPtr;
+
+	eventPtr = (AsyncEvent *) ckalloc(sizeof(AsyncEvent));
+	eventPtr->header.proc = AdnsEventProc;
+	eventPtr->aqPtr       = aqPtr;
+	eventPtr->answPtr     = answPtr;
+
+	Tcl_QueueEvent((Tcl_Event *) eventPtr, TCL_QUEUE_TAIL);
+}
+
+/* Cancels all pending async queries. If notify is true,
+ * their callbacks are still called (with an error),
+ * otherwise they are silently discarded. */
+static void
+AdnsCancelPending (
+	InterpData *interpData,
+	const int notify
+	)
+{
+	while (interpData->pending != NULL) {
+		AsyncQuery *aqPtr = interpData->pending;
+
+		AdnsUnlinkQuery(interpData, aqPtr);
+		adns_cancel(aqPtr->query);
+
+		if (notify) {
+			AdnsQueueEvent(aqPtr, NULL);
+		} else {
+			AdnsFreeQuery(aqPtr);
 		}
 	}
+}
 
-	answObj = Tcl_NewListObj(0, NULL);
+/* Lets ADNS do whatever it can without blocking and queues
+ * events for all the queries which are completed */
+static void
+AdnsProcess (
+	InterpData *interpData
+	)
+{
+	adns_processany(interpData->astate);
 
-	res = DNSParseRRSet(interp, answPtr, resflags, answObj);
+	while (interpData->pending != NULL) {
+		adns_query query;
+		adns_answer *answPtr;
+		void *context;
 
-	free(answPtr);
+		query = NULL;
+		if (adns_check(interpData->astate, &query,
+					&answPtr, &context) != 0) {
+			break;
+		}
 
-	if (res != TCL_OK) {
-		Tcl_DecrRefCount(answObj);
+		AdnsUnlinkQuery(interpData, (AsyncQuery *) context);
+		AdnsQueueEvent((AsyncQuery *) context, answPtr);
+	}
+}
+
+static void
+AdnsFileProc (
+	ClientData clientData,
+	int mask
+	)
+{
+	AdnsProcess((InterpData *) clientData);
+}
+
+static void
+AdnsUnwatchFiles (
+	InterpData *interpData
+	)
+{
+	int i;
+
+	for (i = 0; i < interpData->nwatched; ++i) {
+		Tcl_DeleteFileHandler(interpData->watched[i].fd);
+	}
+	interpData->nwatched = 0;
+}
+
+/* Brings the set of files watched by the notifier in sync
+ * with the set of descriptors reported by adns_beforepoll() */
+static void
+AdnsWatchFiles (
+	InterpData *interpData,
+	const struct pollfd fds[],
+	const int nfds
+	)
+{
+	int i, j;
+
+	/* Forget the files ADNS is not interested in anymore */
+	for (i = 0; i < interpData->nwatched; ) {
+		for (j = 0; j < nfds; ++j) {
+			if (fds[j].fd == interpData->watched[i].fd) break;
+		}
+		if (j == nfds) {
+			Tcl_DeleteFileHandler(interpData->watched[i].fd);
+			interpData->watched[i] = interpData->watched[--interpData->nwatched];
+		} else {
+			++i;
+		}
+	}
+
+	if (nfds > interpData->watchedsz) {
+		interpData->watchedsz = nfds;
+		interpData->watched = (WatchedFile *) ckrealloc(
+				(char *) interpData->watched,
+				sizeof(WatchedFile) * nfds);
+	}
+
+	for (j = 0; j < nfds; ++j) {
+		int mask;
+
+		mask = 0;
+		if (fds[j].events & (POLLIN | POLLPRI)) mask |= TCL_READABLE;
+		if (fds[j].events & POLLOUT) mask |= TCL_WRITABLE;
+
+		for (i = 0; i < interpData->nwatched; ++i) {
+			if (interpData->watched[i].fd == fds[j].fd) break;
+		}
+		if (i < interpData->nwatched) {
+			if (interpData->watched[i].mask == mask) continue;
+		} else {
+			interpData->watched[i].fd = fds[j].fd;
+			++interpData->nwatched;
+		}
+		interpData->watched[i].mask = mask;
+
+		Tcl_CreateFileHandler(fds[j].fd, mask,
+				AdnsFileProc, (ClientData) interpData);
+	}
+}
+
+static void
+AdnsSetupProc (
+	ClientData clientData,
+	int flags
+	)
+{
+	InterpData *interpData;
+	struct pollfd fds[ADNS_POLLFDS_RECOMMENDED * 2];
+	int nfds, timeout;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return;
+	}
+
+	interpData = (InterpData *) clientData;
+
+	if (interpData->pending == NULL) {
+		if (interpData->nwatched > 0) {
+			AdnsUnwatchFiles(interpData);
+		}
+		return;
+	}
+
+	nfds    = sizeof(fds) / sizeof(fds[0]);
+	timeout = -1;
+	if (adns_beforepoll(interpData->astate, fds, &nfds, &timeout, NULL) != 0) {
+		/* Can only be ERANGE which should not happen with
+		 * the recommended number of descriptors; poll again soon */
+		nfds    = 0;
+		timeout = 0;
+	}
+
+	AdnsWatchFiles(interpData, fds, nfds);
+
+	if (timeout >= 0) {
+		Tcl_Time blockTime;
+
+		blockTime.sec  = timeout / 1000;
+		blockTime.usec = (timeout % 1000) * 1000;
+		Tcl_SetMaxBlockTime(&blockTime);
+	}
+}
+
+static void
+AdnsCheckProc (
+	ClientData clientData,
+	int flags
+	)
+{
+	InterpData *interpData;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return;
+	}
+
+	interpData = (InterpData *) clientData;
+
+	if (interpData->pending != NULL) {
+		AdnsProcess(interpData);
+	}
+}
+
+int
+Impl_ResolveAsync (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj
+	)
+{
+	InterpData *interpData;
+	AsyncQuery *aqPtr;
+	int res;
+
+	interpData = (InterpData *) clientData;
+
+	aqPtr = (AsyncQuery *) ckalloc(sizeof(AsyncQuery));
+	aqPtr->owner    = interpData;
+	aqPtr->cmdObj   = cmdObj;
+	aqPtr->resflags = resflags;
+	Tcl_IncrRefCount(cmdObj);
+
+	res = adns_submit(interpData->astate,
+			Tcl_GetStringFromObj(queryObj, NULL),
+			AdnsNormalizeQueryType(qtype), interpData->qflags,
+			aqPtr, &aqPtr->query);
+	if (res != 0) {
+		AdnsFreeQuery(aqPtr);
+		DNSMsgSetPosixError(interp, res);
 		return TCL_ERROR;
-	} else {
-		Tcl_SetObjResult(interp, answObj);
-		return TCL_OK;
 	}
+
+	AdnsLinkQuery(interpData, aqPtr);
+
+	Tcl_ResetResult(interp);
+	return TCL_OK;
+}
+
+/* ADNS resolves all the submitted queries in parallel, so the batch
+ * is processed by keeping a window of submitted queries and waiting
+ * for them in order. Waiting for particular queries leaves alone
+ * any async queries submitted to the same ADNS state. */
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
+	)
+{
+	InterpData *interpData;
+	adns_query *handles;
+	int next, done, res;
+
+	interpData = (InterpData *) clientData;
+
+	handles = (adns_query *) ckalloc(sizeof(adns_query) * nqueries);
+
+	next = 0;
+	for (done = 0; done < nqueries; ++done) {
+		adns_answer *answPtr;
+		void *context;
+
+		while (next < nqueries && next - done < concurrency) {
+			res = adns_submit(interpData->astate,
+					Tcl_GetStringFromObj(queries[next]->queryObj, NULL),
+					AdnsNormalizeQueryType(queries[next]->qtype),
+					interpData->qflags, NULL, &handles[next]);
+			if (res != 0) {
+				DNSMsgSetPosixError(interp, res);
+				Sysdns_BatchResult(interp, queries[next], TCL_ERROR);
+				handles[next] = NULL;
+			}
+			++next;
+		}
+
+		if (handles[done] == NULL) {
+			continue;
+		}
+
+		res = adns_wait(interpData->astate, &handles[done], &answPtr, &context);
+		if (res != 0) {
+			DNSMsgSetPosixError(interp, res);
+			res = TCL_ERROR;
+		} else {
+			res = AdnsSetResult(interp, answPtr, resflags, &queries[done]->info);
+			free(answPtr);
+		}
+
+		Sysdns_BatchResult(interp, queries[done], res);
+	}
+
+	ckfree((char *) handles);
+
+	return TCL_OK;
+}
+
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+void
+Impl_FreePreparedQuery (
+	ClientData prepared
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+}
+
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData
+	)
+{
+	/* Never reached -- outer code checks for the BF_XFER feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
 }
 
 int
@@ -594,7 +1193,11 @@ Impl_Reinit (
 {
 	InterpData *interpData = (InterpData *) clientData;
 
-	free(interpData->astate);
+	/* Pending async queries can't survive the ADNS state
+	 * they were submitted to, so tell their owners */
+	AdnsCancelPending(interpData, 1);
+	AdnsUnwatchFiles(interpData);
+	adns_finish(interpData->astate);
 
 	if (AdnsInit(interp, &(interpData->astate)) != TCL_OK) {
 		return TCL_ERROR;
@@ -611,21 +1214,26 @@ int
 Impl_ConfigureBackend (
 	ClientData clientData,
 	Tcl_Interp *interp,
-	const int flags
+	const int set,
+	const int clear
 	)
 {
 	InterpData *interpData;
 
 	interpData = (InterpData *) clientData;
 
-	if (flags & DBC_DEFAULTS) {
+	if (set == DBC_DEFAULTS) {
 		interpData->qflags = def_qflags;
 	} else {
-		if (flags & DBC_TCP) {
+		if (set & DBC_TCP) {
 			interpData->qflags |= adns_qf_usevc;
+		} else if (clear & DBC_TCP) {
+			interpData->qflags &= ~adns_qf_usevc;
 		}
-		if (flags & DBC_SEARCH) {
+		if (set & DBC_SEARCH) {
 			interpData->qflags |= adns_qf_search;
+		} else if (clear & DBC_SEARCH) {
+			interpData->qflags &= ~adns_qf_search;
 		}
 	}
 
@@ -10,6 +10,8 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #ifdef HAS_DN_EXPAND
 #include <arpa/nameser.h>
 #include <resolv.h>
@@ -19,6 +21,7 @@
 #include "tclsysdns.h"
 #include "dnsparams.h"
 #include "resfmt.h"
+#include "dnsmsg.h"
 
 /* DNS query message format as per RFC 1035:
 
@@ -84,7 +87,7 @@ typedef enum {
 } dns_msg_rcode;
 
 #define DNSMSG_INT16_SIZE  (sizeof(unsigned short))
-#define DNSMSG_INT32_SIZE  (sizeof(unsigned long))
+#define DNSMSG_INT32_SIZE  4
 #define DNSMSG_HEADER_SIZE (6 * sizeof(unsigned short))
 
 typedef struct {
@@ -103,19 +106,33 @@ typedef struct {
 } dns_msg_header;
 
 typedef struct {
-	char name[256];
+	int nameoff;              /* Offset of the owner name in the message */
 	unsigned short type;
 	unsigned short class;
 	unsigned long  ttl;
 	unsigned short rdlength;
 } dns_msg_rr;
 
+/* Owner names of the RRs in a message mostly are compression pointers
+ * to the same few names, so the names decoded while parsing a message
+ * are remembered by the offset they start at and every RR referring
+ * to one of them shares its Tcl_Obj */
+#define DNSMSG_NAMECACHE 8
+
+typedef struct {
+	int offset;
+	Tcl_Obj *nameObj;
+} dns_msg_name;
+
 typedef struct {
 	const unsigned char *start;
 	const unsigned char *end;
 	const unsigned char *cur;
 	int len;
 	dns_msg_header hdr;
+	dns_msg_name names[DNSMSG_NAMECACHE];
+	int nnames;
+	int nextname;             /* Slot to reuse when names is full */
 } dns_msg_handle;
 
 static int
@@ -151,12 +168,29 @@ dns_msg_int32 (
 	dns_msg_handle *const mh
 	)
 {
+	/* Assembled by hand as unsigned long is 64 bits wide on LP64 */
 	unsigned long res;
-	res = ntohl(((unsigned long *) mh->cur)[0]);
+	res = ((unsigned long) mh->cur[0] << 24)
+		| ((unsigned long) mh->cur[1] << 16)
+		| ((unsigned long) mh->cur[2] << 8)
+		| (unsigned long) mh->cur[3];
 	mh->cur = mh->cur + DNSMSG_INT32_SIZE;
 	return res;
 }
 
+/* Errors are reported to interp unless it's NULL, which is the case
+ * when the string form of a lazy result set is generated */
+static void
+DNSMsgSetErrnoResult (
+	Tcl_Interp *interp
+	)
+{
+	if (interp != NULL) {
+		Tcl_SetObjResult(interp,
+				Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+	}
+}
+
 static void
 DNSMsgSetPosixError (
 	Tcl_Interp *interp,
@@ -164,7 +198,7 @@ DNSMsgSetPosixError (
 	)
 {
 	Tcl_SetErrno(errcode);
-	Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+	DNSMsgSetErrnoResult(interp);
 }
 
 static int
@@ -218,10 +252,13 @@ DNSMsgExpandName (
 
 	int len;
 
+	/* Note that mh->end points to the last octet of the message
+	 * while dn_expand() expects a pointer past it */
+
 	Tcl_SetErrno(0);
-	len = dn_expand(mh->start, mh->end, mh->cur, name, namelen);
+	len = dn_expand(mh->start, mh->end + 1, mh->cur, name, namelen);
 	if (len < 0) {
-		Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+		DNSMsgSetErrnoResult(interp);
 		return TCL_ERROR;
 	}
 
@@ -230,6 +267,108 @@ DNSMsgExpandName (
 	return TCL_OK;
 }
 
+/* Moves past the (possibly compressed) name at the current position
+ * without decoding it */
+static int
+DNSMsgSkipName (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh
+	)
+{
+	while (1) {
+		int len;
+
+		if (dns_msg_rem(mh) < 1) {
+			break;
+		}
+
+		len = mh->cur[0];
+		if ((len & 0xC0) == 0xC0) {
+			if (dns_msg_rem(mh) < 2) {
+				break;
+			}
+			dns_msg_adv(mh, 2);
+			return TCL_OK;
+		}
+		if ((len & 0xC0) != 0 || dns_msg_rem(mh) < 1 + len) {
+			break;
+		}
+
+		dns_msg_adv(mh, 1 + len);
+		if (len == 0) {
+			return TCL_OK;
+		}
+	}
+
+	DNSMsgSetPosixError(interp, EBADMSG);
+	return TCL_ERROR;
+}
+
+/* Decodes the name at the given offset of the message, or looks it up
+ * among the names already decoded. The name object is owned by
+ * the handle; callers wishing to keep it must add a reference. */
+static int
+DNSMsgGetNameObj (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	const int offset,
+	Tcl_Obj **nameObjPtr
+	)
+{
+	const unsigned char *p;
+	char name[256];
+	int key, i;
+	dns_msg_name *slotPtr;
+
+	/* A name which is just a pointer is the name it points to */
+	p = mh->start + offset;
+	if ((p[0] & 0xC0) == 0xC0 && p < mh->end) {
+		key = ((p[0] & 0x3F) << 8) | p[1];
+	} else {
+		key = offset;
+	}
+
+	for (i = 0; i < mh->nnames; ++i) {
+		if (mh->names[i].offset == key) {
+			*nameObjPtr = mh->names[i].nameObj;
+			return TCL_OK;
+		}
+	}
+
+	Tcl_SetErrno(0);
+	if (dn_expand(mh->start, mh->end + 1, p, name, sizeof(name)) < 0) {
+		DNSMsgSetErrnoResult(interp);
+		return TCL_ERROR;
+	}
+
+	if (mh->nnames < DNSMSG_NAMECACHE) {
+		slotPtr = &mh->names[mh->nnames++];
+	} else {
+		slotPtr = &mh->names[mh->nextname];
+		mh->nextname = (mh->nextname + 1) % DNSMSG_NAMECACHE;
+		Tcl_DecrRefCount(slotPtr->nameObj);
+	}
+	slotPtr->offset  = key;
+	slotPtr->nameObj = Tcl_NewStringObj(name, -1);
+	Tcl_IncrRefCount(slotPtr->nameObj);
+
+	*nameObjPtr = slotPtr->nameObj;
+	return TCL_OK;
+}
+
+static void
+DNSMsgFreeNames (
+	dns_msg_handle *mh
+	)
+{
+	int i;
+
+	for (i = 0; i < mh->nnames; ++i) {
+		Tcl_DecrRefCount(mh->names[i].nameObj);
+	}
+	mh->nnames = 0;
+}
+
 
 /* Name:
  *   dns_rrdata_parser
@@ -305,8 +444,8 @@ DNSMsgParseAddress (
 		return TCL_ERROR;
 	}
 
-	*addrPtr = ((unsigned long *) mh->cur)[0];
-	dns_msg_adv(mh, DNSMSG_INT32_SIZE);
+	/* The address is kept in the network byte order */
+	*addrPtr = htonl(dns_msg_int32(mh));
 
 	return TCL_OK;
 }
@@ -757,17 +896,71 @@ DNSMsgParseRRDataUnknown (
 	return TCL_OK;
 }
 
+/* EDNS0 pseudo-RR (RFC 6891, 6.1): its CLASS is the requestor's UDP
+ * payload size and its TTL carries the upper 8 bits of the extended
+ * RCODE, the EDNS version and the flags (the DO bit being the only
+ * one defined); RDATA is a list of {CODE LENGTH DATA} options */
+static int
+DNSMsgParseRRDataOPT (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	const dns_msg_rr *rr,
+	const int resflags,
+	Tcl_Obj **resObjPtr
+	)
+{
+	Tcl_Obj *optsObj;
+	int read;
+
+	optsObj = Tcl_NewListObj(0, NULL);
+
+	read = 0;
+	while (read < rr->rdlength) {
+		unsigned short code, len;
+
+		if (rr->rdlength - read < 2 * DNSMSG_INT16_SIZE) {
+			Tcl_DecrRefCount(optsObj);
+			DNSMsgSetPosixError(interp, EBADMSG);
+			return TCL_ERROR;
+		}
+
+		code = dns_msg_int16(mh);
+		len  = dns_msg_int16(mh);
+		read += 2 * DNSMSG_INT16_SIZE;
+		if (len > rr->rdlength - read) {
+			Tcl_DecrRefCount(optsObj);
+			DNSMsgSetPosixError(interp, EBADMSG);
+			return TCL_ERROR;
+		}
+
+		Tcl_ListObjAppendElement(interp, optsObj, Tcl_NewIntObj(code));
+		Tcl_ListObjAppendElement(interp, optsObj,
+				Tcl_NewByteArrayObj(mh->cur, len));
+		dns_msg_adv(mh, len);
+		read += len;
+	}
+
+	DNSFormatRRDataOPT(interp, resflags, resObjPtr,
+			rr->class,
+			((rr->ttl >> 24) & 0xff) << 4 | mh->hdr.RCODE,
+			(rr->ttl >> 16) & 0xff,
+			(rr->ttl >> 15) & 1,
+			optsObj);
+	return TCL_OK;
+}
+
 static int
 DNSMsgParseRRData (
 	Tcl_Interp *interp,
 	dns_msg_handle *mh,
-	const int rrtype,
-	const int rdlength,
+	const dns_msg_rr *rr,
 	const int resflags,
 	Tcl_Obj **resObjPtr
 	)
 {
-	switch (rrtype) {
+	const int rdlength = rr->rdlength;
+
+	switch (rr->type) {
 		case  1: /* A */
 			return DNSMsgParseRRDataA(interp, mh, rdlength, resflags, resObjPtr);
 		case  6: /* SOA */
@@ -809,6 +1002,8 @@ DNSMsgParseRRData (
 			return DNSMsgParseRRDataNXT(interp, mh, rdlength, resObjPtr);
 		case 33: /* SRV */
 			return DNSMsgParseRRDataSRV(interp, mh, rdlength, resflags, resObjPtr);
+		case 41: /* OPT */
+			return DNSMsgParseRRDataOPT(interp, mh, rr, resflags, resObjPtr);
 		case 249: /* TKEY */
 			return DNSMsgParseRRDataTKEY(interp, mh, rdlength, resObjPtr);
 		case 250: /* TSIG */
@@ -830,10 +1025,11 @@ DNSMsgParseQuestion (
 	Tcl_Obj *resObj
 	)
 {
-	char name[256];
+	int nameoff;
 	unsigned short qtype, qclass;
 
-	if (DNSMsgExpandName(interp, mh, name, sizeof(name)) != TCL_OK) {
+	nameoff = mh->cur - mh->start;
+	if (DNSMsgSkipName(interp, mh) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
@@ -846,7 +1042,13 @@ DNSMsgParseQuestion (
 	qclass = dns_msg_int16(mh);
 
 	if (resObj != NULL) {
-		DNSFormatQuestion(interp, resflags, resObj, name, qtype, qclass);
+		Tcl_Obj *nameObj;
+
+		if (DNSMsgGetNameObj(interp, mh, nameoff, &nameObj) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		DNSFormatQuestionObj(interp, resflags, resObj,
+				nameObj, qtype, qclass);
 	}
 
 	return TCL_OK;
@@ -859,7 +1061,9 @@ DNSMsgParseRRHeader (
 	dns_msg_rr *rr
 	)
 {
-	if (DNSMsgExpandName(interp, mh, rr->name, sizeof(rr->name)) != TCL_OK) {
+	/* The name is only decoded if it's asked for */
+	rr->nameoff = mh->cur - mh->start;
+	if (DNSMsgSkipName(interp, mh) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
@@ -881,136 +1085,1492 @@ DNSMsgParseRRHeader (
 	return TCL_OK;
 }
 
+/* Takes the TTL of the RR (whose RDATA starts at the current position)
+ * into account: the minimum TTL over the RRs of a section is reported
+ * via minttlPtr and the negative caching TTL via negttlPtr if it's
+ * a SOA; either pointer may be NULL */
+static void
+DNSMsgTrackTTL (
+	const dns_msg_handle *mh,
+	const dns_msg_rr *rr,
+	const int first,
+	unsigned long *minttlPtr,
+	unsigned long *negttlPtr
+	)
+{
+	if (minttlPtr != NULL && (first || rr->ttl < *minttlPtr)) {
+		*minttlPtr = rr->ttl;
+	}
+
+	/* Negative answers are cached for the lesser of the SOA's
+	 * own TTL and its MINIMUM field, which ends its RDATA
+	 * (RFC 2308, section 5) */
+	if (negttlPtr != NULL && rr->type == 6 /* SOA */
+			&& rr->rdlength >= 5 * DNSMSG_INT32_SIZE) {
+		dns_msg_handle mhmin;
+		unsigned long minimum;
+
+		mhmin.cur = mh->cur + rr->rdlength - DNSMSG_INT32_SIZE;
+		minimum = dns_msg_int32(&mhmin);
+		*negttlPtr = rr->ttl < minimum ? rr->ttl : minimum;
+	}
+}
+
+/* Makes the object representing the RR whose header has been parsed:
+ * its data, preceded by the header fields if RES_DETAIL is set. The
+ * owner name and data are left alone if -fields leaves them out. */
 static int
-DNSMsgParseRRSection (
+DNSMsgParseRR (
 	Tcl_Interp *interp,
-	const char name[],
-	const int wanted,
-	const int nrrs,
 	dns_msg_handle *mh,
+	const dns_msg_rr *rr,
 	const int resflags,
-	Tcl_Obj *resObj
+	Tcl_Obj **rrObjPtr
 	)
 {
-	Tcl_Obj *sectObj;
-	int i;
+	Tcl_Obj *dataObj, *headObj, *nameObj;
 
-	if (wanted) {
-		if (resflags & RES_SECTNAMES) {
-			Tcl_ListObjAppendElement(interp, resObj,
-					Tcl_NewStringObj(name, -1));
-		}
-		if (resflags & RES_WANTLIST) {
-			sectObj = Tcl_NewListObj(0, NULL);
-			Tcl_ListObjAppendElement(interp, resObj, sectObj);
-		} else {
-			sectObj = resObj;
+	dataObj = NULL;
+	if (RES_WANTFIELD(resflags, RES_F_RDATA)) {
+		if (DNSMsgParseRRData(interp, mh, rr, resflags, &dataObj) != TCL_OK) {
+			return TCL_ERROR;
 		}
 	} else {
-		sectObj = NULL; /* to silence the compiler */
+		dns_msg_adv(mh, rr->rdlength);
 	}
 
-	for (i = 0; i < nrrs; ++i) {
-		dns_msg_rr rr;
-
-		if (DNSMsgParseRRHeader(interp, mh, &rr) != TCL_OK) {
-			Tcl_DecrRefCount(resObj);
-			return TCL_ERROR;
-		}
+	if (! (resflags & RES_DETAIL)) {
+		*rrObjPtr = dataObj;
+		return TCL_OK;
+	}
 
-		if (wanted) {
-			Tcl_Obj *dataObj;
-			if (DNSMsgParseRRData(interp, mh, rr.type, rr.rdlength,
-						resflags, &dataObj) != TCL_OK) {
-				Tcl_DecrRefCount(resObj);
-				return TCL_ERROR;
-			}
-			if (resflags & RES_DETAIL) {
-				Tcl_Obj *headObj = Tcl_NewListObj(0, NULL);
-				DNSFormatRRHeader(interp, resflags, headObj,
-						rr.name, rr.type, rr.class, rr.ttl, rr.rdlength);
-				Tcl_ListObjAppendElement(interp, headObj, dataObj);
-				Tcl_ListObjAppendElement(interp, sectObj, headObj);
-			} else {
-				Tcl_ListObjAppendElement(interp, sectObj, dataObj);
-			}
-		} else {
-			dns_msg_adv(mh, rr.rdlength);
+	nameObj = NULL;
+	if (RES_WANTFIELD(resflags, RES_F_NAME)
+			&& DNSMsgGetNameObj(interp, mh, rr->nameoff, &nameObj) != TCL_OK) {
+		if (dataObj != NULL) {
+			Tcl_DecrRefCount(dataObj);
 		}
+		return TCL_ERROR;
 	}
+	headObj = DNSFormatNewRecord(resflags);
+	DNSFormatRRHeaderObj(interp, resflags, headObj,
+			nameObj, rr->type, rr->class, rr->ttl, rr->rdlength, dataObj);
 
+	*rrObjPtr = headObj;
 	return TCL_OK;
 }
 
-int
-DNSParseMessage (
-	Tcl_Interp *interp,
+static int
+DNSMsgIsNegative (
+	const dns_msg_handle *mh
+	)
+{
+	return mh->hdr.RCODE == __NAME_ERROR || mh->hdr.ANCOUNT == 0;
+}
+
+static void
+DNSMsgSetStatus (
+	const dns_msg_handle *mh,
+	const unsigned long negttl,
+	ResolveInfo *infoPtr
+	)
+{
+	if (mh->hdr.RCODE == __NAME_ERROR) {
+		infoPtr->status = RESOLVE_NXDOMAIN;
+		infoPtr->ttl    = negttl;
+	} else if (mh->hdr.ANCOUNT == 0) {
+		infoPtr->status = RESOLVE_NODATA;
+		infoPtr->ttl    = negttl;
+	}
+}
+
+static void
+DNSMsgInitHandle (
+	dns_msg_handle *mh,
 	const unsigned char msg[],
-	const int msglen,
-	unsigned int resflags
+	const int msglen
 	)
 {
-	dns_msg_handle handle;
-	Tcl_Obj *resObj, *sectObj;
-	int i;
+	mh->start    = msg;
+	mh->cur      = msg;
+	mh->end      = msg + msglen - 1;
+	mh->len      = msglen;
+	mh->nnames   = 0;
+	mh->nextname = 0;
+}
 
-	handle.start = msg;
-	handle.cur   = msg;
-	handle.end   = msg + msglen - 1;
-	handle.len   = msglen;
 
-	if (DNSMsgParseHeader(interp, &handle) != TCL_OK) {
-		return TCL_ERROR;
-	}
+
+/* Decoded replies.
+ *
+ * Result sets are made from a reply in two stages. DNSReplyDecode
+ * turns the message into a DNSReply -- a single block of memory holding
+ * an array of RRs whose owner names and RDATA are kept at offsets into
+ * an arena following the array. Owner names are decoded to text (and
+ * stored once for all RRs referring to the same name), while RDATA is
+ * kept in wire form with the names in it uncompressed, so that it means
+ * the same without the message. This stage neither creates Tcl objects
+ * nor reports errors to an interp, so it can run in any thread, and its
+ * outcome can be kept or copied around as it is. DNSReplyFormat then
+ * makes the result set out of the DNSReply, running the RDATA parsers
+ * over the arena as if it was a message. */
+
+#define DNSREPLY_ARENASIZE 2048
+
+/* State of DNSReplyDecode. The arena grows from the space here. */
+typedef struct {
+	dns_msg_handle mh;
+	DNSReplyRR *rrs;
+	int nrrs;
+	unsigned char *arena;
+	int arenalen;
+	int arenasize;
+	struct {
+		int key;              /* Offset the name starts at in the message */
+		int offset;           /* Offset of the decoded name in the arena */
+	} names[DNSMSG_NAMECACHE];
+	int nnames;
+	int nextname;
+	unsigned char space[DNSREPLY_ARENASIZE];
+} dns_reply_decoder;
+
+/* Reserves len bytes at the end of the arena, returning their offset */
+static int
+DNSReplyArenaAlloc (
+	dns_reply_decoder *dec,
+	const int len
+	)
+{
+	int offset;
 
-	resObj = Tcl_NewListObj(0, NULL);
-	sectObj = NULL; /* silence the compiler */
+	if (dec->arenalen + len > dec->arenasize) {
+		int size = dec->arenasize;
 
-	if (resflags & RES_QUESTION) {
-		if (resflags & RES_SECTNAMES) {
-			Tcl_ListObjAppendElement(interp, resObj,
-					Tcl_NewStringObj("question", -1));
+		while (dec->arenalen + len > size) {
+			size *= 2;
 		}
-		if (resflags & RES_WANTLIST) {
-			sectObj = Tcl_NewListObj(0, NULL);
-			Tcl_ListObjAppendElement(interp, resObj, sectObj);
+		if (dec->arena == dec->space) {
+			dec->arena = (unsigned char *) ckalloc(size);
+			memcpy(dec->arena, dec->space, dec->arenalen);
 		} else {
-			sectObj = resObj;
+			dec->arena = (unsigned char *) ckrealloc((char *) dec->arena, size);
 		}
+		dec->arenasize = size;
 	}
-	for (i = 0; i < handle.hdr.QDCOUNT; ++i) {
-		Tcl_Obj *questObj;
-		if (resflags & RES_QUESTION) {
-			questObj = Tcl_NewListObj(0, NULL);
-			Tcl_ListObjAppendElement(interp, sectObj, questObj);
-		} else {
-			questObj = NULL;
+
+	offset = dec->arenalen;
+	dec->arenalen += len;
+	return offset;
+}
+
+/* Copies the (possibly compressed) name at the current position
+ * uncompressed to the end of the arena and moves past it */
+static int
+DNSReplyUnpackName (
+	dns_reply_decoder *dec
+	)
+{
+	dns_msg_handle *mh = &dec->mh;
+	const unsigned char *p;
+	unsigned char name[MAXCDNAME];
+	int len, namelen, hops, offset;
+
+	p = mh->cur;
+	namelen = 0;
+	hops = 0;
+	while (1) {
+		if (p > mh->end) {
+			break;
 		}
-		if (DNSMsgParseQuestion(interp, &handle, resflags, questObj) != TCL_OK) {
-			Tcl_DecrRefCount(resObj);
-			return TCL_ERROR;
+		len = p[0];
+		if ((len & 0xC0) == 0xC0) {
+			if (p == mh->end || ++hops > MAXCDNAME / 2) {
+				break;
+			}
+			if (hops == 1) {
+				mh->cur = p + 2;
+			}
+			p = mh->start + (((len & 0x3F) << 8) | p[1]);
+			continue;
+		}
+		if ((len & 0xC0) != 0 || mh->end - p < len
+				|| namelen + 1 + len > MAXCDNAME) {
+			break;
+		}
+
+		memcpy(name + namelen, p, 1 + len);
+		namelen += 1 + len;
+		p += 1 + len;
+
+		if (len == 0) {
+			if (hops == 0) {
+				mh->cur = p;
+			}
+			offset = DNSReplyArenaAlloc(dec, namelen);
+			memcpy(dec->arena + offset, name, namelen);
+			return TCL_OK;
 		}
 	}
 
-	if (DNSMsgParseRRSection(interp, "answer", (resflags & RES_ANSWER),
-				handle.hdr.ANCOUNT, &handle, resflags, resObj) != TCL_OK) {
-		Tcl_DecrRefCount(resObj);
-		return TCL_ERROR;
+	DNSMsgSetPosixError(NULL, EBADMSG);
+	return TCL_ERROR;
+}
+
+/* Decodes the owner name at the given offset of the message into
+ * the arena unless it's been decoded already; returns its offset
+ * in the arena or -1 on error */
+static int
+DNSReplyAddName (
+	dns_reply_decoder *dec,
+	const int offset
+	)
+{
+	const unsigned char *p;
+	char name[256];
+	int key, len, i, slot;
+
+	/* A name which is just a pointer is the name it points to */
+	p = dec->mh.start + offset;
+	if ((p[0] & 0xC0) == 0xC0 && p < dec->mh.end) {
+		key = ((p[0] & 0x3F) << 8) | p[1];
+	} else {
+		key = offset;
 	}
 
-	if (DNSMsgParseRRSection(interp, "authority", (resflags & RES_AUTH),
-				handle.hdr.NSCOUNT, &handle, resflags, resObj) != TCL_OK) {
-		Tcl_DecrRefCount(resObj);
-		return TCL_ERROR;
+	for (i = 0; i < dec->nnames; ++i) {
+		if (dec->names[i].key == key) {
+			return dec->names[i].offset;
+		}
 	}
 
-	if (DNSMsgParseRRSection(interp, "additional", (resflags & RES_ADD),
-				handle.hdr.ARCOUNT, &handle, resflags, resObj) != TCL_OK) {
-		Tcl_DecrRefCount(resObj);
-		return TCL_ERROR;
+	Tcl_SetErrno(0);
+	if (dn_expand(dec->mh.start, dec->mh.end + 1, p, name, sizeof(name)) < 0) {
+		if (Tcl_GetErrno() == 0) {
+			Tcl_SetErrno(EBADMSG);
+		}
+		return -1;
+	}
+
+	if (dec->nnames < DNSMSG_NAMECACHE) {
+		slot = dec->nnames++;
+	} else {
+		slot = dec->nextname;
+		dec->nextname = (dec->nextname + 1) % DNSMSG_NAMECACHE;
+	}
+
+	len = strlen(name) + 1;
+	dec->names[slot].key    = key;
+	dec->names[slot].offset = DNSReplyArenaAlloc(dec, len);
+	memcpy(dec->arena + dec->names[slot].offset, name, len);
+
+	return dec->names[slot].offset;
+}
+
+/* Copies the RDATA of the RR whose header has been parsed to the arena,
+ * uncompressing the names in it, and moves past it */
+static int
+DNSReplyAddRData (
+	dns_reply_decoder *dec,
+	const dns_msg_rr *rr,
+	DNSReplyRR *rrPtr
+	)
+{
+	dns_msg_handle *mh = &dec->mh;
+	const unsigned char *end;
+	int prefix, names, len, offset;
+
+	/* Octets preceding the names and the number of names
+	 * leading the RDATA of the types having names in it */
+	switch (rr->type) {
+		case  2: /* NS */
+		case  3: /* MD */
+		case  4: /* MF */
+		case  5: /* CNAME */
+		case  7: /* MB */
+		case  8: /* MG */
+		case  9: /* MR */
+		case 12: /* PTR */
+		case 30: /* NXT */
+			prefix = 0; names = 1;
+			break;
+		case  6: /* SOA */
+		case 14: /* MINFO */
+		case 17: /* RP */
+			prefix = 0; names = 2;
+			break;
+		case 15: /* MX */
+		case 18: /* AFSDB */
+		case 21: /* RT */
+			prefix = DNSMSG_INT16_SIZE; names = 1;
+			break;
+		case 33: /* SRV */
+			prefix = 3 * DNSMSG_INT16_SIZE; names = 1;
+			break;
+		default:
+			prefix = 0; names = 0;
+			break;
+	}
+
+	end = mh->cur + rr->rdlength;
+	rrPtr->data = dec->arenalen;
+
+	if (names > 0) {
+		if (rr->rdlength < prefix) {
+			DNSMsgSetPosixError(NULL, EBADMSG);
+			return TCL_ERROR;
+		}
+		offset = DNSReplyArenaAlloc(dec, prefix);
+		memcpy(dec->arena + offset, mh->cur, prefix);
+		dns_msg_adv(mh, prefix);
+
+		while (names-- > 0) {
+			if (DNSReplyUnpackName(dec) != TCL_OK) {
+				return TCL_ERROR;
+			}
+		}
+		if (mh->cur > end) {
+			DNSMsgSetPosixError(NULL, EBADMSG);
+			return TCL_ERROR;
+		}
+	}
+
+	len = end - mh->cur;
+	offset = DNSReplyArenaAlloc(dec, len);
+	memcpy(dec->arena + offset, mh->cur, len);
+	mh->cur = end;
+
+	rrPtr->datalen = dec->arenalen - rrPtr->data;
+	return TCL_OK;
+}
+
+/* Walks a section of RRs, keeping them in the decoded reply if
+ * the section is wanted */
+static int
+DNSReplyDecodeSection (
+	dns_reply_decoder *dec,
+	const int nrrs,
+	const int wanted,
+	const unsigned int flags,
+	unsigned long *minttlPtr,
+	unsigned long *negttlPtr
+	)
+{
+	int i;
+
+	for (i = 0; i < nrrs; ++i) {
+		dns_msg_rr rr;
+		DNSReplyRR *rrPtr;
+
+		if (DNSMsgParseRRHeader(NULL, &dec->mh, &rr) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		DNSMsgTrackTTL(&dec->mh, &rr, i == 0, minttlPtr, negttlPtr);
+
+		if (! wanted) {
+			dns_msg_adv(&dec->mh, rr.rdlength);
+			continue;
+		}
+
+		rrPtr = &dec->rrs[dec->nrrs++];
+		rrPtr->type     = rr.type;
+		rrPtr->class    = rr.class;
+		rrPtr->ttl      = rr.ttl;
+		rrPtr->rdlength = rr.rdlength;
+		rrPtr->name     = -1;
+		if ((flags & (RES_DETAIL | RES_COLUMNS))
+				&& RES_WANTFIELD(flags, RES_F_NAME)) {
+			rrPtr->name = DNSReplyAddName(dec, rr.nameoff);
+			if (rrPtr->name == -1) {
+				return TCL_ERROR;
+			}
+		}
+
+		if (! RES_WANTFIELD(flags, RES_F_RDATA)) {
+			rrPtr->data    = dec->arenalen;
+			rrPtr->datalen = 0;
+			dns_msg_adv(&dec->mh, rr.rdlength);
+		} else if (DNSReplyAddRData(dec, &rr, rrPtr) != TCL_OK) {
+			return TCL_ERROR;
+		}
 	}
 
-	Tcl_SetObjResult(interp, resObj);
 	return TCL_OK;
 }
 
+static int
+DNSReplyDecodeQuestions (
+	dns_reply_decoder *dec,
+	const int wanted
+	)
+{
+	dns_msg_handle *mh = &dec->mh;
+	int i;
+
+	for (i = 0; i < mh->hdr.QDCOUNT; ++i) {
+		DNSReplyRR *rrPtr;
+		int nameoff;
+
+		nameoff = mh->cur - mh->start;
+		if (DNSMsgSkipName(NULL, mh) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (dns_msg_rem(mh) < 2 * DNSMSG_INT16_SIZE) {
+			DNSMsgSetPosixError(NULL, EBADMSG);
+			return TCL_ERROR;
+		}
+
+		if (! wanted) {
+			dns_msg_adv(mh, 2 * DNSMSG_INT16_SIZE);
+			continue;
+		}
+
+		rrPtr = &dec->rrs[dec->nrrs++];
+		memset(rrPtr, 0, sizeof(*rrPtr));
+		rrPtr->type  = dns_msg_int16(mh);
+		rrPtr->class = dns_msg_int16(mh);
+		rrPtr->name  = DNSReplyAddName(dec, nameoff);
+		if (rrPtr->name == -1) {
+			return TCL_ERROR;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* First stage: decodes the message into a newly allocated DNSReply
+ * which is to be freed with DNSReplyFree. Only the sections selected
+ * by flags (as in resflags) are kept, and owner names of RRs are only
+ * decoded if RES_DETAIL or RES_COLUMNS is set too. Names and RDATA
+ * left out by the RES_F_* flags are skipped. The outcome of the query is worked
+ * out in any case. Makes no Tcl objects: errors are left in errno. */
+int
+DNSReplyDecode (
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int flags,
+	DNSReply **replyPtrPtr
+	)
+{
+	dns_reply_decoder *dec;
+	DNSReply *replyPtr;
+	unsigned long negttl;
+	int counts[4], maxrrs, size, res;
+
+	dec = (dns_reply_decoder *) ckalloc(sizeof(dns_reply_decoder));
+	DNSMsgInitHandle(&dec->mh, msg, msglen);
+	if (DNSMsgParseHeader(NULL, &dec->mh) != TCL_OK) {
+		ckfree((char *) dec);
+		return TCL_ERROR;
+	}
+
+	/* Bogus counts can't make the array larger than the message */
+	maxrrs = ((flags & RES_QUESTION) ? dec->mh.hdr.QDCOUNT : 0)
+		+ ((flags & RES_ANSWER) ? dec->mh.hdr.ANCOUNT : 0)
+		+ ((flags & RES_AUTH) ? dec->mh.hdr.NSCOUNT : 0)
+		+ ((flags & RES_ADD) ? dec->mh.hdr.ARCOUNT : 0);
+	if (maxrrs > msglen / 5) {
+		maxrrs = msglen / 5;
+	}
+
+	dec->rrs       = (DNSReplyRR *) ckalloc((maxrrs + 1) * sizeof(DNSReplyRR));
+	dec->nrrs      = 0;
+	dec->arena     = dec->space;
+	dec->arenalen  = 0;
+	dec->arenasize = DNSREPLY_ARENASIZE;
+	dec->nnames    = 0;
+	dec->nextname  = 0;
+
+	replyPtr = NULL;
+	negttl   = 0;
+	memset(counts, 0, sizeof(counts));
+
+	res = DNSReplyDecodeQuestions(dec, (flags & RES_QUESTION));
+	counts[0] = dec->nrrs;
+
+	if (res == TCL_OK) {
+		unsigned long ttl = 0;
+
+		res = DNSReplyDecodeSection(dec, dec->mh.hdr.ANCOUNT,
+				(flags & RES_ANSWER), flags, &ttl, NULL);
+		counts[1] = dec->nrrs - counts[0];
+
+		/* Sections after the last one needed are not walked: the authority
+		 * one is only needed if it's wanted or the answer is negative
+		 * (for its SOA), the additional one only if it's wanted */
+		if (res == TCL_OK && ((flags & (RES_AUTH | RES_ADD))
+					|| DNSMsgIsNegative(&dec->mh))) {
+			res = DNSReplyDecodeSection(dec, dec->mh.hdr.NSCOUNT,
+					(flags & RES_AUTH), flags, NULL, &negttl);
+			counts[2] = dec->nrrs - counts[0] - counts[1];
+		}
+		if (res == TCL_OK && (flags & RES_ADD)) {
+			res = DNSReplyDecodeSection(dec, dec->mh.hdr.ARCOUNT,
+					RES_ADD, flags, NULL, NULL);
+			counts[3] = dec->nrrs - counts[0] - counts[1] - counts[2];
+		}
+
+		if (res == TCL_OK) {
+			size = offsetof(DNSReply, rrs)
+				+ dec->nrrs * sizeof(DNSReplyRR) + dec->arenalen;
+			replyPtr = (DNSReply *) ckalloc(size);
+			replyPtr->size        = size;
+			replyPtr->rcode       = dec->mh.hdr.RCODE;
+			replyPtr->nrrs        = dec->nrrs;
+			replyPtr->arenalen    = dec->arenalen;
+			replyPtr->info.status = RESOLVE_DATA;
+			replyPtr->info.ttl    = ttl;
+			memcpy(replyPtr->counts, counts, sizeof(counts));
+			memcpy(replyPtr->rrs, dec->rrs, dec->nrrs * sizeof(DNSReplyRR));
+			memcpy(DNSReplyArena(replyPtr), dec->arena, dec->arenalen);
+			DNSMsgSetStatus(&dec->mh, negttl, &replyPtr->info);
+		}
+	}
+
+	if (dec->arena != dec->space) {
+		ckfree((char *) dec->arena);
+	}
+	ckfree((char *) dec->rrs);
+	ckfree((char *) dec);
+
+	*replyPtrPtr = replyPtr;
+	return res;
+}
+
+void
+DNSReplyFree (
+	DNSReply *replyPtr
+	)
+{
+	ckfree((char *) replyPtr);
+}
+
+/* Gets the object of the decoded name at the given offset of the arena
+ * (which the handle is set up for) sharing it among the RRs having
+ * the same owner name; the object is owned by the handle */
+static Tcl_Obj *
+DNSReplyGetNameObj (
+	dns_msg_handle *mh,
+	const int offset
+	)
+{
+	dns_msg_name *slotPtr;
+	int i;
+
+	for (i = 0; i < mh->nnames; ++i) {
+		if (mh->names[i].offset == offset) {
+			return mh->names[i].nameObj;
+		}
+	}
+
+	if (mh->nnames < DNSMSG_NAMECACHE) {
+		slotPtr = &mh->names[mh->nnames++];
+	} else {
+		slotPtr = &mh->names[mh->nextname];
+		mh->nextname = (mh->nextname + 1) % DNSMSG_NAMECACHE;
+		Tcl_DecrRefCount(slotPtr->nameObj);
+	}
+	slotPtr->offset  = offset;
+	slotPtr->nameObj = Tcl_NewStringObj((const char *) mh->start + offset, -1);
+	Tcl_IncrRefCount(slotPtr->nameObj);
+
+	return slotPtr->nameObj;
+}
+
+static int
+DNSReplyFormatRData (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	const DNSReplyRR *rrPtr,
+	const unsigned int resflags,
+	Tcl_Obj **dataObjPtr
+	)
+{
+	dns_msg_rr rr;
+
+	rr.nameoff  = rrPtr->name;
+	rr.type     = rrPtr->type;
+	rr.class    = rrPtr->class;
+	rr.ttl      = rrPtr->ttl;
+	rr.rdlength = rrPtr->datalen;
+
+	mh->cur = mh->start + rrPtr->data;
+	return DNSMsgParseRRData(interp, mh, &rr, resflags, dataObjPtr);
+}
+
+static int
+DNSReplyFormatRR (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	const DNSReplyRR *rrPtr,
+	const unsigned int resflags,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	Tcl_Obj *dataObj;
+
+	dataObj = NULL;
+	if (RES_WANTFIELD(resflags, RES_F_RDATA)
+			&& DNSReplyFormatRData(interp, mh,
+				rrPtr, resflags, &dataObj) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (! (resflags & RES_DETAIL)) {
+		*rrObjPtr = dataObj;
+		return TCL_OK;
+	}
+
+	/* RDLENGTH is reported as it was on the wire */
+	*rrObjPtr = DNSFormatNewRecord(resflags);
+	DNSFormatRRHeaderObj(interp, resflags, *rrObjPtr,
+			rrPtr->name == -1 ? NULL : DNSReplyGetNameObj(mh, rrPtr->name),
+			rrPtr->type, rrPtr->class, rrPtr->ttl, rrPtr->rdlength, dataObj);
+	return TCL_OK;
+}
+
+static const char *const DNSReplySectNames[] = {
+	"question", "answer", "authority", "additional"
+};
+static const int DNSReplySections[] = {
+	RES_QUESTION, RES_ANSWER, RES_AUTH, RES_ADD
+};
+
+/* Same as DNSReplyFormat but with RES_COLUMNS: each section is made
+ * of lists of the values of one field taken from all its records,
+ * which need far less objects than a record per RR */
+static int
+DNSReplyFormatColumns (
+	Tcl_Interp *interp,
+	const DNSReply *replyPtr,
+	const unsigned int resflags,
+	Tcl_Obj **resObjPtr
+	)
+{
+	dns_msg_handle handle;
+	DNSColumns cols;
+	Tcl_Obj *resObj, *colsObj;
+	const DNSReplyRR *rrPtr;
+	int sect, i, res;
+
+	DNSMsgInitHandle(&handle, DNSReplyArena(replyPtr), replyPtr->arenalen);
+	handle.hdr.RCODE = replyPtr->rcode;
+
+	/* A single section is the result set itself */
+	resObj = (resflags & RES_WANTLIST) ? Tcl_NewListObj(0, NULL) : NULL;
+	rrPtr  = replyPtr->rrs;
+	res    = TCL_OK;
+
+	for (sect = 0; sect < 4 && res == TCL_OK; ++sect) {
+		if (! (resflags & DNSReplySections[sect])) {
+			rrPtr += replyPtr->counts[sect];
+			continue;
+		}
+
+		DNSFormatColumnsInit(&cols, resflags,
+				sect == 0, replyPtr->counts[sect]);
+
+		for (i = 0; i < replyPtr->counts[sect]; ++i, ++rrPtr) {
+			Tcl_Obj *nameObj, *dataObj;
+
+			nameObj = rrPtr->name == -1
+				? NULL : DNSReplyGetNameObj(&handle, rrPtr->name);
+			if (sect == 0) {
+				DNSFormatColumnsQuestion(interp, resflags, &cols,
+						nameObj, rrPtr->type, rrPtr->class);
+				continue;
+			}
+
+			dataObj = NULL;
+			if (RES_WANTFIELD(resflags, RES_F_RDATA)
+					&& DNSReplyFormatRData(interp, &handle,
+						rrPtr, resflags, &dataObj) != TCL_OK) {
+				res = TCL_ERROR;
+				break;
+			}
+			DNSFormatColumnsRR(interp, resflags, &cols, nameObj,
+					rrPtr->type, rrPtr->class, rrPtr->ttl,
+					rrPtr->rdlength, dataObj);
+		}
+
+		colsObj = DNSFormatColumnsObj(interp, resflags, &cols);
+		if (resObj == NULL) {
+			resObj = colsObj;
+		} else {
+			DNSFormatPutSection(interp, resflags, resObj,
+					DNSReplySectNames[sect], colsObj);
+		}
+	}
+
+	DNSMsgFreeNames(&handle);
+
+	if (res != TCL_OK) {
+		Tcl_DecrRefCount(resObj);
+		return TCL_ERROR;
+	}
+
+	*resObjPtr = resObj;
+	return TCL_OK;
+}
+
+/* Second stage: makes the result set out of the decoded reply,
+ * formatted according to resflags, which must not select sections
+ * or details the reply has been decoded without. Errors are reported
+ * to interp unless it's NULL. */
+int
+DNSReplyFormat (
+	Tcl_Interp *interp,
+	const DNSReply *replyPtr,
+	const unsigned int resflags,
+	Tcl_Obj **resObjPtr
+	)
+{
+	dns_msg_handle handle;
+	Tcl_Obj *resObj;
+	const DNSReplyRR *rrPtr;
+	int sect, i, res;
+
+	if (resflags & RES_COLUMNS) {
+		return DNSReplyFormatColumns(interp, replyPtr, resflags, resObjPtr);
+	}
+
+	DNSMsgInitHandle(&handle, DNSReplyArena(replyPtr), replyPtr->arenalen);
+	handle.hdr.RCODE = replyPtr->rcode;
+
+	resObj = Tcl_NewListObj(0, NULL);
+	rrPtr  = replyPtr->rrs;
+	res    = TCL_OK;
+
+	for (sect = 0; sect < 4 && res == TCL_OK; ++sect) {
+		Tcl_Obj *sectObj;
+
+		if (! (resflags & DNSReplySections[sect])) {
+			rrPtr += replyPtr->counts[sect];
+			continue;
+		}
+
+		sectObj = DNSFormatSection(interp, resflags, resObj,
+				DNSReplySectNames[sect]);
+
+		for (i = 0; i < replyPtr->counts[sect]; ++i, ++rrPtr) {
+			Tcl_Obj *rrObj;
+
+			if (sect == 0) {
+				rrObj = DNSFormatNewRecord(resflags);
+				DNSFormatQuestionObj(interp, resflags, rrObj,
+						DNSReplyGetNameObj(&handle, rrPtr->name),
+						rrPtr->type, rrPtr->class);
+			} else if (DNSReplyFormatRR(interp, &handle,
+						rrPtr, resflags, &rrObj) != TCL_OK) {
+				res = TCL_ERROR;
+				break;
+			}
+			Tcl_ListObjAppendElement(interp, sectObj, rrObj);
+		}
+	}
+
+	DNSMsgFreeNames(&handle);
+
+	if (res != TCL_OK) {
+		Tcl_DecrRefCount(resObj);
+		return TCL_ERROR;
+	}
+
+	*resObjPtr = resObj;
+	return TCL_OK;
+}
+
+/* Makes the result set out of the message in the two stages above */
+static int
+DNSMsgParseReply (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr,
+	Tcl_Obj **resObjPtr
+	)
+{
+	DNSReply *replyPtr;
+	int res;
+
+	if (DNSReplyDecode(msg, msglen, resflags, &replyPtr) != TCL_OK) {
+		DNSMsgSetErrnoResult(interp);
+		return TCL_ERROR;
+	}
+
+	*infoPtr = replyPtr->info;
+	res = DNSReplyFormat(interp, replyPtr, resflags, resObjPtr);
+
+	DNSReplyFree(replyPtr);
+	return res;
+}
+
+
+/* Passes the record just made to proc, releasing it afterwards */
+static int
+DNSMsgDeliverRR (
+	Tcl_Interp *interp,
+	const char section[],
+	Tcl_Obj *rrObj,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	int res;
+
+	Tcl_IncrRefCount(rrObj);
+	res = proc(interp, clientData, DNSFormatLiteral(section), rrObj);
+	Tcl_DecrRefCount(rrObj);
+
+	return res == TCL_CONTINUE ? TCL_OK : res;
+}
+
+/* Streaming counterpart of DNSMsgParseRRSection: the wanted RRs are
+ * handed to proc one at a time instead of being collected in a list */
+static int
+DNSMsgEachRRInSection (
+	Tcl_Interp *interp,
+	const char name[],
+	const int wanted,
+	const int nrrs,
+	dns_msg_handle *mh,
+	const int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	int i, res;
+
+	for (i = 0; i < nrrs; ++i) {
+		dns_msg_rr rr;
+		Tcl_Obj *rrObj;
+
+		if (DNSMsgParseRRHeader(interp, mh, &rr) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		if (! wanted) {
+			dns_msg_adv(mh, rr.rdlength);
+			continue;
+		}
+
+		if (DNSMsgParseRR(interp, mh, &rr, resflags, &rrObj) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		res = DNSMsgDeliverRR(interp, name, rrObj, proc, clientData);
+		if (res != TCL_OK) {
+			return res;
+		}
+	}
+
+	return TCL_OK;
+}
+
+static int
+DNSMsgEachRR (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	int i, res;
+
+	for (i = 0; i < mh->hdr.QDCOUNT; ++i) {
+		Tcl_Obj *questObj;
+
+		if (! (resflags & RES_QUESTION)) {
+			if (DNSMsgParseQuestion(interp, mh, resflags, NULL) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			continue;
+		}
+
+		questObj = DNSFormatNewRecord(resflags);
+		if (DNSMsgParseQuestion(interp, mh, resflags, questObj) != TCL_OK) {
+			Tcl_DecrRefCount(questObj);
+			return TCL_ERROR;
+		}
+		res = DNSMsgDeliverRR(interp, "question", questObj,
+				proc, clientData);
+		if (res != TCL_OK) {
+			return res;
+		}
+	}
+
+	/* No section after the last one wanted is walked */
+	res = TCL_OK;
+	if (resflags & (RES_ANSWER | RES_AUTH | RES_ADD)) {
+		res = DNSMsgEachRRInSection(interp, "answer", (resflags & RES_ANSWER),
+				mh->hdr.ANCOUNT, mh, resflags, proc, clientData);
+	}
+	if (res == TCL_OK && (resflags & (RES_AUTH | RES_ADD))) {
+		res = DNSMsgEachRRInSection(interp, "authority", (resflags & RES_AUTH),
+				mh->hdr.NSCOUNT, mh, resflags, proc, clientData);
+	}
+	if (res == TCL_OK && (resflags & RES_ADD)) {
+		res = DNSMsgEachRRInSection(interp, "additional", RES_ADD,
+				mh->hdr.ARCOUNT, mh, resflags, proc, clientData);
+	}
+
+	return res;
+}
+
+/* Hands the questions and RRs of the sections of the message selected
+ * by resflags (and formatted accordingly) to proc one at a time, so that
+ * no result set is ever built. Stops early when proc returns anything
+ * but TCL_OK or TCL_CONTINUE, and returns that code then. */
+int
+DNSParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	dns_msg_handle handle;
+	int res;
+
+	DNSMsgInitHandle(&handle, msg, msglen);
+
+	if (DNSMsgParseHeader(interp, &handle) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	res = DNSMsgEachRR(interp, &handle, resflags, proc, clientData);
+
+	DNSMsgFreeNames(&handle);
+	return res;
+}
+
+/* Takes the SOA RR of a zone transfer (whose RDATA starts at the current
+ * position) into account and tells whether it is the one ending the
+ * transfer. The first SOA gives the serial of the zone; an AXFR reply
+ * ends with the next one. An IXFR reply either looks like an AXFR one
+ * or lists differences, each starting with the SOA of the serial it
+ * applies to and having the SOA of the serial it results in between
+ * its deletions and additions (RFC 1995); it ends with the SOA of the
+ * zone in place of the first SOA of a difference. A reply made of
+ * the first SOA alone means the zone is not newer than the serial
+ * the IXFR asked for. */
+static int
+DNSMsgTransferSOA (
+	Tcl_Interp *interp,
+	const dns_msg_handle *mh,
+	const dns_msg_rr *rr,
+	const int last,
+	DNSTransferState *statePtr,
+	int *finalPtr
+	)
+{
+	dns_msg_handle mhsoa;
+	unsigned long serial, delta;
+
+	mhsoa = *mh;
+	mhsoa.end = mh->cur + rr->rdlength - 1;
+	if (DNSMsgSkipName(interp, &mhsoa) != TCL_OK
+			|| DNSMsgSkipName(interp, &mhsoa) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	if (dns_msg_rem(&mhsoa) < 5 * DNSMSG_INT32_SIZE) {
+		DNSMsgSetPosixError(interp, EBADMSG);
+		return TCL_ERROR;
+	}
+	serial = dns_msg_int32(&mhsoa);
+
+	++statePtr->nsoas;
+	*finalPtr = 0;
+
+	if (statePtr->nrrs == 0) {
+		statePtr->serial = serial;
+		if (statePtr->incremental && last) {
+			/* Serial number arithmetic (RFC 1982) */
+			delta = (serial - statePtr->reqserial) & 0xFFFFFFFFUL;
+			*finalPtr = delta == 0 || delta >= 0x80000000UL;
+		}
+	} else if (statePtr->incremental && statePtr->nrrs == 1
+			&& serial != statePtr->serial) {
+		statePtr->diffs = 1;
+	} else if (! statePtr->diffs) {
+		*finalPtr = 1;
+	} else {
+		*finalPtr = statePtr->nsoas % 2 == 0 && serial == statePtr->serial;
+	}
+
+	return TCL_OK;
+}
+
+/* Hands the RRs of the answer section of a message of a zone transfer
+ * reply to proc one at a time (formatted according to resflags) until
+ * the SOA ending the transfer is met, which sets statePtr->done.
+ * Returns what DNSParseMessageRRs does. */
+int
+DNSTransferMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	DNSTransferState *statePtr,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	dns_msg_handle handle;
+	int i, res;
+
+	DNSMsgInitHandle(&handle, msg, msglen);
+
+	if (DNSMsgParseHeader(interp, &handle) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (! handle.hdr.QR || handle.hdr.ID != statePtr->id) {
+		Tcl_SetResult(interp, "Zone transfer reply does not match "
+				"the query", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	res = TCL_OK;
+	for (i = 0; i < handle.hdr.QDCOUNT && res == TCL_OK; ++i) {
+		res = DNSMsgParseQuestion(interp, &handle, resflags, NULL);
+	}
+
+	for (i = 0; i < handle.hdr.ANCOUNT && res == TCL_OK; ++i) {
+		dns_msg_rr rr;
+		Tcl_Obj *rrObj;
+		int final;
+
+		res = DNSMsgParseRRHeader(interp, &handle, &rr);
+		if (res != TCL_OK) {
+			break;
+		}
+
+		final = 0;
+		if (rr.type == 6 /* SOA */) {
+			res = DNSMsgTransferSOA(interp, &handle, &rr,
+					i == handle.hdr.ANCOUNT - 1, statePtr, &final);
+			if (res != TCL_OK) {
+				break;
+			}
+		} else if (statePtr->nrrs == 0) {
+			break;
+		}
+		++statePtr->nrrs;
+
+		res = DNSMsgParseRR(interp, &handle, &rr, resflags, &rrObj);
+		if (res == TCL_OK) {
+			res = DNSMsgDeliverRR(interp, "answer", rrObj, proc, clientData);
+		}
+		if (final) {
+			statePtr->done = 1;
+			break;
+		}
+	}
+
+	if (res == TCL_OK && statePtr->nrrs == 0) {
+		Tcl_SetResult(interp, "Zone transfer reply does not start "
+				"with a SOA record", TCL_STATIC);
+		res = TCL_ERROR;
+	}
+
+	DNSMsgFreeNames(&handle);
+	return res;
+}
+
+/* Sets the result of interp to the reply itself as a byte array
+ * (for DBC_RAWRESULT), scanning it only for the outcome of the query */
+int
+DNSRawResult (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	ResolveInfo *infoPtr
+	)
+{
+	DNSReply *replyPtr;
+
+	if (DNSReplyDecode(msg, msglen, 0, &replyPtr) != TCL_OK) {
+		DNSMsgSetErrnoResult(interp);
+		return TCL_ERROR;
+	}
+	*infoPtr = replyPtr->info;
+	DNSReplyFree(replyPtr);
+
+	Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(msg, msglen));
+	return TCL_OK;
+}
+
+/* Lazy result sets (RES_LAZY).
+ *
+ * Instead of the nested list of the result set the query returns
+ * a "dnsresult" object holding a copy of the reply and the offsets
+ * of its questions and RRs, found by a single pass over the message
+ * which decodes no names and no RDATA. Records are turned into
+ * Tcl objects only when asked for by DNSLazyGetRR (and remembered
+ * then), and the string form -- exactly that of the eagerly parsed
+ * result set -- is only generated if the script looks at the result
+ * as a string or a list. As Tcl lists can't be lazy, the latter
+ * replaces the internal representation by the complete list. */
+
+typedef struct {
+	int refcount;             /* Objects sharing this representation */
+	unsigned int resflags;    /* Formatting of the result set */
+	int counts[4];            /* QD, AN, NS and AR counts */
+	int *offsets;             /* Offsets of the questions and RRs
+	                           * of all sections, in order */
+	Tcl_Obj **rrObjs;         /* Records made so far, NULL if none */
+	int msglen;
+	unsigned char *msg;       /* Copy of the reply */
+} DNSLazyResult;
+
+#define LazyRep(objPtr) \
+	((DNSLazyResult *) (objPtr)->internalRep.otherValuePtr)
+
+static void FreeLazyResultInternalRep (Tcl_Obj *objPtr);
+static void DupLazyResultInternalRep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void UpdateStringOfLazyResult (Tcl_Obj *objPtr);
+static int SetLazyResultFromAny (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+static Tcl_ObjType lazyResultType = {
+	"dnsresult",
+	FreeLazyResultInternalRep,
+	DupLazyResultInternalRep,
+	UpdateStringOfLazyResult,
+	SetLazyResultFromAny
+};
+
+static void
+FreeLazyResultInternalRep (
+	Tcl_Obj *objPtr
+	)
+{
+	DNSLazyResult *lrPtr = LazyRep(objPtr);
+	int i, n;
+
+	if (--lrPtr->refcount > 0) {
+		return;
+	}
+
+	if (lrPtr->rrObjs != NULL) {
+		n = lrPtr->counts[0] + lrPtr->counts[1]
+			+ lrPtr->counts[2] + lrPtr->counts[3];
+		for (i = 0; i < n; ++i) {
+			if (lrPtr->rrObjs[i] != NULL) {
+				Tcl_DecrRefCount(lrPtr->rrObjs[i]);
+			}
+		}
+		ckfree((char *) lrPtr->rrObjs);
+	}
+	ckfree((char *) lrPtr);
+}
+
+static void
+DupLazyResultInternalRep (
+	Tcl_Obj *srcPtr,
+	Tcl_Obj *dupPtr
+	)
+{
+	DNSLazyResult *lrPtr = LazyRep(srcPtr);
+
+	++lrPtr->refcount;
+	dupPtr->internalRep.otherValuePtr = lrPtr;
+	dupPtr->typePtr = &lazyResultType;
+}
+
+static void
+UpdateStringOfLazyResult (
+	Tcl_Obj *objPtr
+	)
+{
+	DNSLazyResult *lrPtr = LazyRep(objPtr);
+	ResolveInfo info;
+	Tcl_Obj *resObj;
+	const char *str;
+	int len;
+
+	/* The message has been checked by DNSLazyIndex, so only
+	 * malformed RDATA can fail here; the string is empty then */
+	if (DNSMsgParseReply(NULL, lrPtr->msg, lrPtr->msglen,
+				lrPtr->resflags & ~RES_LAZY, &info, &resObj) != TCL_OK) {
+		resObj = Tcl_NewObj();
+	}
+
+	Tcl_IncrRefCount(resObj);
+	str = Tcl_GetStringFromObj(resObj, &len);
+	objPtr->bytes = ckalloc(len + 1);
+	memcpy(objPtr->bytes, str, len + 1);
+	objPtr->length = len;
+	Tcl_DecrRefCount(resObj);
+}
+
+static int
+SetLazyResultFromAny (
+	Tcl_Interp *interp,
+	Tcl_Obj *objPtr
+	)
+{
+	/* The reply can't be recovered from the string */
+	if (interp != NULL) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "expected a lazy result set but got \"",
+				Tcl_GetString(objPtr), "\"", NULL);
+	}
+	return TCL_ERROR;
+}
+
+/* Records the offsets of the questions and RRs of the message
+ * (whose header has been parsed) in the index of the result set
+ * and works out the outcome of the query as DNSReplyDecode does */
+static int
+DNSLazyScan (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	DNSLazyResult *lrPtr,
+	ResolveInfo *infoPtr
+	)
+{
+	unsigned long negttl;
+	int i, n, sect;
+
+	negttl = 0;
+	n = 0;
+	for (i = 0; i < mh->hdr.QDCOUNT; ++i) {
+		lrPtr->offsets[n++] = mh->cur - mh->start;
+		if (DNSMsgSkipName(interp, mh) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (dns_msg_rem(mh) < 2 * DNSMSG_INT16_SIZE) {
+			DNSMsgSetPosixError(interp, EBADMSG);
+			return TCL_ERROR;
+		}
+		dns_msg_adv(mh, 2 * DNSMSG_INT16_SIZE);
+	}
+
+	for (sect = 1; sect < 4; ++sect) {
+		for (i = 0; i < lrPtr->counts[sect]; ++i) {
+			dns_msg_rr rr;
+
+			lrPtr->offsets[n++] = mh->cur - mh->start;
+			if (DNSMsgParseRRHeader(interp, mh, &rr) != TCL_OK) {
+				return TCL_ERROR;
+			}
+			DNSMsgTrackTTL(mh, &rr, i == 0,
+					sect == 1 ? &infoPtr->ttl : NULL,
+					sect == 2 ? &negttl : NULL);
+			dns_msg_adv(mh, rr.rdlength);
+		}
+	}
+
+	DNSMsgSetStatus(mh, negttl, infoPtr);
+	return TCL_OK;
+}
+
+/* Indexes the message whose header has been parsed and sets the result
+ * of interp to the lazy result set made of it */
+static int
+DNSLazyIndex (
+	Tcl_Interp *interp,
+	dns_msg_handle *mh,
+	unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	DNSLazyResult *lrPtr;
+	Tcl_Obj *resObj;
+	int total;
+
+	/* Each question takes at least 5 octets and each RR 11 ones,
+	 * so bogus counts are rejected before allocating the index */
+	total = mh->hdr.QDCOUNT + mh->hdr.ANCOUNT
+		+ mh->hdr.NSCOUNT + mh->hdr.ARCOUNT;
+	if (total > dns_msg_rem(mh) / 5) {
+		DNSMsgSetPosixError(interp, EBADMSG);
+		return TCL_ERROR;
+	}
+
+	lrPtr = (DNSLazyResult *) ckalloc(sizeof(DNSLazyResult)
+			+ total * sizeof(int) + mh->len);
+	lrPtr->refcount  = 1;
+	lrPtr->resflags  = resflags;
+	lrPtr->counts[0] = mh->hdr.QDCOUNT;
+	lrPtr->counts[1] = mh->hdr.ANCOUNT;
+	lrPtr->counts[2] = mh->hdr.NSCOUNT;
+	lrPtr->counts[3] = mh->hdr.ARCOUNT;
+	lrPtr->offsets   = (int *) (lrPtr + 1);
+	lrPtr->rrObjs    = NULL;
+	lrPtr->msglen    = mh->len;
+	lrPtr->msg       = (unsigned char *) (lrPtr->offsets + total);
+	memcpy(lrPtr->msg, mh->start, mh->len);
+
+	if (DNSLazyScan(interp, mh, lrPtr, infoPtr) != TCL_OK) {
+		ckfree((char *) lrPtr);
+		return TCL_ERROR;
+	}
+
+	resObj = Tcl_NewObj();
+	Tcl_InvalidateStringRep(resObj);
+	resObj->internalRep.otherValuePtr = lrPtr;
+	resObj->typePtr = &lazyResultType;
+
+	Tcl_SetObjResult(interp, resObj);
+	return TCL_OK;
+}
+
+int
+DNSParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	Tcl_Obj *resObj;
+
+	if (resflags & RES_LAZY) {
+		dns_msg_handle handle;
+
+		DNSMsgInitHandle(&handle, msg, msglen);
+		if (DNSMsgParseHeader(interp, &handle) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		return DNSLazyIndex(interp, &handle, resflags, infoPtr);
+	}
+
+	if (DNSMsgParseReply(interp, msg, msglen,
+				resflags, infoPtr, &resObj) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult(interp, resObj);
+	return TCL_OK;
+}
+
+/* Maps the section (one of RES_QUESTION, RES_ANSWER, RES_AUTH
+ * and RES_ADD) to its index in the counts of a lazy result set */
+static int
+DNSLazySection (
+	const int section
+	)
+{
+	switch (section) {
+		case RES_QUESTION: return 0;
+		case RES_ANSWER:   return 1;
+		case RES_AUTH:     return 2;
+		default:           return 3;
+	}
+}
+
+/* Gets the lazy result set out of resObj; an empty string
+ * (the result of a negative answer) stands for no records at all */
+static int
+DNSLazyGetResult (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	DNSLazyResult **lrPtrPtr
+	)
+{
+	if (resObj->typePtr == &lazyResultType) {
+		*lrPtrPtr = LazyRep(resObj);
+		return TCL_OK;
+	}
+
+	*lrPtrPtr = NULL;
+	if (resObj->bytes != NULL && resObj->length == 0) {
+		return TCL_OK;
+	}
+
+	return SetLazyResultFromAny(interp, resObj);
+}
+
+int
+DNSLazyCount (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	DNSLazyResult *lrPtr;
+
+	if (DNSLazyGetResult(interp, resObj, &lrPtr) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	*countPtr = lrPtr == NULL ? 0 : lrPtr->counts[DNSLazySection(section)];
+	return TCL_OK;
+}
+
+int
+DNSLazyGetRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	DNSLazyResult *lrPtr;
+	dns_msg_handle handle;
+	Tcl_Obj *rrObj;
+	int sect, i, n, res;
+
+	if (DNSLazyGetResult(interp, resObj, &lrPtr) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	sect = DNSLazySection(section);
+	if (lrPtr == NULL || index < 0 || index >= lrPtr->counts[sect]) {
+		Tcl_SetResult(interp, "record index out of range", TCL_STATIC);
+		return TCL_ERROR;
+	}
+
+	n = lrPtr->counts[0] + lrPtr->counts[1]
+		+ lrPtr->counts[2] + lrPtr->counts[3];
+	for (i = index; --sect >= 0; ) {
+		i += lrPtr->counts[sect];
+	}
+
+	if (lrPtr->rrObjs != NULL && lrPtr->rrObjs[i] != NULL) {
+		*rrObjPtr = lrPtr->rrObjs[i];
+		return TCL_OK;
+	}
+
+	DNSMsgInitHandle(&handle, lrPtr->msg, lrPtr->msglen);
+	handle.cur = handle.start + lrPtr->offsets[i];
+
+	if (section == RES_QUESTION) {
+		rrObj = DNSFormatNewRecord(lrPtr->resflags);
+		res = DNSMsgParseQuestion(interp, &handle, lrPtr->resflags, rrObj);
+		if (res != TCL_OK) {
+			Tcl_DecrRefCount(rrObj);
+		}
+	} else {
+		dns_msg_rr rr;
+
+		res = DNSMsgParseRRHeader(interp, &handle, &rr);
+		if (res == TCL_OK) {
+			res = DNSMsgParseRR(interp, &handle, &rr,
+					lrPtr->resflags, &rrObj);
+		}
+	}
+	DNSMsgFreeNames(&handle);
+
+	if (res != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (lrPtr->rrObjs == NULL) {
+		lrPtr->rrObjs = (Tcl_Obj **) ckalloc(n * sizeof(Tcl_Obj *));
+		memset(lrPtr->rrObjs, 0, n * sizeof(Tcl_Obj *));
+	}
+	lrPtr->rrObjs[i] = rrObj;
+	Tcl_IncrRefCount(rrObj);
+
+	*rrObjPtr = rrObj;
+	return TCL_OK;
+}
@@ -7,10 +7,110 @@
 
 #include <tcl.h>
 
+/* A reply decoded by DNSReplyDecode: a single block of memory made of
+ * this header, the RRs of the sections kept (in order) and the arena
+ * of the names and RDATA they refer to by offsets */
+typedef struct {
+	unsigned short type;      /* QTYPE for questions */
+	unsigned short class;     /* QCLASS for questions */
+	unsigned long ttl;
+	unsigned short rdlength;  /* Length of RDATA on the wire */
+	int name;                 /* Offset of the owner name (ASCIIZ), or -1 */
+	int data;                 /* Offset of RDATA, names in it uncompressed */
+	int datalen;              /* Length of RDATA in the arena */
+} DNSReplyRR;
+
+typedef struct {
+	int size;                 /* Size of the whole block */
+	int rcode;
+	ResolveInfo info;         /* Outcome of the query */
+	int counts[4];            /* RRs of each section (question, answer,
+	                           * authority, additional) kept */
+	int nrrs;
+	int arenalen;
+	DNSReplyRR rrs[1];        /* nrrs of them, followed by the arena */
+} DNSReply;
+
+#define DNSReplyArena(replyPtr) \
+	((unsigned char *) ((replyPtr)->rrs + (replyPtr)->nrrs))
+
+int
+DNSReplyDecode (
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int flags,
+	DNSReply **replyPtrPtr);
+
+int
+DNSReplyFormat (
+	Tcl_Interp *interp,
+	const DNSReply *replyPtr,
+	const unsigned int resflags,
+	Tcl_Obj **resObjPtr);
+
+void
+DNSReplyFree (
+	DNSReply *replyPtr);
+
 int
 DNSParseMessage (
 	Tcl_Interp *interp,
 	const unsigned char msg[],
 	const int msglen,
-	unsigned int resflags);
+	unsigned int resflags,
+	ResolveInfo *infoPtr);
+
+
+int
+DNSParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData);
+
+/* Progress of a zone transfer, whose reply may span many messages */
+typedef struct {
+	unsigned short id;        /* ID of the query */
+	int incremental;          /* The query is an IXFR... */
+	unsigned long reqserial;  /* ...for the changes since this serial */
+	unsigned long serial;     /* Serial of the zone (of the first SOA) */
+	int nrrs;                 /* RRs met so far */
+	int nsoas;                /* SOA RRs among them */
+	int diffs;                /* The IXFR reply lists differences */
+	int done;                 /* The SOA ending the transfer is met */
+} DNSTransferState;
+
+int
+DNSTransferMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	DNSTransferState *statePtr,
+	Sysdns_RRProc *proc,
+	ClientData clientData);
+
+int
+DNSRawResult (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	ResolveInfo *infoPtr);
+
+int
+DNSLazyCount (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr);
+
+int
+DNSLazyGetRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr);
 
@@ -189,16 +189,16 @@ DNSParseRRSet (
 		}
 
 		if (resflags & RES_DETAIL) {
-			Tcl_Obj *sectObj = Tcl_NewListObj(0, NULL);
+			Tcl_Obj *sectObj = DNSFormatNewRecord(resflags);
 
 			DNSFormatRRHeader(interp, resflags, sectObj,
 					rri->rri_name,
 					rri->rri_rdtype,
 					rri->rri_rdclass,
 					rri->rri_ttl,
-					rdi->rdi_length);
+					rdi->rdi_length,
+					dataObj);
 
-			Tcl_ListObjAppendElement(interp, sectObj, dataObj);
 			Tcl_ListObjAppendElement(interp, resObj, sectObj);
 		} else {
 			Tcl_ListObjAppendElement(interp, resObj, dataObj);
@@ -215,7 +215,8 @@ Impl_Resolve (
 	Tcl_Obj *queryObj,
 	const unsigned short qclass,
 	const unsigned short qtype,
-	const unsigned int resflags
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
 	)
 {
 	struct rrsetinfo *dataPtr;
@@ -230,6 +231,9 @@ Impl_Resolve (
 		switch (res) {
 			case ERRSET_NONAME:
 			case ERRSET_NODATA:
+				/* lwres doesn't tell the negative caching TTL */
+				infoPtr->status = res == ERRSET_NONAME
+					? RESOLVE_NXDOMAIN : RESOLVE_NODATA;
 				Tcl_ResetResult(interp);
 				return TCL_OK;
 			case ERRSET_NOMEMORY:
@@ -264,11 +268,151 @@ Impl_Resolve (
 		return TCL_ERROR;
 	}
 
+	if (dataPtr->rri_nrdatas > 0) {
+		infoPtr->ttl = dataPtr->rri_ttl;
+	}
+
 	lwres_freerrset(dataPtr);
 	Tcl_SetObjResult(interp, answObj);
 	return TCL_OK;
 }
 
+int
+Impl_ResolveAsync (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj
+	)
+{
+	/* Never reached -- outer code checks for the BF_ASYNC feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_BATCH feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+void
+Impl_FreePreparedQuery (
+	ClientData prepared
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+}
+
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData
+	)
+{
+	/* Never reached -- outer code checks for the BF_XFER feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
+}
+
 int
 Impl_Reinit (
 	ClientData clientData,
@@ -0,0 +1,2324 @@
+/*
+ * native.c --
+ *   DNS resolution using a stub resolver implemented right here:
+ *   queries are built and sent to the nameservers over non-blocking
+ *   sockets by this module, and replies are parsed by dnsmsg.c.
+ *   The resolver library is only used to read the system's resolver
+ *   configuration (see resolver(5)).
+ *
+ * $Id$
+ */
+
+#if defined HAVE_SENDMMSG || defined HAVE_RECVMMSG
+#define _GNU_SOURCE               /* For sendmmsg() and recvmmsg() */
+#endif
+
+#include <tcl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include "tclsysdns.h"
+#include "dnsmsg.h"
+#include "xfer.h"
+#include "qtypes.h"
+
+/*
+ * Each interp has one UDP socket which all its queries are sent
+ * through, so any number of queries may be outstanding at once.
+ * Replies are matched to queries by their IDs (which are random
+ * and unique among the queries in flight) and then checked to carry
+ * the question that was asked and to come from a configured
+ * nameserver. Unanswered queries are retransmitted to the next
+ * nameserver once the timeout of the resolver configuration runs
+ * out, for the configured number of rounds. Truncated replies are
+ * retried over TCP.
+ *
+ * TCP connections are pooled per nameserver: a query sent over TCP
+ * goes down the least busy connection to its nameserver, and a new
+ * connection is only opened if that one already has NATIVE_TCPPIPELINE
+ * queries outstanding and there are less than NATIVE_TCPCONNS of them.
+ * Queries are written back to back without waiting for the replies,
+ * which are matched by their IDs in whatever order they arrive
+ * (RFC 7766). A connection left without outstanding queries is closed
+ * unless the query which used it last had the DBC_STAYOPEN option on;
+ * then it is kept for NATIVE_TCPIDLE seconds for later queries.
+ *
+ * Synchronous queries are completed by polling the interp's sockets
+ * right in the command; replies to any asynchronous queries received
+ * meanwhile are processed as well. While asynchronous queries are in
+ * flight, the sockets are watched by the Tcl notifier and the event
+ * source created by Impl_Init limits the notifier's blocking time
+ * to let the queries time out. Completed asynchronous queries are
+ * turned into events in the Tcl event queue.
+ *
+ * Where the system has recvmmsg(), the replies waiting in the UDP
+ * socket are read in batches of up to NATIVE_RECVBATCH datagrams
+ * per system call. While a batch of ::sysdns::resolvemany is being
+ * resolved, outgoing UDP queries are not sent right away but held
+ * in a queue which is flushed with as few calls to sendmmsg() as
+ * possible before waiting for the replies.
+ *
+ * Queries carry an EDNS0 OPT RR (RFC 6891) advertising the payload
+ * size set by "::sysdns::configure -ednssize" (or 1232 bytes if that
+ * is 0 and "options edns0" is in the resolver configuration), so
+ * large replies come over UDP instead of being truncated. A query
+ * rejected with FORMERR or NOTIMP is asked again without the OPT RR.
+ *
+ * Queries made by "::sysdns::query create" (Impl_PrepareQuery) keep
+ * the encoded question for the first name tried, so running them
+ * only takes filling in a header with a fresh ID. The question is
+ * encoded anew if the options or the resolver configuration it was
+ * made with have changed since.
+ */
+
+#ifdef HAVE_RECVMMSG
+#define NATIVE_RECVBATCH 32     /* Datagrams read per system call */
+#define NATIVE_UDPSIZE   4096   /* Longer datagrams are retried over TCP */
+#else
+#define NATIVE_RECVBATCH 1
+#define NATIVE_UDPSIZE   65536
+#endif
+#define NATIVE_BUFSIZE   (NATIVE_RECVBATCH * NATIVE_UDPSIZE)
+#define NATIVE_SENDBATCH 64     /* Size of the queue of outgoing datagrams */
+#define NATIVE_TCPCONNS  4      /* TCP connections per nameserver */
+#define NATIVE_TCPPIPELINE 32   /* Queries outstanding per TCP connection */
+#define NATIVE_TCPIDLE   10     /* Seconds idle TCP connections are kept open */
+#define NATIVE_EDNSSIZE  1232   /* Payload size advertised by "options edns0" */
+#define NATIVE_OPTSIZE   11     /* Size of the OPT RR carried by queries */
+#define NATIVE_MAXQUERY  (HFIXEDSZ + MAXCDNAME + QFIXEDSZ + NATIVE_OPTSIZE)
+#define NATIVE_IDTRIES   64     /* Random IDs tried before giving up */
+
+typedef struct NativeQuery NativeQuery;
+typedef struct NativeConn NativeConn;
+
+/* Query prepared by Impl_PrepareQuery */
+typedef struct {
+	int refcount;             /* Owner's reference plus queries made of it */
+	char *name;
+	unsigned short qclass;
+	unsigned short qtype;
+	int opts;                 /* Backend options the question was made for */
+	unsigned int config;      /* Resolver configuration it was made for */
+	unsigned char question[MAXCDNAME + QFIXEDSZ]; /* Encoded question */
+	int qlen;
+} NativePrepared;
+
+typedef struct {
+	struct __res_state state; /* Resolver configuration */
+	int opts;                 /* Backend options (DBC_*) in effect */
+	int def_opts;             /* Default backend options */
+	Tcl_Interp *interp;       /* Interp to deliver async results to */
+	int sock;                 /* UDP socket, -1 if not yet opened */
+	unsigned char *buf;       /* Buffer for incoming UDP replies */
+	Tcl_HashTable ids;        /* UDP queries in flight keyed by their IDs */
+	NativeQuery *queries;     /* All queries in flight (linked list) */
+	NativeConn *conns;        /* Open TCP connections (linked list) */
+	unsigned int seed;        /* State of the query ID generator */
+	unsigned int config;      /* Bumped when the configuration is reloaded */
+	int batching;             /* Whether UDP queries are held in outq */
+	NativeQuery *outq[NATIVE_SENDBATCH]; /* UDP queries waiting to be sent */
+	int noutq;
+	BatchStats traffic;       /* Totals of the socket I/O of the interp */
+} InterpData;
+
+typedef enum {
+	NQ_UDP,                   /* Waiting for a reply over UDP */
+	NQ_TCP                    /* Waiting for a reply over TCP */
+} native_state_t;
+
+/* TCP connection to a nameserver */
+struct NativeConn {
+	InterpData *owner;
+	NativeConn *prevPtr;      /* Links in the owner's list of connections */
+	NativeConn *nextPtr;
+	int ns;                   /* Index of the nameserver connected to */
+	int fd;
+	int connecting;           /* Whether connect() is still in progress */
+	int mask;                 /* Events the notifier watches for */
+	int nqueries;             /* Number of queries waiting for replies */
+	Tcl_Time expires;         /* When it's closed if still idle */
+
+	unsigned char *obuf;      /* Queries to write, with length prefixes */
+	int olen;
+	int opos;                 /* Bytes of obuf written */
+	int osize;
+
+	unsigned char ihdr[2];    /* Length prefix of the reply being read */
+	unsigned char *ibuf;      /* Reply being read */
+	int ilen;                 /* Length of the reply, 0 if not yet known */
+	int ipos;                 /* Bytes of the current item read */
+};
+
+struct NativeQuery {
+	InterpData *owner;
+	NativeQuery *prevPtr;     /* Links in the owner's list of queries */
+	NativeQuery *nextPtr;
+	Tcl_Obj *cmdObj;          /* Callback of an async query, NULL otherwise */
+	unsigned int resflags;
+
+	char *name;               /* Name as given by the caller */
+	NativePrepared *prepPtr;  /* Prepared query it's made of, if any */
+	unsigned short qclass;
+	unsigned short qtype;
+	int opts;                 /* Backend options the query was made with */
+	int cand;                 /* Index of the search list candidate being tried */
+	int edns;                 /* EDNS0 payload size advertised, 0 for none */
+
+	unsigned short id;
+	int registered;           /* Whether the ID is in the owner's table */
+	unsigned char msgbuf[2 + NATIVE_MAXQUERY]; /* TCP length prefix + query */
+	int msglen;
+	int qend;                 /* Offset of the end of the question in it */
+	int ns;                   /* Index of the nameserver being asked */
+	int tries;                /* Number of transmissions made */
+	Tcl_Time deadline;        /* When the current transmission times out */
+
+	native_state_t state;
+	NativeConn *conn;         /* Connection the query was sent over */
+
+	int done;                 /* Outcome, valid once this is set: */
+	unsigned char *answer;    /* reply or NULL if the query failed with */
+	int anslen;
+	const char *errmsg;       /* this error message */
+	const char *errcode;      /* and this code (for the SYSDNS error code) */
+};
+
+/* Event delivering the outcome of an async query to the Tcl event loop */
+typedef struct {
+	Tcl_Event header;
+	NativeQuery *nqPtr;
+} NativeEvent;
+
+static const unsigned short
+SupportedQTypes[] = {
+	SYSDNS_TYPE_A,
+	SYSDNS_TYPE_NS,
+	SYSDNS_TYPE_MD,
+	SYSDNS_TYPE_MF,
+	SYSDNS_TYPE_CNAME,
+	SYSDNS_TYPE_SOA,
+	SYSDNS_TYPE_MB,
+	SYSDNS_TYPE_MG,
+	SYSDNS_TYPE_MR,
+	SYSDNS_TYPE_NULL,
+	SYSDNS_TYPE_WKS,
+	SYSDNS_TYPE_PTR,
+	SYSDNS_TYPE_HINFO,
+	SYSDNS_TYPE_MINFO,
+	SYSDNS_TYPE_MX,
+	SYSDNS_TYPE_TXT,
+	SYSDNS_TYPE_RP,
+	SYSDNS_TYPE_AFSDB,
+	SYSDNS_TYPE_X25,
+	SYSDNS_TYPE_ISDN,
+	SYSDNS_TYPE_RT,
+	SYSDNS_TYPE_AAAA,
+	SYSDNS_TYPE_SRV,
+	0
+};
+
+#define NATIVE_CAPS (DBC_DEFAULTS | DBC_RAWRESULT | DBC_TCP | DBC_TRUNCOK \
+		| DBC_SEARCH | DBC_PRIMARY | DBC_STAYOPEN)
+
+static void NativeSetupProc (ClientData clientData, int flags);
+static void NativeCheckProc (ClientData clientData, int flags);
+static void NativeTcpFileProc (ClientData clientData, int mask);
+
+static int
+ResInit (
+	Tcl_Interp *interp,
+	InterpData *interpData
+	)
+{
+	memset(&interpData->state, 0, sizeof(interpData->state));
+
+	Tcl_SetErrno(0);
+	if (res_ninit(&interpData->state) != 0) {
+		if (Tcl_GetErrno() == 0) {
+			Tcl_SetErrno(EINVAL);
+		}
+		Tcl_SetObjResult(interp,
+				Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+		return TCL_ERROR;
+	}
+
+	interpData->def_opts = 0;
+	if (interpData->state.options & RES_USEVC) {
+		interpData->def_opts |= DBC_TCP;
+	}
+	if (interpData->state.options & RES_IGNTC) {
+		interpData->def_opts |= DBC_TRUNCOK;
+	}
+	if (interpData->state.options & RES_DNSRCH) {
+		interpData->def_opts |= DBC_SEARCH;
+	}
+	if (interpData->state.options & RES_STAYOPEN) {
+		interpData->def_opts |= DBC_STAYOPEN;
+	}
+
+	return TCL_OK;
+}
+
+static void
+NativeSetPosixError (
+	Tcl_Interp *interp,
+	int errcode
+	)
+{
+	Tcl_SetErrno(errcode);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+}
+
+/* Seeds the query ID generator from the system's entropy source */
+static unsigned int
+NativeSeed (void)
+{
+	unsigned int seed;
+	int fd;
+
+	seed = 0;
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+			seed = 0;
+		}
+		close(fd);
+	}
+	if (seed == 0) {
+		seed = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+	}
+
+	return seed == 0 ? 1 : seed;
+}
+
+/* xorshift32 */
+static unsigned short
+NativeRandom (
+	InterpData *interpData
+	)
+{
+	unsigned int x = interpData->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	interpData->seed = x;
+
+	return (unsigned short) (x >> 8);
+}
+
+static void
+NativeLinkQuery (
+	InterpData *interpData,
+	NativeQuery *nqPtr
+	)
+{
+	nqPtr->prevPtr = NULL;
+	nqPtr->nextPtr = interpData->queries;
+	if (interpData->queries != NULL) {
+		interpData->queries->prevPtr = nqPtr;
+	}
+	interpData->queries = nqPtr;
+}
+
+static void
+NativeUnlinkQuery (
+	InterpData *interpData,
+	NativeQuery *nqPtr
+	)
+{
+	if (nqPtr->prevPtr != NULL) {
+		nqPtr->prevPtr->nextPtr = nqPtr->nextPtr;
+	} else {
+		interpData->queries = nqPtr->nextPtr;
+	}
+	if (nqPtr->nextPtr != NULL) {
+		nqPtr->nextPtr->prevPtr = nqPtr->prevPtr;
+	}
+}
+
+static void
+NativeReleasePrepared (
+	NativePrepared *prepPtr
+	)
+{
+	if (--prepPtr->refcount == 0) {
+		ckfree(prepPtr->name);
+		ckfree((char *) prepPtr);
+	}
+}
+
+static void
+NativeFreeQuery (
+	NativeQuery *nqPtr
+	)
+{
+	if (nqPtr->cmdObj != NULL) {
+		Tcl_DecrRefCount(nqPtr->cmdObj);
+	}
+	if (nqPtr->answer != NULL) {
+		ckfree((char *) nqPtr->answer);
+	}
+	if (nqPtr->prepPtr != NULL) {
+		NativeReleasePrepared(nqPtr->prepPtr);
+	} else {
+		ckfree(nqPtr->name);
+	}
+	ckfree((char *) nqPtr);
+}
+
+static void
+NativeUdpFileProc (
+	ClientData clientData,
+	int mask
+	);
+
+static int
+NativeOpenSocket (
+	Tcl_Interp *interp,
+	InterpData *interpData
+	)
+{
+	int sock;
+
+	if (interpData->sock != -1) {
+		return TCL_OK;
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == -1) {
+		NativeSetPosixError(interp, errno);
+		return TCL_ERROR;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+	interpData->sock = sock;
+	Tcl_CreateFileHandler(sock, TCL_READABLE,
+			NativeUdpFileProc, (ClientData) interpData);
+
+	return TCL_OK;
+}
+
+static void
+NativeCloseSocket (
+	InterpData *interpData
+	)
+{
+	if (interpData->sock != -1) {
+		Tcl_DeleteFileHandler(interpData->sock);
+		close(interpData->sock);
+		interpData->sock = -1;
+	}
+	interpData->noutq = 0;
+}
+
+static struct sockaddr_in *
+NativeServer (
+	NativeQuery *nqPtr
+	)
+{
+	return &nqPtr->owner->state.nsaddr_list[nqPtr->ns];
+}
+
+/* Encodes the name as a sequence of labels. Returns the length
+ * of the encoded name or -1 if the name is not valid. */
+static int
+NativeEncodeName (
+	const char *name,
+	unsigned char *buf
+	)
+{
+	unsigned char *lenPtr;
+	int len, total;
+
+	if (name[0] == '\0' || (name[0] == '.' && name[1] == '\0')) {
+		buf[0] = 0;
+		return 1;
+	}
+
+	total = 0;
+	while (1) {
+		lenPtr = buf + total++;
+		len = 0;
+		while (*name != '.' && *name != '\0') {
+			if (total >= MAXCDNAME - 1) {
+				return -1;
+			}
+			buf[total++] = (unsigned char) *name++;
+			++len;
+		}
+		if (len == 0 || len > 63) {
+			return -1;
+		}
+		*lenPtr = (unsigned char) len;
+		if (*name == '\0' || (name[0] == '.' && name[1] == '\0')) {
+			break;
+		}
+		++name;
+	}
+	buf[total++] = 0;
+
+	return total;
+}
+
+/* Gets the candidate name with the given index. Like res_nsearch(),
+ * names having at least "ndots" dots are tried as they are before
+ * the names made by appending the domains of the search list,
+ * others are tried after them. Returns 0 if there is no such
+ * candidate. */
+static int
+NativeGetCandidate (
+	NativeQuery *nqPtr,
+	const int index,
+	Tcl_DString *namePtr
+	)
+{
+	struct __res_state *statePtr;
+	const char *name, *p;
+	int len, dots, ndomains, asisfirst, domain;
+
+	statePtr = &nqPtr->owner->state;
+	name = nqPtr->name;
+	len  = strlen(name);
+
+	dots = 0;
+	for (p = name; *p != '\0'; ++p) {
+		if (*p == '.') ++dots;
+	}
+
+	ndomains = 0;
+	if ((nqPtr->opts & DBC_SEARCH) && ! (len > 0 && name[len - 1] == '.')) {
+		while (ndomains < MAXDNSRCH && statePtr->dnsrch[ndomains] != NULL) {
+			++ndomains;
+		}
+	}
+
+	asisfirst = ndomains == 0 || dots >= (int) statePtr->ndots;
+
+	if (asisfirst) {
+		domain = index - 1;
+	} else {
+		domain = index < ndomains ? index : -1;
+	}
+	if (index > ndomains) {
+		return 0;
+	}
+
+	Tcl_DStringInit(namePtr);
+	Tcl_DStringAppend(namePtr, name, len);
+	if (domain >= 0) {
+		Tcl_DStringAppend(namePtr, ".", 1);
+		Tcl_DStringAppend(namePtr, statePtr->dnsrch[domain], -1);
+	}
+
+	return 1;
+}
+
+/* Gives the query a random ID no other query in flight has.
+ * Returns 0 if none was found in NATIVE_IDTRIES attempts. */
+static int
+NativeRegisterId (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData;
+	Tcl_HashEntry *hPtr;
+	int tries, new;
+
+	interpData = nqPtr->owner;
+
+	for (tries = 0; tries < NATIVE_IDTRIES; ++tries) {
+		nqPtr->id = NativeRandom(interpData);
+		hPtr = Tcl_CreateHashEntry(&interpData->ids,
+				(char *) (size_t) nqPtr->id, &new);
+		if (new) {
+			Tcl_SetHashValue(hPtr, nqPtr);
+			nqPtr->registered = 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+NativeUnregisterId (
+	NativeQuery *nqPtr
+	)
+{
+	Tcl_HashEntry *hPtr;
+
+	if (! nqPtr->registered) {
+		return;
+	}
+
+	hPtr = Tcl_FindHashEntry(&nqPtr->owner->ids, (char *) (size_t) nqPtr->id);
+	if (hPtr != NULL) {
+		Tcl_DeleteHashEntry(hPtr);
+	}
+	nqPtr->registered = 0;
+}
+
+/* Encodes the question for the given candidate name of the query
+ * into buf (of MAXCDNAME + QFIXEDSZ bytes). Returns its length
+ * or -1 if there is no such candidate or it can't be encoded. */
+static int
+NativeEncodeQuestion (
+	NativeQuery *nqPtr,
+	const int cand,
+	unsigned char *buf
+	)
+{
+	Tcl_DString name;
+	int len;
+
+	if (! NativeGetCandidate(nqPtr, cand, &name)) {
+		return -1;
+	}
+
+	len = NativeEncodeName(Tcl_DStringValue(&name), buf);
+	Tcl_DStringFree(&name);
+	if (len == -1) {
+		return -1;
+	}
+
+	buf += len;
+	buf[0] = nqPtr->qtype >> 8;
+	buf[1] = nqPtr->qtype & 0xff;
+	buf[2] = nqPtr->qclass >> 8;
+	buf[3] = nqPtr->qclass & 0xff;
+
+	return len + QFIXEDSZ;
+}
+
+/* Makes the query message for the current candidate name.
+ * Returns 0 if the name can't be encoded and -1 if no query ID
+ * is free, in which case the query's error is set. */
+static int
+NativeMakeQuery (
+	NativeQuery *nqPtr
+	)
+{
+	NativePrepared *prepPtr = nqPtr->prepPtr;
+	unsigned char *msg;
+	int len;
+
+	msg = nqPtr->msgbuf + 2;
+
+	if (nqPtr->cand == 0 && prepPtr != NULL && prepPtr->opts == nqPtr->opts
+			&& prepPtr->config == nqPtr->owner->config) {
+		len = prepPtr->qlen;
+		memcpy(msg + HFIXEDSZ, prepPtr->question, len);
+	} else {
+		len = NativeEncodeQuestion(nqPtr, nqPtr->cand, msg + HFIXEDSZ);
+		if (len == -1) {
+			return 0;
+		}
+	}
+
+	NativeUnregisterId(nqPtr);
+	if (! NativeRegisterId(nqPtr)) {
+		nqPtr->errmsg  = "No free DNS query ID";
+		nqPtr->errcode = "NOQUERYID";
+		return -1;
+	}
+
+	memset(msg, 0, HFIXEDSZ);
+	msg[0] = nqPtr->id >> 8;
+	msg[1] = nqPtr->id & 0xff;
+	msg[2] = 0x01;            /* RD */
+	msg[5] = 1;               /* QDCOUNT */
+
+	nqPtr->qend = nqPtr->msglen = HFIXEDSZ + len;
+
+	if (nqPtr->edns > 0) {
+		/* OPT RR: root owner, the payload size in place of the class,
+		 * zero extended RCODE, version and flags, no options */
+		msg += HFIXEDSZ + len;
+		memset(msg, 0, NATIVE_OPTSIZE);
+		msg[2] = ns_t_opt;
+		msg[3] = nqPtr->edns >> 8;
+		msg[4] = nqPtr->edns & 0xff;
+		nqPtr->msgbuf[2 + 11] = 1; /* ARCOUNT */
+		nqPtr->msglen += NATIVE_OPTSIZE;
+	}
+	nqPtr->msgbuf[0] = nqPtr->msglen >> 8;
+	nqPtr->msgbuf[1] = nqPtr->msglen & 0xff;
+
+	nqPtr->tries = 0;
+	nqPtr->ns    = 0;
+
+	return 1;
+}
+
+static void
+NativeSetDeadline (
+	NativeQuery *nqPtr,
+	const int seconds
+	)
+{
+	Tcl_GetTime(&nqPtr->deadline);
+	nqPtr->deadline.sec += seconds;
+}
+
+static int
+NativeTimeIsBefore (
+	const Tcl_Time *aPtr,
+	const Tcl_Time *bPtr
+	)
+{
+	return aPtr->sec < bPtr->sec
+		|| (aPtr->sec == bPtr->sec && aPtr->usec < bPtr->usec);
+}
+
+static void
+NativeRetry (
+	NativeQuery *nqPtr
+	);
+
+static void
+NativeConnWatch (
+	NativeConn *connPtr
+	)
+{
+	int mask;
+
+	mask = TCL_READABLE;
+	if (connPtr->connecting || connPtr->opos < connPtr->olen) {
+		mask |= TCL_WRITABLE;
+	}
+
+	if (mask != connPtr->mask) {
+		Tcl_CreateFileHandler(connPtr->fd, mask,
+				NativeTcpFileProc, (ClientData) connPtr);
+		connPtr->mask = mask;
+	}
+}
+
+static void
+NativeConnUnlink (
+	NativeConn *connPtr
+	)
+{
+	InterpData *interpData = connPtr->owner;
+
+	if (connPtr->prevPtr != NULL) {
+		connPtr->prevPtr->nextPtr = connPtr->nextPtr;
+	} else {
+		interpData->conns = connPtr->nextPtr;
+	}
+	if (connPtr->nextPtr != NULL) {
+		connPtr->nextPtr->prevPtr = connPtr->prevPtr;
+	}
+}
+
+static void
+NativeConnFree (
+	NativeConn *connPtr
+	)
+{
+	Tcl_DeleteFileHandler(connPtr->fd);
+	close(connPtr->fd);
+
+	if (connPtr->obuf != NULL) {
+		ckfree((char *) connPtr->obuf);
+	}
+	if (connPtr->ibuf != NULL) {
+		ckfree((char *) connPtr->ibuf);
+	}
+	ckfree((char *) connPtr);
+}
+
+/* Closes the connection. Queries waiting for replies
+ * over it must have been detached before. */
+static void
+NativeConnClose (
+	NativeConn *connPtr
+	)
+{
+	NativeConnUnlink(connPtr);
+	NativeConnFree(connPtr);
+}
+
+static void
+NativeCloseConns (
+	InterpData *interpData
+	)
+{
+	while (interpData->conns != NULL) {
+		NativeConnClose(interpData->conns);
+	}
+}
+
+/* Detaches the query from the connection it was sent over;
+ * a reply to it arriving later will be ignored */
+static void
+NativeTcpDetach (
+	NativeQuery *nqPtr
+	)
+{
+	NativeConn *connPtr = nqPtr->conn;
+
+	if (connPtr == NULL) {
+		return;
+	}
+	nqPtr->conn = NULL;
+
+	if (--connPtr->nqueries == 0) {
+		/* Idle now; NativeReapConns will close it when this expires */
+		Tcl_GetTime(&connPtr->expires);
+		if (nqPtr->opts & DBC_STAYOPEN) {
+			connPtr->expires.sec += NATIVE_TCPIDLE;
+		}
+	}
+}
+
+/* Closes the connection after a failure; the queries waiting
+ * for replies over it go on to the next nameserver */
+static void
+NativeConnFail (
+	NativeConn *connPtr
+	)
+{
+	InterpData *interpData = connPtr->owner;
+	NativeQuery *nqPtr, *nextPtr;
+
+	/* Out of the pool first, so the queries don't come back to it */
+	NativeConnUnlink(connPtr);
+
+	for (nqPtr = interpData->queries; nqPtr != NULL; nqPtr = nextPtr) {
+		nextPtr = nqPtr->nextPtr;
+		if (nqPtr->conn == connPtr) {
+			nqPtr->conn = NULL;
+			nqPtr->errmsg = "Connection to nameserver failed";
+			nqPtr->errcode = "CONNFAILED";
+			NativeRetry(nqPtr);
+		}
+	}
+
+	NativeConnFree(connPtr);
+}
+
+/* Opens a new connection to the nameserver. Returns NULL
+ * if the connection can't even be attempted. */
+static NativeConn *
+NativeConnOpen (
+	InterpData *interpData,
+	const int ns
+	)
+{
+	NativeConn *connPtr;
+	int fd, connecting;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(fd, (struct sockaddr *) &interpData->state.nsaddr_list[ns],
+				sizeof(struct sockaddr_in)) == 0) {
+		connecting = 0;
+	} else if (errno == EINPROGRESS) {
+		connecting = 1;
+	} else {
+		close(fd);
+		return NULL;
+	}
+
+	connPtr = (NativeConn *) ckalloc(sizeof(NativeConn));
+	memset(connPtr, 0, sizeof(NativeConn));
+	connPtr->owner      = interpData;
+	connPtr->ns         = ns;
+	connPtr->fd         = fd;
+	connPtr->connecting = connecting;
+
+	connPtr->prevPtr = NULL;
+	connPtr->nextPtr = interpData->conns;
+	if (interpData->conns != NULL) {
+		interpData->conns->prevPtr = connPtr;
+	}
+	interpData->conns = connPtr;
+
+	NativeConnWatch(connPtr);
+
+	return connPtr;
+}
+
+/* Sends the query over TCP to the current nameserver. Failures
+ * make the query go on to the next nameserver right away. */
+static void
+NativeTcpStart (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData;
+	NativeConn *connPtr, *bestPtr;
+	int count, len;
+
+	interpData = nqPtr->owner;
+
+	NativeTcpDetach(nqPtr);
+
+	/* Pick the least busy connection to the nameserver */
+	bestPtr = NULL;
+	count = 0;
+	for (connPtr = interpData->conns; connPtr != NULL;
+			connPtr = connPtr->nextPtr) {
+		if (connPtr->ns != nqPtr->ns) continue;
+		++count;
+		if (bestPtr == NULL || connPtr->nqueries < bestPtr->nqueries) {
+			bestPtr = connPtr;
+		}
+	}
+
+	if (bestPtr == NULL || (bestPtr->nqueries >= NATIVE_TCPPIPELINE
+				&& count < NATIVE_TCPCONNS)) {
+		connPtr = NativeConnOpen(interpData, nqPtr->ns);
+		if (connPtr == NULL) {
+			connPtr = bestPtr;
+		}
+	} else {
+		connPtr = bestPtr;
+	}
+
+	if (connPtr == NULL) {
+		nqPtr->errmsg = "Connection to nameserver failed";
+		nqPtr->errcode = "CONNFAILED";
+		Tcl_GetTime(&nqPtr->deadline);
+		return;
+	}
+
+	len = nqPtr->msglen + 2;
+	if (connPtr->opos == connPtr->olen) {
+		connPtr->opos = connPtr->olen = 0;
+	}
+	if (connPtr->olen + len > connPtr->osize) {
+		connPtr->osize = 2 * (connPtr->olen + len);
+		connPtr->obuf = (unsigned char *) ckrealloc((char *) connPtr->obuf,
+				connPtr->osize);
+	}
+	memcpy(connPtr->obuf + connPtr->olen, nqPtr->msgbuf, len);
+	connPtr->olen += len;
+
+	nqPtr->conn = connPtr;
+	++connPtr->nqueries;
+
+	NativeConnWatch(connPtr);
+}
+
+/* Closes the idle connections which have expired */
+static void
+NativeReapConns (
+	InterpData *interpData
+	)
+{
+	NativeConn *connPtr, *nextPtr;
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+
+	for (connPtr = interpData->conns; connPtr != NULL; connPtr = nextPtr) {
+		nextPtr = connPtr->nextPtr;
+		if (connPtr->nqueries == 0
+				&& ! NativeTimeIsBefore(&now, &connPtr->expires)) {
+			NativeConnClose(connPtr);
+		}
+	}
+}
+
+/* Removes the query from the queue of outgoing datagrams */
+static void
+NativeDequeue (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData = nqPtr->owner;
+	int i, j;
+
+	for (i = 0, j = 0; i < interpData->noutq; ++i) {
+		if (interpData->outq[i] != nqPtr) {
+			interpData->outq[j++] = interpData->outq[i];
+		}
+	}
+	interpData->noutq = j;
+}
+
+/* Sends the query over UDP to the current nameserver */
+static void
+NativeSendUdp (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData = nqPtr->owner;
+
+	++interpData->traffic.sendcalls;
+	if (sendto(interpData->sock, nqPtr->msgbuf + 2, nqPtr->msglen, 0,
+				(struct sockaddr *) NativeServer(nqPtr),
+				sizeof(struct sockaddr_in)) == -1) {
+		if (errno != EAGAIN) {
+			/* Let the next nameserver have a try right away */
+			Tcl_GetTime(&nqPtr->deadline);
+		}
+		return;
+	}
+	++interpData->traffic.sent;
+}
+
+/* Sends all the queries held in the queue of outgoing datagrams */
+static void
+NativeFlush (
+	InterpData *interpData
+	)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NATIVE_SENDBATCH];
+	struct iovec iovs[NATIVE_SENDBATCH];
+	int first, n;
+#endif
+	int i;
+
+	if (interpData->noutq == 0) {
+		return;
+	}
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(struct mmsghdr) * interpData->noutq);
+	for (i = 0; i < interpData->noutq; ++i) {
+		NativeQuery *nqPtr = interpData->outq[i];
+
+		iovs[i].iov_base = nqPtr->msgbuf + 2;
+		iovs[i].iov_len  = nqPtr->msglen;
+		msgs[i].msg_hdr.msg_name    = NativeServer(nqPtr);
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov     = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	first = 0;
+	while (first < interpData->noutq) {
+		++interpData->traffic.sendcalls;
+		n = sendmmsg(interpData->sock, msgs + first,
+				interpData->noutq - first, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break; /* The rest will time out */
+			/* sendmmsg() stops at the datagram which can't be sent:
+			 * let the next nameserver have a try right away */
+			Tcl_GetTime(&interpData->outq[first]->deadline);
+			++first;
+			continue;
+		}
+		interpData->traffic.sent += n;
+		first += n;
+	}
+#else
+	for (i = 0; i < interpData->noutq; ++i) {
+		NativeSendUdp(interpData->outq[i]);
+	}
+#endif
+
+	interpData->noutq = 0;
+}
+
+/* Sends the query to the current nameserver */
+static void
+NativeTransmit (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData = nqPtr->owner;
+
+	++nqPtr->tries;
+	NativeSetDeadline(nqPtr, interpData->state.retrans > 0
+			? interpData->state.retrans : RES_TIMEOUT);
+
+	if (interpData->batching) {
+		NativeDequeue(nqPtr);
+	}
+
+	if (nqPtr->state != NQ_UDP || (nqPtr->opts & DBC_TCP)) {
+		nqPtr->state = NQ_TCP;
+		NativeTcpStart(nqPtr);
+		return;
+	}
+
+	if (interpData->batching) {
+		if (interpData->noutq == NATIVE_SENDBATCH) {
+			NativeFlush(interpData);
+		}
+		interpData->outq[interpData->noutq++] = nqPtr;
+		return;
+	}
+
+	NativeSendUdp(nqPtr);
+}
+
+static int
+NativeEventProc (
+	Tcl_Event *evPtr,
+	int flags
+	);
+
+/* Finishes the query. Async queries are handed over
+ * to the event loop; sync ones are left for their waiters. */
+static void
+NativeComplete (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData = nqPtr->owner;
+
+	NativeUnregisterId(nqPtr);
+	NativeTcpDetach(nqPtr);
+	NativeDequeue(nqPtr);
+	NativeUnlinkQuery(interpData, nqPtr);
+	nqPtr->done = 1;
+
+	if (nqPtr->cmdObj != NULL) {
+		NativeEvent *eventPtr;
+
+		eventPtr = (NativeEvent *) ckalloc(sizeof(NativeEvent));
+		eventPtr->header.proc = NativeEventProc;
+		eventPtr->nqPtr       = nqPtr;
+		Tcl_QueueEvent((Tcl_Event *) eventPtr, TCL_QUEUE_TAIL);
+	}
+}
+
+static void
+NativeFail (
+	NativeQuery *nqPtr,
+	const char *errmsg,
+	const char *errcode
+	)
+{
+	nqPtr->errmsg  = errmsg;
+	nqPtr->errcode = errcode;
+	NativeComplete(nqPtr);
+}
+
+/* Gives up on the current nameserver: asks the next one
+ * or fails the query if all the tries are used up */
+static void
+NativeRetry (
+	NativeQuery *nqPtr
+	)
+{
+	InterpData *interpData;
+	int nscount, rounds;
+
+	interpData = nqPtr->owner;
+
+	NativeTcpDetach(nqPtr);
+
+	nscount = interpData->state.nscount > 0 ? interpData->state.nscount : 1;
+	if (nqPtr->opts & DBC_PRIMARY) {
+		nscount = 1;
+	}
+	rounds = interpData->state.retry > 0 ? interpData->state.retry : RES_DFLRETRY;
+
+	if (nqPtr->tries >= rounds * nscount) {
+		NativeComplete(nqPtr);
+		return;
+	}
+
+	nqPtr->ns = (nqPtr->ns + 1) % nscount;
+	NativeTransmit(nqPtr);
+}
+
+/* Checks whether the reply carries the question of the query.
+ * Names are compared case-insensitively. */
+static int
+NativeQuestionMatches (
+	NativeQuery *nqPtr,
+	const unsigned char *reply,
+	const int len
+	)
+{
+	const unsigned char *q;
+	int qlen, i;
+
+	q = nqPtr->msgbuf + 2;
+	qlen = nqPtr->qend;
+
+	if (len < qlen || reply[4] != 0 || reply[5] != 1) {
+		return 0;
+	}
+
+	for (i = HFIXEDSZ; i < qlen - QFIXEDSZ; ++i) {
+		if (tolower(reply[i]) != tolower(q[i])) {
+			return 0;
+		}
+	}
+
+	return memcmp(reply + i, q + i, QFIXEDSZ) == 0;
+}
+
+/* Asks the current nameserver again, over TCP */
+static void
+NativeSwitchToTcp (
+	NativeQuery *nqPtr
+	)
+{
+	nqPtr->state = NQ_TCP;
+	NativeTransmit(nqPtr);
+}
+
+/* Processes the reply received for the query */
+static void
+NativeHandleReply (
+	NativeQuery *nqPtr,
+	const unsigned char *reply,
+	const int len
+	)
+{
+	int rcode;
+
+	if (nqPtr->state == NQ_UDP && (reply[2] & 0x02)
+			&& ! (nqPtr->opts & DBC_TRUNCOK)) {
+		NativeSwitchToTcp(nqPtr);
+		return;
+	}
+
+	rcode = reply[3] & 0x0f;
+
+	if ((rcode == FORMERR || rcode == NOTIMP) && nqPtr->edns > 0) {
+		int ns = nqPtr->ns, tries = nqPtr->tries;
+
+		/* The nameserver may predate EDNS0 -- ask it again without it */
+		nqPtr->edns = 0;
+		switch (NativeMakeQuery(nqPtr)) {
+			case 1:
+				nqPtr->ns    = ns;
+				nqPtr->tries = tries;
+				NativeTcpDetach(nqPtr);
+				NativeTransmit(nqPtr);
+				return;
+			case -1:
+				NativeComplete(nqPtr);
+				return;
+		}
+	}
+
+	switch (rcode) {
+		case NOERROR:
+		case NXDOMAIN:
+			if (rcode == NXDOMAIN) {
+				++nqPtr->cand;
+				switch (NativeMakeQuery(nqPtr)) {
+					case 1:
+						/* Try the next name of the search list */
+						nqPtr->state = NQ_UDP;
+						NativeTcpDetach(nqPtr);
+						NativeTransmit(nqPtr);
+						return;
+					case -1:
+						NativeComplete(nqPtr);
+						return;
+				}
+			}
+			nqPtr->answer = (unsigned char *) ckalloc(len);
+			memcpy(nqPtr->answer, reply, len);
+			nqPtr->anslen = len;
+			NativeComplete(nqPtr);
+			return;
+		case FORMERR:
+			nqPtr->errmsg  = "Nameserver could not interpret the query";
+			nqPtr->errcode = "FORMERR";
+			break;
+		case SERVFAIL:
+			nqPtr->errmsg  = "Nameserver failure";
+			nqPtr->errcode = "SERVFAIL";
+			break;
+		case NOTIMP:
+			nqPtr->errmsg  = "Nameserver does not support the query";
+			nqPtr->errcode = "NOTIMP";
+			break;
+		case REFUSED:
+			nqPtr->errmsg  = "Nameserver refused the query";
+			nqPtr->errcode = "REFUSED";
+			break;
+		default:
+			nqPtr->errmsg  = "Unexpected response code from nameserver";
+			nqPtr->errcode = "BADRCODE";
+			break;
+	}
+
+	NativeRetry(nqPtr);
+}
+
+static int
+NativeIsServer (
+	InterpData *interpData,
+	const struct sockaddr_in *addrPtr
+	)
+{
+	int i;
+
+	for (i = 0; i < interpData->state.nscount; ++i) {
+		const struct sockaddr_in *nsPtr = &interpData->state.nsaddr_list[i];
+
+		if (nsPtr->sin_addr.s_addr == addrPtr->sin_addr.s_addr
+				&& nsPtr->sin_port == addrPtr->sin_port) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Processes a datagram received from the UDP socket. Datagrams
+ * which were too long for the buffer are marked as truncated. */
+static void
+NativeHandleDatagram (
+	InterpData *interpData,
+	const unsigned char *buf,
+	const int len,
+	const int truncated,
+	const struct sockaddr_in *fromPtr
+	)
+{
+	Tcl_HashEntry *hPtr;
+	NativeQuery *nqPtr;
+
+	if (len < HFIXEDSZ || ! (buf[2] & 0x80)) {
+		return;
+	}
+
+	hPtr = Tcl_FindHashEntry(&interpData->ids,
+			(char *) (size_t) ((buf[0] << 8) | buf[1]));
+	if (hPtr == NULL) {
+		return;
+	}
+	nqPtr = (NativeQuery *) Tcl_GetHashValue(hPtr);
+
+	if (nqPtr->state != NQ_UDP
+			|| ! NativeIsServer(interpData, fromPtr)
+			|| ! NativeQuestionMatches(nqPtr, buf, len)) {
+		return;
+	}
+
+	if (truncated) {
+		NativeSwitchToTcp(nqPtr);
+		return;
+	}
+
+	NativeHandleReply(nqPtr, buf, len);
+}
+
+/* Reads all the replies waiting in the UDP socket */
+static void
+NativeReadUdp (
+	InterpData *interpData
+	)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[NATIVE_RECVBATCH];
+	struct iovec iovs[NATIVE_RECVBATCH];
+	struct sockaddr_in from[NATIVE_RECVBATCH];
+	int n, i;
+
+	while (interpData->sock != -1) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < NATIVE_RECVBATCH; ++i) {
+			iovs[i].iov_base = interpData->buf + i * NATIVE_UDPSIZE;
+			iovs[i].iov_len  = NATIVE_UDPSIZE;
+			msgs[i].msg_hdr.msg_name    = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_iov     = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		++interpData->traffic.recvcalls;
+		n = recvmmsg(interpData->sock, msgs, NATIVE_RECVBATCH, 0, NULL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		interpData->traffic.received += n;
+
+		for (i = 0; i < n; ++i) {
+			NativeHandleDatagram(interpData,
+					interpData->buf + i * NATIVE_UDPSIZE, (int) msgs[i].msg_len,
+					(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0, &from[i]);
+		}
+
+		if (n < NATIVE_RECVBATCH) {
+			/* The socket has been drained */
+			break;
+		}
+	}
+#else
+	while (interpData->sock != -1) {
+		struct sockaddr_in from;
+		socklen_t fromlen;
+		int len;
+
+		fromlen = sizeof(from);
+		++interpData->traffic.recvcalls;
+		len = recvfrom(interpData->sock, interpData->buf, NATIVE_BUFSIZE, 0,
+				(struct sockaddr *) &from, &fromlen);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		++interpData->traffic.received;
+
+		NativeHandleDatagram(interpData, interpData->buf, len, 0, &from);
+	}
+#endif
+}
+
+/* Processes a reply read from the connection */
+static void
+NativeConnReply (
+	NativeConn *connPtr,
+	const unsigned char *reply,
+	const int len
+	)
+{
+	Tcl_HashEntry *hPtr;
+	NativeQuery *nqPtr;
+
+	hPtr = Tcl_FindHashEntry(&connPtr->owner->ids,
+			(char *) (size_t) ((reply[0] << 8) | reply[1]));
+	if (hPtr == NULL) {
+		return;
+	}
+	nqPtr = (NativeQuery *) Tcl_GetHashValue(hPtr);
+
+	if (nqPtr->conn != connPtr
+			|| ! NativeQuestionMatches(nqPtr, reply, len)) {
+		/* Most probably the reply to a query given up on */
+		return;
+	}
+
+	NativeTcpDetach(nqPtr);
+	NativeHandleReply(nqPtr, reply, len);
+}
+
+/* Moves the exchange over the connection on as far as it can go
+ * without blocking. Returns 0 if the connection failed (and has
+ * been closed). */
+static int
+NativeConnProcess (
+	NativeConn *connPtr,
+	const int readable,
+	const int writable
+	)
+{
+	InterpData *interpData = connPtr->owner;
+	int n, err;
+	socklen_t errlen;
+
+	if (connPtr->connecting) {
+		if (! writable && ! readable) {
+			return 1;
+		}
+		errlen = sizeof(err);
+		if (getsockopt(connPtr->fd, SOL_SOCKET, SO_ERROR,
+					&err, &errlen) == -1 || err != 0) {
+			NativeConnFail(connPtr);
+			return 0;
+		}
+		connPtr->connecting = 0;
+	}
+
+	while (readable) {
+		++interpData->traffic.recvcalls;
+		if (connPtr->ilen == 0) {
+			n = recv(connPtr->fd, connPtr->ihdr + connPtr->ipos,
+					2 - connPtr->ipos, 0);
+		} else {
+			n = recv(connPtr->fd, connPtr->ibuf + connPtr->ipos,
+					connPtr->ilen - connPtr->ipos, 0);
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EAGAIN) {
+			break;
+		}
+		if (n <= 0) {
+			NativeConnFail(connPtr);
+			return 0;
+		}
+
+		connPtr->ipos += n;
+		if (connPtr->ilen == 0) {
+			if (connPtr->ipos < 2) continue;
+			connPtr->ilen = (connPtr->ihdr[0] << 8) | connPtr->ihdr[1];
+			connPtr->ipos = 0;
+			if (connPtr->ilen < HFIXEDSZ) {
+				NativeConnFail(connPtr);
+				return 0;
+			}
+			connPtr->ibuf = (unsigned char *) ckalloc(connPtr->ilen);
+			continue;
+		}
+		if (connPtr->ipos < connPtr->ilen) continue;
+
+		{
+			unsigned char *reply = connPtr->ibuf;
+			int len = connPtr->ilen;
+
+			connPtr->ibuf = NULL;
+			connPtr->ilen = 0;
+			connPtr->ipos = 0;
+			NativeConnReply(connPtr, reply, len);
+			ckfree((char *) reply);
+		}
+	}
+
+	/* Replies may have made more queries go over the connection,
+	 * so try writing whatever is there regardless of writable */
+	while (connPtr->opos < connPtr->olen) {
+		++interpData->traffic.sendcalls;
+		n = send(connPtr->fd, connPtr->obuf + connPtr->opos,
+				connPtr->olen - connPtr->opos, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+			NativeConnFail(connPtr);
+			return 0;
+		}
+		connPtr->opos += n;
+	}
+
+	NativeConnWatch(connPtr);
+
+	return 1;
+}
+
+/* Retries the queries whose current transmissions have timed out */
+static void
+NativeCheckTimeouts (
+	InterpData *interpData
+	)
+{
+	NativeQuery *nqPtr, *nextPtr;
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+
+	for (nqPtr = interpData->queries; nqPtr != NULL; nqPtr = nextPtr) {
+		nextPtr = nqPtr->nextPtr;
+		if (! NativeTimeIsBefore(&now, &nqPtr->deadline)) {
+			NativeRetry(nqPtr);
+		}
+	}
+
+	NativeReapConns(interpData);
+}
+
+static long
+NativeMsUntil (
+	const Tcl_Time *nowPtr,
+	const Tcl_Time *timePtr
+	)
+{
+	long ms;
+
+	ms = (timePtr->sec - nowPtr->sec) * 1000
+		+ (timePtr->usec - nowPtr->usec + 999) / 1000;
+
+	return ms < 0 ? 0 : ms;
+}
+
+/* Returns the time (in milliseconds) until the earliest timeout
+ * of the queries in flight or expiry of the idle connections,
+ * -1 if there are none */
+static int
+NativeNextTimeout (
+	InterpData *interpData
+	)
+{
+	NativeQuery *nqPtr;
+	NativeConn *connPtr;
+	Tcl_Time now;
+	long ms, min;
+
+	if (interpData->queries == NULL && interpData->conns == NULL) {
+		return -1;
+	}
+
+	Tcl_GetTime(&now);
+
+	min = -1;
+	for (nqPtr = interpData->queries; nqPtr != NULL; nqPtr = nqPtr->nextPtr) {
+		ms = NativeMsUntil(&now, &nqPtr->deadline);
+		if (min == -1 || ms < min) min = ms;
+	}
+	for (connPtr = interpData->conns; connPtr != NULL;
+			connPtr = connPtr->nextPtr) {
+		if (connPtr->nqueries > 0) continue;
+		ms = NativeMsUntil(&now, &connPtr->expires);
+		if (min == -1 || ms < min) min = ms;
+	}
+
+	return (int) min;
+}
+
+/* Waits for the sockets of the interp to get ready (or for the
+ * earliest timeout) and processes whatever has happened */
+static void
+NativePoll (
+	InterpData *interpData
+	)
+{
+	struct pollfd *fds;
+	NativeConn **conns, *connPtr;
+	int nfds, nconns, i;
+
+	nconns = 0;
+	for (connPtr = interpData->conns; connPtr != NULL;
+			connPtr = connPtr->nextPtr) {
+		++nconns;
+	}
+
+	fds   = (struct pollfd *) ckalloc(sizeof(struct pollfd) * (nconns + 1));
+	conns = (NativeConn **) ckalloc(sizeof(NativeConn *) * (nconns + 1));
+
+	nfds = 0;
+	if (interpData->sock != -1) {
+		fds[nfds].fd = interpData->sock;
+		fds[nfds].events = POLLIN;
+		conns[nfds] = NULL;
+		++nfds;
+	}
+	for (connPtr = interpData->conns; connPtr != NULL;
+			connPtr = connPtr->nextPtr) {
+		fds[nfds].fd = connPtr->fd;
+		fds[nfds].events = POLLIN;
+		if (connPtr->connecting || connPtr->opos < connPtr->olen) {
+			fds[nfds].events |= POLLOUT;
+		}
+		conns[nfds] = connPtr;
+		++nfds;
+	}
+
+	if (poll(fds, nfds, NativeNextTimeout(interpData)) > 0) {
+		for (i = 0; i < nfds; ++i) {
+			if (fds[i].revents == 0) continue;
+			if (conns[i] == NULL) {
+				NativeReadUdp(interpData);
+			} else {
+				/* Errors and hangups are noticed by reading */
+				NativeConnProcess(conns[i],
+						(fds[i].revents & ~POLLOUT) != 0,
+						(fds[i].revents & POLLOUT) != 0);
+			}
+		}
+	}
+
+	ckfree((char *) conns);
+	ckfree((char *) fds);
+
+	NativeCheckTimeouts(interpData);
+}
+
+/* Creates the query (of the prepared one if prepPtr is not NULL,
+ * of queryObj, qclass and qtype otherwise) and sends it off.
+ * Returns NULL and leaves an error message in interp on failure. */
+static NativeQuery *
+NativeSubmit (
+	InterpData *interpData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	NativePrepared *prepPtr
+	)
+{
+	NativeQuery *nqPtr;
+	const char *name;
+	int len;
+
+	if (NativeOpenSocket(interp, interpData) != TCL_OK) {
+		return NULL;
+	}
+
+	nqPtr = (NativeQuery *) ckalloc(sizeof(NativeQuery));
+	memset(nqPtr, 0, sizeof(NativeQuery));
+	nqPtr->owner    = interpData;
+	nqPtr->resflags = resflags;
+	if (prepPtr != NULL) {
+		++prepPtr->refcount;
+		nqPtr->prepPtr = prepPtr;
+		nqPtr->name    = prepPtr->name;
+		name = prepPtr->name;
+		nqPtr->qclass  = prepPtr->qclass;
+		nqPtr->qtype   = prepPtr->qtype;
+	} else {
+		name = Tcl_GetStringFromObj(queryObj, &len);
+		nqPtr->name    = strcpy(ckalloc(len + 1), name);
+		nqPtr->qclass  = qclass;
+		nqPtr->qtype   = qtype;
+	}
+	nqPtr->opts     = interpData->opts;
+	nqPtr->edns     = Sysdns_GetEDNSSize();
+	if (nqPtr->edns == 0 && (interpData->state.options & RES_USE_EDNS0)) {
+		nqPtr->edns = NATIVE_EDNSSIZE;
+	}
+	if (nqPtr->edns > NATIVE_UDPSIZE) {
+		nqPtr->edns = NATIVE_UDPSIZE;
+	}
+	nqPtr->state    = NQ_UDP;
+	nqPtr->errmsg   = "DNS query timed out";
+	nqPtr->errcode  = "TIMEOUT";
+
+	switch (NativeMakeQuery(nqPtr)) {
+		case 0:
+			NativeUnregisterId(nqPtr);
+			NativeFreeQuery(nqPtr);
+			Tcl_ResetResult(interp);
+			Tcl_AppendResult(interp, "Invalid domain name \"", name, "\"",
+					NULL);
+			return NULL;
+		case -1:
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(nqPtr->errmsg, -1));
+			Tcl_SetErrorCode(interp, "SYSDNS", nqPtr->errcode, NULL);
+			NativeFreeQuery(nqPtr);
+			return NULL;
+	}
+
+	nqPtr->cmdObj = cmdObj;
+	if (cmdObj != NULL) {
+		Tcl_IncrRefCount(cmdObj);
+	}
+
+	NativeLinkQuery(interpData, nqPtr);
+	NativeTransmit(nqPtr);
+
+	return nqPtr;
+}
+
+/* Sets the outcome of the completed query as the result of interp */
+static int
+NativeSetResult (
+	Tcl_Interp *interp,
+	NativeQuery *nqPtr,
+	ResolveInfo *infoPtr
+	)
+{
+	if (nqPtr->answer == NULL) {
+		Tcl_SetObjResult(interp, Tcl_NewStringObj(nqPtr->errmsg, -1));
+		Tcl_SetErrorCode(interp, "SYSDNS", nqPtr->errcode, NULL);
+		return TCL_ERROR;
+	}
+
+	if ((nqPtr->opts & DBC_RAWRESULT) || (nqPtr->resflags & RES_RAW)) {
+		return DNSRawResult(interp, nqPtr->answer, nqPtr->anslen, infoPtr);
+	}
+
+	return DNSParseMessage(interp, nqPtr->answer, nqPtr->anslen,
+			nqPtr->resflags, infoPtr);
+}
+
+static int
+NativeEventProc (
+	Tcl_Event *evPtr,
+	int flags
+	)
+{
+	NativeQuery *nqPtr;
+	Tcl_Interp *interp;
+	ResolveInfo info;
+	int res;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return 0;
+	}
+
+	nqPtr  = ((NativeEvent *) evPtr)->nqPtr;
+	interp = nqPtr->owner->interp;
+
+	memset(&info, 0, sizeof(info));
+	res = NativeSetResult(interp, nqPtr, &info);
+
+	/* The callback is free to delete the interp's commands
+	 * (and hence the interp data) so nothing but the query
+	 * itself may be touched after it returns */
+	Sysdns_AsyncResult(interp, nqPtr->cmdObj, res, &info);
+	NativeFreeQuery(nqPtr);
+
+	return 1;
+}
+
+static int
+NativeDeleteEventFilter (
+	Tcl_Event *evPtr,
+	ClientData clientData
+	)
+{
+	NativeQuery *nqPtr;
+
+	if (evPtr->proc != NativeEventProc) {
+		return 0;
+	}
+
+	nqPtr = ((NativeEvent *) evPtr)->nqPtr;
+	if (nqPtr->owner != (InterpData *) clientData) {
+		return 0;
+	}
+
+	NativeFreeQuery(nqPtr);
+
+	return 1;
+}
+
+/* Cancels all async queries in flight. If notify is true,
+ * their callbacks are still called (with an error),
+ * otherwise they are silently discarded. */
+static void
+NativeCancelPending (
+	InterpData *interpData,
+	const int notify
+	)
+{
+	while (interpData->queries != NULL) {
+		NativeQuery *nqPtr = interpData->queries;
+
+		if (notify) {
+			NativeFail(nqPtr, "DNS query cancelled", "CANCELLED");
+		} else {
+			NativeUnregisterId(nqPtr);
+			NativeTcpDetach(nqPtr);
+			NativeDequeue(nqPtr);
+			NativeUnlinkQuery(interpData, nqPtr);
+			NativeFreeQuery(nqPtr);
+		}
+	}
+}
+
+static void
+NativeUdpFileProc (
+	ClientData clientData,
+	int mask
+	)
+{
+	NativeReadUdp((InterpData *) clientData);
+}
+
+static void
+NativeTcpFileProc (
+	ClientData clientData,
+	int mask
+	)
+{
+	NativeConnProcess((NativeConn *) clientData,
+			mask & TCL_READABLE, mask & TCL_WRITABLE);
+}
+
+static void
+NativeSetupProc (
+	ClientData clientData,
+	int flags
+	)
+{
+	int timeout;
+	Tcl_Time blockTime;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return;
+	}
+
+	timeout = NativeNextTimeout((InterpData *) clientData);
+	if (timeout >= 0) {
+		blockTime.sec  = timeout / 1000;
+		blockTime.usec = (timeout % 1000) * 1000;
+		Tcl_SetMaxBlockTime(&blockTime);
+	}
+}
+
+static void
+NativeCheckProc (
+	ClientData clientData,
+	int flags
+	)
+{
+	InterpData *interpData;
+
+	if (! (flags & TCL_FILE_EVENTS)) {
+		return;
+	}
+
+	interpData = (InterpData *) clientData;
+
+	if (interpData->queries != NULL || interpData->conns != NULL) {
+		NativeCheckTimeouts(interpData);
+	}
+}
+
+void
+Impl_GetBackendInfo (
+	BackendInfo *binfo
+	)
+{
+	binfo->name     = "native";
+	binfo->caps     = NATIVE_CAPS;
+	binfo->qtypes   = SupportedQTypes;
+	binfo->features = BF_ASYNC | BF_BATCH | BF_EDNS | BF_PREPARE
+		| BF_LAZY | BF_PARSE | BF_XFER | BF_COLUMNS;
+}
+
+int
+Impl_Init (
+	Tcl_Interp *interp,
+	ClientData *clientDataPtr
+	)
+{
+	InterpData *interpData;
+
+	interpData = (InterpData *) ckalloc(sizeof(InterpData));
+
+	if (ResInit(interp, interpData) != TCL_OK) {
+		ckfree((char *) interpData);
+		return TCL_ERROR;
+	}
+
+	interpData->opts    = interpData->def_opts;
+	interpData->interp  = interp;
+	interpData->sock    = -1;
+	interpData->buf     = (unsigned char *) ckalloc(NATIVE_BUFSIZE);
+	interpData->queries = NULL;
+	interpData->conns   = NULL;
+	interpData->seed    = NativeSeed();
+	interpData->config  = 0;
+	interpData->batching = 0;
+	interpData->noutq    = 0;
+	memset(&interpData->traffic, 0, sizeof(BatchStats));
+	Tcl_InitHashTable(&interpData->ids, TCL_ONE_WORD_KEYS);
+
+	Tcl_CreateEventSource(NativeSetupProc, NativeCheckProc,
+			(ClientData) interpData);
+
+	*clientDataPtr = (ClientData) interpData;
+
+	return TCL_OK;
+}
+
+void
+Impl_Cleanup (
+	ClientData clientData
+	)
+{
+	InterpData *interpData = (InterpData *) clientData;
+
+	NativeCancelPending(interpData, 0);
+	Tcl_DeleteEvents(NativeDeleteEventFilter, (ClientData) interpData);
+	Tcl_DeleteEventSource(NativeSetupProc, NativeCheckProc,
+			(ClientData) interpData);
+
+	NativeCloseConns(interpData);
+	NativeCloseSocket(interpData);
+	Tcl_DeleteHashTable(&interpData->ids);
+	ckfree((char *) interpData->buf);
+	res_nclose(&interpData->state);
+	ckfree((char *) interpData);
+}
+
+int
+Impl_GetNameservers (
+	ClientData clientData,
+	Tcl_Interp *interp
+	)
+{
+	InterpData *interpData;
+	Tcl_Obj *nsObj;
+	int i;
+
+	interpData = (InterpData *) clientData;
+
+	nsObj = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < interpData->state.nscount; ++i) {
+		Tcl_ListObjAppendElement(interp, nsObj,
+				Tcl_NewStringObj(inet_ntoa(
+						interpData->state.nsaddr_list[i].sin_addr), -1));
+	}
+
+	Tcl_SetObjResult(interp, nsObj);
+	return TCL_OK;
+}
+
+int
+Impl_Resolve (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	InterpData *interpData;
+	NativeQuery *nqPtr;
+	int res;
+
+	interpData = (InterpData *) clientData;
+
+	nqPtr = NativeSubmit(interpData, interp,
+			queryObj, qclass, qtype, resflags, NULL, NULL);
+	if (nqPtr == NULL) {
+		return TCL_ERROR;
+	}
+
+	while (! nqPtr->done) {
+		NativePoll(interpData);
+	}
+	NativeReapConns(interpData);
+
+	res = NativeSetResult(interp, nqPtr, infoPtr);
+	NativeFreeQuery(nqPtr);
+
+	return res;
+}
+
+int
+Impl_ResolveAsync (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj
+	)
+{
+	if (NativeSubmit((InterpData *) clientData, interp,
+				queryObj, qclass, qtype, resflags, cmdObj, NULL) == NULL) {
+		return TCL_ERROR;
+	}
+
+	Tcl_ResetResult(interp);
+	return TCL_OK;
+}
+
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
+	)
+{
+	InterpData *interpData;
+	NativeQuery **nqs;
+	BatchStats before;
+	int first, next, inflight, i;
+
+	interpData = (InterpData *) clientData;
+
+	nqs = (NativeQuery **) ckalloc(sizeof(NativeQuery *) * nqueries);
+
+	before = interpData->traffic;
+	interpData->batching = 1;
+
+	first    = 0;
+	next     = 0;
+	inflight = 0;
+	while (first < nqueries) {
+		while (next < nqueries && inflight < concurrency) {
+			nqs[next] = NativeSubmit(interpData, interp, queries[next]->queryObj,
+					queries[next]->qclass, queries[next]->qtype, resflags,
+					NULL, NULL);
+			if (nqs[next] == NULL) {
+				Sysdns_BatchResult(interp, queries[next], TCL_ERROR);
+			} else {
+				++inflight;
+			}
+			++next;
+		}
+
+		/* Send the new queries along with the retransmissions
+		 * made by the last poll */
+		NativeFlush(interpData);
+
+		if (inflight > 0) {
+			NativePoll(interpData);
+		}
+
+		for (i = first; i < next; ++i) {
+			if (nqs[i] != NULL && nqs[i]->done) {
+				Sysdns_BatchResult(interp, queries[i], NativeSetResult(interp,
+							nqs[i], &queries[i]->info));
+				NativeFreeQuery(nqs[i]);
+				nqs[i] = NULL;
+				--inflight;
+			}
+		}
+		while (first < next && nqs[first] == NULL) {
+			++first;
+		}
+	}
+
+	/* Async queries may have been retransmitted meanwhile */
+	NativeFlush(interpData);
+	interpData->batching = 0;
+	NativeReapConns(interpData);
+
+	ckfree((char *) nqs);
+
+	statsPtr->valid     = 1;
+	statsPtr->sendcalls = interpData->traffic.sendcalls - before.sendcalls;
+	statsPtr->recvcalls = interpData->traffic.recvcalls - before.recvcalls;
+	statsPtr->sent      = interpData->traffic.sent - before.sent;
+	statsPtr->received  = interpData->traffic.received - before.received;
+
+	return TCL_OK;
+}
+
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr
+	)
+{
+	InterpData *interpData;
+	NativePrepared *prepPtr;
+	NativeQuery nq;
+	const char *name;
+	int len;
+
+	interpData = (InterpData *) clientData;
+
+	name = Tcl_GetStringFromObj(queryObj, &len);
+
+	prepPtr = (NativePrepared *) ckalloc(sizeof(NativePrepared));
+	prepPtr->refcount = 1;
+	prepPtr->name     = strcpy(ckalloc(len + 1), name);
+	prepPtr->qclass   = qclass;
+	prepPtr->qtype    = qtype;
+	prepPtr->opts     = interpData->opts;
+	prepPtr->config   = interpData->config;
+
+	/* Just enough of a query for NativeGetCandidate() */
+	memset(&nq, 0, sizeof(nq));
+	nq.owner  = interpData;
+	nq.name   = prepPtr->name;
+	nq.qclass = qclass;
+	nq.qtype  = qtype;
+	nq.opts   = interpData->opts;
+
+	prepPtr->qlen = NativeEncodeQuestion(&nq, 0, prepPtr->question);
+	if (prepPtr->qlen == -1) {
+		NativeReleasePrepared(prepPtr);
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "Invalid domain name \"", name, "\"", NULL);
+		return TCL_ERROR;
+	}
+
+	*preparedPtr = (ClientData) prepPtr;
+	return TCL_OK;
+}
+
+int
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr
+	)
+{
+	InterpData *interpData;
+	NativeQuery *nqPtr;
+	int res;
+
+	interpData = (InterpData *) clientData;
+
+	nqPtr = NativeSubmit(interpData, interp, NULL, 0, 0, resflags,
+			cmdObj, (NativePrepared *) prepared);
+	if (nqPtr == NULL) {
+		return TCL_ERROR;
+	}
+
+	if (cmdObj != NULL) {
+		Tcl_ResetResult(interp);
+		return TCL_OK;
+	}
+
+	while (! nqPtr->done) {
+		NativePoll(interpData);
+	}
+	NativeReapConns(interpData);
+
+	res = NativeSetResult(interp, nqPtr, infoPtr);
+	NativeFreeQuery(nqPtr);
+
+	return res;
+}
+
+void
+Impl_FreePreparedQuery (
+	ClientData prepared
+	)
+{
+	NativeReleasePrepared((NativePrepared *) prepared);
+}
+
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	return DNSParseMessage(interp, msg, msglen, resflags, infoPtr);
+}
+
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	return DNSParseMessageRRs(interp, msg, msglen, resflags,
+			proc, clientData);
+}
+
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData
+	)
+{
+	InterpData *interpData = (InterpData *) clientData;
+
+	return DNSTransfer(interp, &interpData->state, zoneObj, serverObj,
+			qclass, qtype, serial, resflags, proc, procData);
+}
+
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	return DNSLazyCount(interp, resObj, section, countPtr);
+}
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	return DNSLazyGetRR(interp, resObj, section, index, rrObjPtr);
+}
+
+int
+Impl_Reinit (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	const int flags
+	)
+{
+	InterpData *interpData;
+	int opts;
+
+	interpData = (InterpData *) clientData;
+
+	/* Pending async queries were sent according
+	 * to the old configuration, so tell their owners */
+	NativeCancelPending(interpData, 1);
+	NativeCloseConns(interpData);
+	NativeCloseSocket(interpData);
+
+	opts = interpData->opts;
+	res_nclose(&interpData->state);
+
+	if (ResInit(interp, interpData) != TCL_OK) {
+		return TCL_ERROR;
+	}
+	++interpData->config;
+
+	if (flags & REINIT_RESETOPTS) {
+		interpData->opts = interpData->def_opts;
+	} else {
+		interpData->opts = opts;
+	}
+
+	return TCL_OK;
+}
+
+int
+Impl_ConfigureBackend (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	const int set,
+	const int clear
+	)
+{
+	InterpData *interpData;
+
+	interpData = (InterpData *) clientData;
+
+	if (set == DBC_DEFAULTS) {
+		interpData->opts = interpData->def_opts;
+	} else {
+		interpData->opts = (interpData->opts | (set & NATIVE_CAPS)) & ~clear;
+	}
+
+	return TCL_OK;
+}
+
+int
+Impl_CgetBackend (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	const int option,
+	Tcl_Obj **resObjPtr
+	)
+{
+	InterpData *interpData;
+
+	interpData = (InterpData *) clientData;
+
+	*resObjPtr = Tcl_NewBooleanObj((interpData->opts & option) != 0);
+
+	return TCL_OK;
+}
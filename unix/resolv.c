@@ -6,28 +6,112 @@
  */
 
 #include <tcl.h>
+#include <string.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <resolv.h>
+#include <netdb.h>
 #include <errno.h>
 #include "tclsysdns.h"
 #include "dnsparams.h"
 #include "dnsmsg.h"
+#include "xfer.h"
 #include "resfmt.h"
+#include "qtypes.h"
 
-extern struct __res_state _res;
-
+/* Each interp works with its private copy of the resolver state
+ * using the "reentrant" res_n* family of functions, so interps
+ * living in different threads do not clobber each other's options
+ * and can resolve in parallel. */
 typedef struct {
-	/* Resolver's options */
-	unsigned long res_opts;
-	unsigned long def_opts;
+	struct __res_state state; /* Resolver state of this interp */
+	unsigned long def_opts;   /* Default resolver options */
+	int rawresult;            /* Return replies unparsed (DBC_RAWRESULT) */
 } InterpData;
 
-#define GetResOpts (_res.options)
-#define ResOpts_SaveTo(id) ((id)->res_opts = _res.options)
-#define ResOpts_LoadFrom(id) (_res.options = (id)->res_opts)
-#define ResDefs_SaveTo(id) ((id)->def_opts = _res.options)
-#define ResDefs_LoadFrom(id) (_res.options = (id)->def_opts)
+/* Replies are read into a buffer of ANSWER_BUFSIZE bytes which grows
+ * up to ANSWER_MAXSIZE bytes when the resolver reports longer ones */
+#define ANSWER_BUFSIZE 4096
+#define ANSWER_MAXSIZE 65536
+
+#define GetResOpts(id) ((id)->state.options)
+#define ResDefs_SaveTo(id) ((id)->def_opts = (id)->state.options)
+#define ResDefs_LoadFrom(id) ((id)->state.options = (id)->def_opts)
+
+static const unsigned short
+SupportedQTypes[] = {
+	SYSDNS_TYPE_A,
+	SYSDNS_TYPE_NS,
+	SYSDNS_TYPE_MD,
+	SYSDNS_TYPE_MF,
+	SYSDNS_TYPE_CNAME,
+	SYSDNS_TYPE_SOA,
+	SYSDNS_TYPE_MB,
+	SYSDNS_TYPE_MG,
+	SYSDNS_TYPE_MR,
+	SYSDNS_TYPE_NULL,
+	SYSDNS_TYPE_WKS,
+	SYSDNS_TYPE_PTR,
+	SYSDNS_TYPE_HINFO,
+	SYSDNS_TYPE_MINFO,
+	SYSDNS_TYPE_MX,
+	SYSDNS_TYPE_TXT,
+	SYSDNS_TYPE_RP,
+	SYSDNS_TYPE_AFSDB,
+	SYSDNS_TYPE_X25,
+	SYSDNS_TYPE_ISDN,
+	SYSDNS_TYPE_RT,
+	SYSDNS_TYPE_AAAA,
+	SYSDNS_TYPE_SRV,
+	0
+};
+
+/* Mapping of backend capabilities to resolver options */
+static const struct {
+	int cap; unsigned long opt;
+} CapsMap[] = {
+	{ DBC_TCP,      RES_USEVC    },
+	{ DBC_TRUNCOK,  RES_IGNTC    },
+	{ DBC_SEARCH,   RES_DNSRCH   },
+	{ DBC_STAYOPEN, RES_STAYOPEN },
+};
+
+static int
+ResInit (
+	Tcl_Interp *interp,
+	InterpData *interpData
+	)
+{
+	memset(&interpData->state, 0, sizeof(interpData->state));
+
+	Tcl_SetErrno(0);
+	if (res_ninit(&interpData->state) != 0) {
+		if (Tcl_GetErrno() == 0) {
+			Tcl_SetErrno(EINVAL);
+		}
+		Tcl_SetObjResult(interp,
+				Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+void
+Impl_GetBackendInfo (
+	BackendInfo *binfo
+	)
+{
+	binfo->name     = "resolv";
+	binfo->caps     = DBC_DEFAULTS | DBC_RAWRESULT | DBC_TCP | DBC_TRUNCOK
+		| DBC_SEARCH | DBC_STAYOPEN;
+	binfo->qtypes   = SupportedQTypes;
+#ifdef RES_USE_EDNS0
+	binfo->features = BF_EDNS | BF_LAZY | BF_PARSE | BF_XFER | BF_COLUMNS;
+#else
+	binfo->features = BF_LAZY | BF_PARSE | BF_XFER | BF_COLUMNS;
+#endif
+}
 
 int
 Impl_Init (
@@ -39,11 +123,12 @@ Impl_Init (
 
 	interpData = (InterpData *) ckalloc(sizeof(InterpData));
 
-	if (! (GetResOpts & RES_INIT)) {
-		res_init();
+	if (ResInit(interp, interpData) != TCL_OK) {
+		ckfree((char *) interpData);
+		return TCL_ERROR;
 	}
-	ResOpts_SaveTo(interpData);
 	ResDefs_SaveTo(interpData);
+	interpData->rawresult = 0;
 
 	*clientDataPtr = (ClientData *)interpData;
 	return TCL_OK;
@@ -54,7 +139,10 @@ Impl_Cleanup (
 	ClientData clientData
 	)
 {
-	ckfree((char *) clientData);
+	InterpData *interpData = (InterpData *) clientData;
+
+	res_nclose(&interpData->state);
+	ckfree((char *) interpData);
 }
 
 int
@@ -68,28 +156,69 @@ Impl_GetNameservers (
 	int i;
 
 	interpData = (InterpData *) clientData;
-	ResOpts_LoadFrom(interpData);
-
-	if (! (GetResOpts & RES_INIT)) {
-		res_init();
-	}
 
 	nsObj = Tcl_NewListObj(0, NULL);
-	/* IPv6 -- does it work?
-	for (i = 0; i < _res._u._ext.nscount; ++i) {
-		Tcl_ListObjAppendElement(interp, nsObj,
-				DNSFormatAAAA(_res._u._ext.nsaddrs[i]->sin6_addr.s6_addr16));
-	}
-	*/
-	for (i = 0; i < _res.nscount; ++i) {
+	for (i = 0; i < interpData->state.nscount; ++i) {
 		Tcl_ListObjAppendElement(interp, nsObj,
-				Tcl_NewStringObj(inet_ntoa(_res.nsaddr_list[i].sin_addr), -1));
+				Tcl_NewStringObj(inet_ntoa(
+						interpData->state.nsaddr_list[i].sin_addr), -1));
 	}
 
 	Tcl_SetObjResult(interp, nsObj);
 	return TCL_OK;
 }
 
+/* Turns the outcome of res_nsearch() (which returned len and
+ * left the reply in the answer buffer of the given size)
+ * into the result of interp */
+static int
+ResSetResult (
+	Tcl_Interp *interp,
+	InterpData *interpData,
+	const unsigned char answer[],
+	const int size,
+	const int len,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	if (len == -1) {
+		int err = Tcl_GetErrno();
+		switch (interpData->state.res_h_errno) {
+			case HOST_NOT_FOUND:
+			case NO_DATA:
+				/* No error -- negative query result.
+				 * The (last) reply is still in the buffer though
+				 * its length is lost; it's only scanned for
+				 * the SOA to learn the negative caching TTL */
+				if (DNSParseMessage(interp, answer, size,
+							0, infoPtr) != TCL_OK) {
+					infoPtr->ttl = 0;
+				}
+				infoPtr->status = interpData->state.res_h_errno
+					== HOST_NOT_FOUND ? RESOLVE_NXDOMAIN : RESOLVE_NODATA;
+				Tcl_ResetResult(interp);
+				return TCL_OK;
+		}
+		if (err == 0) {
+			Tcl_SetObjResult(interp, Tcl_NewStringObj(
+						hstrerror(interpData->state.res_h_errno), -1));
+		} else {
+			Tcl_SetObjResult(interp,
+					Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+		}
+		return TCL_ERROR;
+	}
+
+	if (interpData->rawresult || (resflags & RES_RAW)) {
+		return DNSRawResult(interp, answer, len < size ? len : size,
+				infoPtr);
+	}
+
+	return DNSParseMessage(interp, answer, len < size ? len : size,
+			resflags, infoPtr);
+}
+
 int
 Impl_Resolve (
 	ClientData clientData,
@@ -97,65 +226,270 @@ Impl_Resolve (
 	Tcl_Obj *queryObj,
 	const unsigned short qclass,
 	const unsigned short qtype,
-	const unsigned int resflags
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
 )
 {
 	InterpData *interpData;
-	unsigned char answer[4096];
-	int len;
+	unsigned char buf[ANSWER_BUFSIZE], *answer;
+	int size, len, res, edns;
 
 	interpData = (InterpData *) clientData;
-	ResOpts_LoadFrom(interpData);
 
-	Tcl_SetErrno(0);
-	len = res_search(Tcl_GetString(queryObj), qclass, qtype,
-			answer, sizeof(answer));
-	if (len == -1) {
-		int err = Tcl_GetErrno();
-		if (err == 0) {
-			/* No error -- negative query result */
-			Tcl_ResetResult(interp);
-			return TCL_OK;
-		} else {
-			Tcl_SetObjResult(interp,
-					Tcl_NewStringObj(Tcl_PosixError(interp), -1));
-			return TCL_ERROR;
+	/* The resolver sizes the EDNS0 payload it advertises
+	 * after the answer buffer (glibc caps it at 1200 bytes) */
+	size = ANSWER_BUFSIZE;
+	edns = 0;
+#ifdef RES_USE_EDNS0
+	if (Sysdns_GetEDNSSize() > 0) {
+		GetResOpts(interpData) |= RES_USE_EDNS0;
+		edns = 1;
+		if (Sysdns_GetEDNSSize() > size) {
+			size = Sysdns_GetEDNSSize();
 		}
+	} else {
+		GetResOpts(interpData) = (GetResOpts(interpData) & ~RES_USE_EDNS0)
+			| (interpData->def_opts & RES_USE_EDNS0);
 	}
+#endif
+	answer = size > sizeof(buf) ? (unsigned char *) ckalloc(size) : buf;
+
+	while (1) {
+		/* An empty header is left in the buffer if no reply arrives */
+		memset(answer, 0, HFIXEDSZ);
+
+		Tcl_SetErrno(0);
+		len = res_nsearch(&interpData->state, Tcl_GetString(queryObj),
+				qclass, qtype, answer, size);
+
+#ifdef RES_USE_EDNS0
+		/* A server rejecting the OPT RR is asked again without it,
+		 * once; the option is set up anew for the next query */
+		if (len == -1 && edns && (((HEADER *) answer)->rcode == FORMERR
+					|| ((HEADER *) answer)->rcode == NOTIMP)) {
+			GetResOpts(interpData) &= ~RES_USE_EDNS0;
+			edns = 0;
+			continue;
+		}
+#endif
 
-	return DNSParseMessage(interp, answer, len, resflags);
+		if (len <= size || size == ANSWER_MAXSIZE) {
+			break;
+		}
+
+		/* The reply didn't fit -- ask again with a buffer of its size */
+		size = len < ANSWER_MAXSIZE ? len : ANSWER_MAXSIZE;
+		if (answer != buf) {
+			ckfree((char *) answer);
+		}
+		answer = (unsigned char *) ckalloc(size);
+	}
+
+	res = ResSetResult(interp, interpData, answer, size, len,
+			resflags, infoPtr);
+
+	if (answer != buf) {
+		ckfree((char *) answer);
+	}
+
+	return res;
 }
 
 int
-Impl_Reinit (
+Impl_ResolveAsync (
 	ClientData clientData,
 	Tcl_Interp *interp,
-	const int flags)
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj
+	)
 {
-	res_init();
+	/* Never reached -- outer code checks for the BF_ASYNC feature */
+	return TCL_ERROR;
+}
 
-	if (flags & REINIT_RESETOPTS) {
-		ResDefs_LoadFrom((InterpData *) clientData);
-	}
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_BATCH feature */
+	return TCL_ERROR;
+}
 
-	return TCL_OK;
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
 }
 
 int
-Impl_GetBackendCapabilities (void)
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+void
+Impl_FreePreparedQuery (
+	ClientData prepared
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+}
+
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	return DNSParseMessage(interp, msg, msglen, resflags, infoPtr);
+}
+
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	return DNSParseMessageRRs(interp, msg, msglen, resflags,
+			proc, clientData);
+}
+
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData
+	)
+{
+	InterpData *interpData = (InterpData *) clientData;
+
+	return DNSTransfer(interp, &interpData->state, zoneObj, serverObj,
+			qclass, qtype, serial, resflags, proc, procData);
+}
+
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	return DNSLazyCount(interp, resObj, section, countPtr);
+}
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
 {
-	/* TODO implement */
-	return DBC_TCP;
+	return DNSLazyGetRR(interp, resObj, section, index, rrObjPtr);
+}
+
+int
+Impl_Reinit (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	const int flags)
+{
+	InterpData *interpData;
+	unsigned long opts;
+
+	interpData = (InterpData *) clientData;
+
+	opts = GetResOpts(interpData);
+	res_nclose(&interpData->state);
+
+	if (ResInit(interp, interpData) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (! (flags & REINIT_RESETOPTS)) {
+		GetResOpts(interpData) = opts;
+	} else {
+		interpData->rawresult = 0;
+	}
+
+	return TCL_OK;
 }
 
 int
 Impl_ConfigureBackend (
 	ClientData clientData,
 	Tcl_Interp *interp,
-	const int options
+	const int set,
+	const int clear
 	)
 {
-	/* TODO implement */
+	InterpData *interpData;
+	int i;
+
+	interpData = (InterpData *) clientData;
+
+	if (set == DBC_DEFAULTS) {
+		ResDefs_LoadFrom(interpData);
+		interpData->rawresult = 0;
+		return TCL_OK;
+	}
+
+	if (set & DBC_RAWRESULT) {
+		interpData->rawresult = 1;
+	} else if (clear & DBC_RAWRESULT) {
+		interpData->rawresult = 0;
+	}
+
+	for (i = 0; i < sizeof(CapsMap)/sizeof(CapsMap[0]); ++i) {
+		if (set & CapsMap[i].cap) {
+			GetResOpts(interpData) |= CapsMap[i].opt;
+		} else if (clear & CapsMap[i].cap) {
+			GetResOpts(interpData) &= ~CapsMap[i].opt;
+		}
+	}
+
 	return TCL_OK;
 }
 
@@ -167,7 +501,25 @@ Impl_CgetBackend (
 	Tcl_Obj **resObjPtr
 	)
 {
-	/* TODO implement */
+	InterpData *interpData;
+	int i, val;
+
+	interpData = (InterpData *) clientData;
+
+	if (option == DBC_RAWRESULT) {
+		*resObjPtr = Tcl_NewBooleanObj(interpData->rawresult);
+		return TCL_OK;
+	}
+
+	val = 0;
+	for (i = 0; i < sizeof(CapsMap)/sizeof(CapsMap[0]); ++i) {
+		if (option == CapsMap[i].cap) {
+			val = (GetResOpts(interpData) & CapsMap[i].opt) != 0;
+			break;
+		}
+	}
+
+	*resObjPtr = Tcl_NewBooleanObj(val);
+
 	return TCL_OK;
 }
-
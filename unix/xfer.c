@@ -0,0 +1,403 @@
+/*
+ * xfer.c --
+ *   Zone transfers (AXFR and IXFR) over TCP for the backends which
+ *   keep a resolver library state (see resolver(3)).
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include "tclsysdns.h"
+#include "dnsmsg.h"
+#include "xfer.h"
+#include "qtypes.h"
+
+/*
+ * The reply to a zone transfer query is a stream of DNS messages
+ * over one TCP connection, each preceded by its length, which only
+ * ends with the SOA record closing the zone. The messages are read
+ * one at a time into a buffer of the largest size a message can have
+ * and parsed right away, their records being handed to the caller's
+ * Sysdns_RRProc, so the memory used doesn't depend on the size of the
+ * zone. Every wait for the nameserver is limited by the timeout of the
+ * resolver configuration.
+ */
+
+#define XFER_MSGSIZE 65536
+
+/* The SOA RR an IXFR query carries in its authority section: the owner
+ * is a pointer to the question name, both names in RDATA are the root */
+#define XFER_SOASIZE (NS_INT16SZ * 4 + NS_INT32SZ + 2 + NS_INT32SZ * 5)
+#define XFER_MAXQUERY (HFIXEDSZ + MAXCDNAME + QFIXEDSZ + XFER_SOASIZE)
+
+static void
+XferSetError (
+	Tcl_Interp *interp,
+	const char *errmsg,
+	const char *errcode
+	)
+{
+	Tcl_SetResult(interp, (char *) errmsg, TCL_STATIC);
+	Tcl_SetErrorCode(interp, "SYSDNS", errcode, NULL);
+}
+
+static void
+XferSetPosixError (
+	Tcl_Interp *interp,
+	int errcode
+	)
+{
+	Tcl_SetErrno(errcode);
+	Tcl_SetObjResult(interp,
+			Tcl_NewStringObj(Tcl_PosixError(interp), -1));
+}
+
+/* Builds the query into buf. Returns its length or -1 if the zone
+ * name is not valid. */
+static int
+XferMakeQuery (
+	struct __res_state *statePtr,
+	const char *zone,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	unsigned char buf[]
+	)
+{
+	unsigned char *p;
+	int len;
+
+	len = res_nmkquery(statePtr, QUERY, zone, qclass, qtype,
+			NULL, 0, NULL, buf, XFER_MAXQUERY);
+	if (len == -1) {
+		return -1;
+	}
+
+	/* Zone transfers are not recursive */
+	buf[2] &= ~0x01;
+
+	if (qtype != SYSDNS_TYPE_IXFR) {
+		return len;
+	}
+
+	p = buf + len;
+	*p++ = 0xC0;
+	*p++ = HFIXEDSZ;
+	NS_PUT16(SYSDNS_TYPE_SOA, p);
+	NS_PUT16(qclass, p);
+	NS_PUT32(0, p);
+	NS_PUT16(2 + NS_INT32SZ * 5, p);
+	*p++ = 0;
+	*p++ = 0;
+	NS_PUT32(serial, p);
+	memset(p, 0, NS_INT32SZ * 4);
+	p += NS_INT32SZ * 4;
+
+	buf[9] = 1; /* NSCOUNT */
+
+	return p - buf;
+}
+
+/* Gets the address of the nameserver to transfer the zone from:
+ * the one given as serverObj or else the first configured one */
+static int
+XferGetServer (
+	Tcl_Interp *interp,
+	struct __res_state *statePtr,
+	Tcl_Obj *serverObj,
+	struct sockaddr_in *addrPtr
+	)
+{
+	if (serverObj == NULL) {
+		if (statePtr->nscount < 1
+				|| statePtr->nsaddr_list[0].sin_family != AF_INET) {
+			XferSetError(interp, "No IPv4 nameserver configured",
+					"NONAMESERVER");
+			return TCL_ERROR;
+		}
+		*addrPtr = statePtr->nsaddr_list[0];
+		return TCL_OK;
+	}
+
+	memset(addrPtr, 0, sizeof(*addrPtr));
+	addrPtr->sin_family = AF_INET;
+	addrPtr->sin_port   = htons(NAMESERVER_PORT);
+	if (inet_pton(AF_INET, Tcl_GetString(serverObj),
+				&addrPtr->sin_addr) != 1) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "Invalid nameserver address \"",
+				Tcl_GetString(serverObj), "\"", NULL);
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+/* Waits for the socket to become ready for the given events */
+static int
+XferWait (
+	Tcl_Interp *interp,
+	const int fd,
+	const short events,
+	const int timeout
+	)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd     = fd;
+	pfd.events = events;
+
+	do {
+		n = poll(&pfd, 1, timeout);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1) {
+		XferSetPosixError(interp, errno);
+		return TCL_ERROR;
+	}
+	if (n == 0) {
+		XferSetError(interp, "Zone transfer timed out", "TIMEOUT");
+		return TCL_ERROR;
+	}
+
+	return TCL_OK;
+}
+
+static int
+XferConnect (
+	Tcl_Interp *interp,
+	const struct sockaddr_in *addrPtr,
+	const int timeout,
+	int *fdPtr
+	)
+{
+	int fd, err;
+	socklen_t errlen;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		XferSetPosixError(interp, errno);
+		return TCL_ERROR;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	err = 0;
+	if (connect(fd, (const struct sockaddr *) addrPtr,
+				sizeof(struct sockaddr_in)) == -1) {
+		if (errno != EINPROGRESS) {
+			err = errno;
+		} else if (XferWait(interp, fd, POLLOUT, timeout) != TCL_OK) {
+			close(fd);
+			return TCL_ERROR;
+		} else {
+			errlen = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
+				err = errno;
+			}
+		}
+	}
+
+	if (err != 0) {
+		close(fd);
+		XferSetPosixError(interp, err);
+		Tcl_SetErrorCode(interp, "SYSDNS", "CONNFAILED", NULL);
+		return TCL_ERROR;
+	}
+
+	*fdPtr = fd;
+	return TCL_OK;
+}
+
+static int
+XferWrite (
+	Tcl_Interp *interp,
+	const int fd,
+	const unsigned char buf[],
+	const int len,
+	const int timeout
+	)
+{
+	int done, n;
+
+	for (done = 0; done < len; done += n) {
+		if (XferWait(interp, fd, POLLOUT, timeout) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		n = write(fd, buf + done, len - done);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			XferSetPosixError(interp, errno);
+			return TCL_ERROR;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/* Reads exactly len bytes */
+static int
+XferRead (
+	Tcl_Interp *interp,
+	const int fd,
+	unsigned char buf[],
+	const int len,
+	const int timeout
+	)
+{
+	int done, n;
+
+	for (done = 0; done < len; done += n) {
+		if (XferWait(interp, fd, POLLIN, timeout) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		n = read(fd, buf + done, len - done);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			XferSetPosixError(interp, errno);
+			return TCL_ERROR;
+		}
+		if (n == 0) {
+			XferSetError(interp, "Nameserver closed the connection "
+					"before the end of the zone", "CONNCLOSED");
+			return TCL_ERROR;
+		}
+	}
+
+	return TCL_OK;
+}
+
+static int
+XferCheckReply (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int len
+	)
+{
+	if (len < HFIXEDSZ) {
+		XferSetPosixError(interp, EBADMSG);
+		return TCL_ERROR;
+	}
+
+	switch (msg[3] & 0x0f) {
+		case NOERROR:
+			return TCL_OK;
+		case FORMERR:
+			XferSetError(interp, "Nameserver could not interpret "
+					"the query", "FORMERR");
+			break;
+		case SERVFAIL:
+			XferSetError(interp, "Nameserver failure", "SERVFAIL");
+			break;
+		case NXDOMAIN:
+			XferSetError(interp, "No such zone", "NXDOMAIN");
+			break;
+		case NOTIMP:
+			XferSetError(interp, "Nameserver does not support "
+					"the query", "NOTIMP");
+			break;
+		case REFUSED:
+			XferSetError(interp, "Nameserver refused the zone transfer",
+					"REFUSED");
+			break;
+		default:
+			XferSetError(interp, "Unexpected response code "
+					"from nameserver", "BADRCODE");
+			break;
+	}
+
+	return TCL_ERROR;
+}
+
+/* Transfers the zone (qtype being AXFR, or IXFR asking for the changes
+ * since the serial) from the nameserver, handing the records of the
+ * reply to proc as they arrive. Returns what DNSTransferMessage does
+ * for the last message read. */
+int
+DNSTransfer (
+	Tcl_Interp *interp,
+	struct __res_state *statePtr,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	DNSTransferState state;
+	struct sockaddr_in addr;
+	unsigned char query[NS_INT16SZ + XFER_MAXQUERY], *msg;
+	int fd, len, timeout, res;
+
+	if (XferGetServer(interp, statePtr, serverObj, &addr) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	len = XferMakeQuery(statePtr, Tcl_GetString(zoneObj),
+			qclass, qtype, serial, query + NS_INT16SZ);
+	if (len == -1) {
+		Tcl_ResetResult(interp);
+		Tcl_AppendResult(interp, "Invalid zone name \"",
+				Tcl_GetString(zoneObj), "\"", NULL);
+		return TCL_ERROR;
+	}
+	query[0] = len >> 8;
+	query[1] = len & 0xff;
+
+	memset(&state, 0, sizeof(state));
+	state.id          = (query[2] << 8) | query[3];
+	state.incremental = qtype == SYSDNS_TYPE_IXFR;
+	state.reqserial   = serial;
+
+	timeout = (statePtr->retrans > 0 ? statePtr->retrans : RES_TIMEOUT) * 1000;
+
+	if (XferConnect(interp, &addr, timeout, &fd) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	msg = (unsigned char *) ckalloc(XFER_MSGSIZE);
+
+	res = XferWrite(interp, fd, query, NS_INT16SZ + len, timeout);
+	while (res == TCL_OK && ! state.done) {
+		res = XferRead(interp, fd, msg, NS_INT16SZ, timeout);
+		if (res != TCL_OK) {
+			break;
+		}
+		len = (msg[0] << 8) | msg[1];
+
+		res = XferRead(interp, fd, msg, len, timeout);
+		if (res == TCL_OK) {
+			res = XferCheckReply(interp, msg, len);
+		}
+		if (res == TCL_OK) {
+			res = DNSTransferMessage(interp, msg, len, resflags,
+					&state, proc, clientData);
+		}
+	}
+
+	ckfree((char *) msg);
+	close(fd);
+
+	return res;
+}
@@ -0,0 +1,22 @@
+/*
+ * xfer.h --
+ *   Interface to the xfer.c module.
+ *
+ * $Id$
+ */
+
+#include <tcl.h>
+#include <resolv.h>
+
+int
+DNSTransfer (
+	Tcl_Interp *interp,
+	struct __res_state *statePtr,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData);
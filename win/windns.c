@@ -180,6 +180,7 @@ Impl_GetBackendInfo (
 			DBC_NOCACHE | DBC_NOWIRE |
 			DBC_SEARCH);
 	binfo->qtypes = SupportedQTypes;
+	binfo->features = 0;
 }
 
 int
@@ -430,7 +431,7 @@ DNSParseQuestion (
 {
 	Tcl_Obj *dataObj;
 
-	dataObj = Tcl_NewListObj(0, NULL);
+	dataObj = DNSFormatNewRecord(resflags);
 	DNSFormatQuestion(interp, resflags, dataObj,
 			rr->pName,
 			rr->wType,
@@ -451,16 +452,16 @@ DNSParseRRSection (
 	DNSParseRRData(interp, rr, resflags, &dataObj);
 
 	if (resflags & RES_DETAIL) {
-		Tcl_Obj *sectObj = Tcl_NewListObj(0, NULL);
+		Tcl_Obj *sectObj = DNSFormatNewRecord(resflags);
 
 		DNSFormatRRHeader(interp, resflags, sectObj,
 				rr->pName,
 				rr->wType,
 				DNS_CLASS_INTERNET,
 				rr->dwTtl,
-				rr->wDataLength);
+				rr->wDataLength,
+				dataObj);
 
-		Tcl_ListObjAppendElement(interp, sectObj, dataObj);
 		Tcl_ListObjAppendElement(interp, resObj, sectObj);
 	} else {
 		Tcl_ListObjAppendElement(interp, resObj, dataObj);
@@ -474,11 +475,13 @@ Impl_Resolve (
 	Tcl_Obj *queryObj,
 	const unsigned short qclass,
 	const unsigned short qtype,
-	const unsigned int resflags
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
 	)
 {
 	InterpData *interpData;
 	DNS_STATUS res;
+	int nanswers;
 	PDNS_RECORD recPtr, sectPtr;
 	Tcl_Obj *questObj, *answObj, *authObj, *addObj;
 	Tcl_Obj *resObj;
@@ -497,6 +500,10 @@ Impl_Resolve (
 			|| res == DNS_INFO_NO_RECORDS
 			|| (res == DNS_ERROR_RECORD_DOES_NOT_EXIST
 				&& interpData->res_opts & DNS_QUERY_CACHE_ONLY)) {
+		/* DnsQuery doesn't tell the negative caching TTL,
+		 * it caches negative answers by itself anyway */
+		infoPtr->status = res == DNS_ERROR_RCODE_NAME_ERROR
+			? RESOLVE_NXDOMAIN : RESOLVE_NODATA;
 		Tcl_ResetResult(interp);
 		return TCL_OK;
 	} else if (res != ERROR_SUCCESS) {
@@ -520,6 +527,7 @@ Impl_Resolve (
 		addObj   = Tcl_NewListObj(0, NULL);
 	}
 
+	nanswers = 0;
 	sectPtr = recPtr;
 	while (sectPtr != NULL) {
 		switch (sectPtr->Flags.S.Section) {
@@ -529,6 +537,10 @@ Impl_Resolve (
 				}
 				break;
 			case DNSREC_ANSWER:
+				if (nanswers == 0 || sectPtr->dwTtl < infoPtr->ttl) {
+					infoPtr->ttl = sectPtr->dwTtl;
+				}
+				++nanswers;
 				if (resflags & RES_ANSWER) {
 					DNSParseRRSection(interp, sectPtr, resflags, answObj);
 				}
@@ -557,59 +569,26 @@ Impl_Resolve (
 			int len;
 			Tcl_ListObjLength(interp, questObj, &len);
 			if (len == 0) {
-				DNSFormatFakeQuestion(interp, resflags, questObj,
+				DNSFormatFakeQuestion(interp, resflags, resObj,
 						Tcl_GetStringFromObj(queryObj, NULL),
 						qtype, DNS_CLASS_INTERNET);
-				Tcl_ListObjAppendList(interp, resObj, questObj);
 				Tcl_DecrRefCount(questObj);
 			} else {
-				if (resflags & RES_SECTNAMES) {
-					Tcl_ListObjAppendElement(interp, resObj,
-							Tcl_NewStringObj("question", -1));
-				}
-				if (resflags & RES_WANTLIST) {
-					Tcl_ListObjAppendElement(interp, resObj, questObj);
-				} else {
-					Tcl_ListObjAppendList(interp, resObj, questObj);
-					Tcl_DecrRefCount(questObj);
-				}
+				DNSFormatSectionObj(interp, resflags, resObj,
+						"question", questObj);
 			}
 		}
 		if (resflags & RES_ANSWER) {
-			if (resflags & RES_SECTNAMES) {
-				Tcl_ListObjAppendElement(interp, resObj,
-						Tcl_NewStringObj("answer", -1));
-			}
-			if (resflags & RES_WANTLIST) {
-				Tcl_ListObjAppendElement(interp, resObj, answObj);
-			} else {
-				Tcl_ListObjAppendList(interp, resObj, answObj);
-				Tcl_DecrRefCount(answObj);
-			}
+			DNSFormatSectionObj(interp, resflags, resObj,
+					"answer", answObj);
 		}
 		if (resflags & RES_AUTH) {
-			if (resflags & RES_SECTNAMES) {
-				Tcl_ListObjAppendElement(interp, resObj,
-						Tcl_NewStringObj("authority", -1));
-			}
-			if (resflags & RES_WANTLIST) {
-				Tcl_ListObjAppendElement(interp, resObj, authObj);
-			} else {
-				Tcl_ListObjAppendList(interp, resObj, authObj);
-				Tcl_DecrRefCount(authObj);
-			}
+			DNSFormatSectionObj(interp, resflags, resObj,
+					"authority", authObj);
 		}
 		if (resflags & RES_ADD) {
-			if (resflags & RES_SECTNAMES) {
-				Tcl_ListObjAppendElement(interp, resObj,
-						Tcl_NewStringObj("additional", -1));
-			}
-			if (resflags & RES_WANTLIST) {
-				Tcl_ListObjAppendElement(interp, resObj, addObj);
-			} else {
-				Tcl_ListObjAppendList(interp, resObj, addObj);
-				Tcl_DecrRefCount(addObj);
-			}
+			DNSFormatSectionObj(interp, resflags, resObj,
+					"additional", addObj);
 		}
 	} while (0);
 
@@ -617,6 +596,142 @@ Impl_Resolve (
 	return TCL_OK;
 }
 
+int
+Impl_ResolveAsync (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj
+	)
+{
+	/* Never reached -- outer code checks for the BF_ASYNC feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ResolveBatch (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	BatchQuery *queries[],
+	const int nqueries,
+	const unsigned int resflags,
+	const int concurrency,
+	BatchStats *statsPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_BATCH feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_PrepareQuery (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *queryObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	ClientData *preparedPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ResolvePrepared (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	ClientData prepared,
+	const unsigned int resflags,
+	Tcl_Obj *cmdObj,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+	return TCL_ERROR;
+}
+
+void
+Impl_FreePreparedQuery (
+	ClientData prepared
+	)
+{
+	/* Never reached -- outer code checks for the BF_PREPARE feature */
+}
+
+int
+Impl_ParseMessage (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	ResolveInfo *infoPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_ParseMessageRRs (
+	Tcl_Interp *interp,
+	const unsigned char msg[],
+	const int msglen,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData clientData
+	)
+{
+	/* Never reached -- outer code checks for the BF_PARSE feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_Transfer (
+	ClientData clientData,
+	Tcl_Interp *interp,
+	Tcl_Obj *zoneObj,
+	Tcl_Obj *serverObj,
+	const unsigned short qclass,
+	const unsigned short qtype,
+	const unsigned long serial,
+	const unsigned int resflags,
+	Sysdns_RRProc *proc,
+	ClientData procData
+	)
+{
+	/* Never reached -- outer code checks for the BF_XFER feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_CountLazyRRs (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	int *countPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
+}
+
+int
+Impl_GetLazyRR (
+	Tcl_Interp *interp,
+	Tcl_Obj *resObj,
+	const int section,
+	const int index,
+	Tcl_Obj **rrObjPtr
+	)
+{
+	/* Never reached -- outer code checks for the BF_LAZY feature */
+	return TCL_ERROR;
+}
+
 int
 Impl_Reinit (
 	ClientData clientData,